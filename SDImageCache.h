@@ -8,6 +8,7 @@
 
 #import <Foundation/Foundation.h>
 #import "SDWebImageCompat.h"
+#import "SDImageFormat.h"
 
 typedef NS_ENUM(NSInteger, SDImageCacheType) {
     /**
@@ -49,6 +50,161 @@ typedef void(^SDWebImageCheckCacheCompletionBlock)(BOOL isInCache);
  */
 typedef void(^SDWebImageCalculateSizeBlock)(NSUInteger fileCount, NSUInteger totalSize);
 
+/**
+ *  批量查询时每个 key 查询完成后的回调 block
+ *
+ *  @param index     key 在查询数组中的下标
+ *  @param image     获取到的图片
+ *  @param cacheType 获取图片的方式
+ */
+typedef void(^SDWebImageBatchQueryCompletedBlock)(NSUInteger index, UIImage *image, SDImageCacheType cacheType);
+
+@class SDImageCacheMetadata;
+@class SDImageCacheValidators;
+
+/**
+ *  查询 disk 缓存中图片元数据的回调
+ *
+ *  @param metadata 图片的元数据，没有缓存时为 nil
+ */
+typedef void(^SDWebImageQueryMetadataCompletedBlock)(SDImageCacheMetadata *metadata);
+
+/**
+ *  查询 disk 缓存中 HTTP 校验值的回调
+ *
+ *  @param validators 保存的校验值，没有缓存或者没有保存过时为 nil
+ */
+typedef void(^SDWebImageQueryValidatorsCompletedBlock)(SDImageCacheValidators *validators);
+
+
+
+/**
+ *  将下载中的数据边接收边写入 disk 缓存
+ *  数据先写到缓存文件夹中的临时文件，commit 时原子地重命名为 key 对应的缓存文件，discard 时删除临时文件
+ *  可以在任意线程调用
+ */
+@interface SDImageCacheFileWriter : NSObject
+
+/**
+ *  缓存图片的 key
+ */
+@property (copy, nonatomic, readonly) NSString *key;
+
+/**
+ *  是否已经提交到 disk 缓存中
+ */
+@property (assign, nonatomic, readonly, getter = isCommitted) BOOL committed;
+
+/**
+ *  下载响应中的 HTTP 校验值，commit 时和缓存文件一起保存
+ */
+@property (strong, nonatomic) SDImageCacheValidators *validators;
+
+/**
+ *  写入接收到的数据，第一次写入时才会创建临时文件
+ *
+ *  @return 写入失败或者已经 commit/discard 过时返回 NO
+ */
+- (BOOL)appendData:(NSData *)data;
+
+/**
+ *  将临时文件提交为 key 对应的缓存文件
+ *
+ *  @return 提交成功返回 YES
+ */
+- (BOOL)commit;
+
+/**
+ *  放弃已经写入的数据，删除临时文件
+ */
+- (void)discard;
+
+@end
+
+
+
+/**
+ *  disk 缓存中一张图片的元数据，写入缓存时从文件头解析出来，作为扩展属性 (xattr) 和缓存文件保存在一起
+ *  查询元数据只读取扩展属性，不会读取和解码像素数据，可以用于图片加载之前的布局
+ */
+@interface SDImageCacheMetadata : NSObject
+
+/**
+ *  图片的像素宽高 (第一帧，方向处理之前)
+ */
+@property (assign, nonatomic, readonly) NSUInteger pixelWidth;
+@property (assign, nonatomic, readonly) NSUInteger pixelHeight;
+
+/**
+ *  从 EXIF 中读出的图片方向
+ */
+@property (assign, nonatomic, readonly) UIImageOrientation orientation;
+
+/**
+ *  图片格式
+ */
+@property (assign, nonatomic, readonly) SDImageFormat format;
+
+/**
+ *  帧数，动图大于 1
+ */
+@property (assign, nonatomic, readonly) NSUInteger frameCount;
+
+/**
+ *  缓存文件的大小 (in bytes)
+ */
+@property (assign, nonatomic, readonly) unsigned long long byteSize;
+
+/**
+ *  按方向显示之后的像素大小，方向是 Left/Right 时宽高交换
+ */
+@property (assign, nonatomic, readonly) CGSize orientedPixelSize;
+
+@end
+
+
+
+/**
+ *  disk 缓存中一张图片对应的 HTTP 校验值和过期时间，从下载的响应中取出，作为扩展属性 (xattr) 和缓存文件保存在一起
+ *  刷新缓存时用来发送条件请求 (If-None-Match / If-Modified-Since)，不需要 NSURLCache 再保存一份响应数据
+ */
+@interface SDImageCacheValidators : NSObject
+
+/**
+ *  响应的 ETag 和 Last-Modified，没有时为 nil
+ */
+@property (copy, nonatomic, readonly) NSString *ETag;
+@property (copy, nonatomic, readonly) NSString *lastModified;
+
+/**
+ *  按 Cache-Control (max-age、no-cache、no-store) 和 Expires 算出的过期时间，响应没有给出时为 nil
+ */
+@property (strong, nonatomic, readonly) NSDate *expirationDate;
+
+/**
+ *  有 ETag 或 Last-Modified，可以发送条件请求
+ */
+@property (assign, nonatomic, readonly) BOOL canRevalidate;
+
+/**
+ *  还没有过期，没有过期时间时当作已经过期
+ */
+@property (assign, nonatomic, readonly, getter = isFresh) BOOL fresh;
+
+- (id)initWithETag:(NSString *)ETag lastModified:(NSString *)lastModified expirationDate:(NSDate *)expirationDate;
+
+/**
+ *  从 HTTP 响应中取出校验值和过期时间，不是 HTTP 响应时返回 nil
+ */
++ (SDImageCacheValidators *)validatorsWithResponse:(NSURLResponse *)response;
+
+/**
+ *  收到 304 之后更新：响应中带有的校验值和过期时间替换原来的，没有带的保留原来的
+ */
+- (SDImageCacheValidators *)validatorsByUpdatingWithResponse:(NSURLResponse *)response;
+
+@end
+
 
 
 /**
@@ -63,6 +219,18 @@ typedef void(^SDWebImageCalculateSizeBlock)(NSUInteger fileCount, NSUInteger tot
  */
 @property (assign, nonatomic) BOOL shouldDecompressImages;
 
+/**
+ *  多帧的动图是否解码成 SDWebImageAnimatedImage (按需解码每一帧)，而不是一次解码出所有帧，默认是 NO
+ *  打开之后动图的 images 为 nil，需要由播放的一方逐帧获取
+ */
+@property (assign, nonatomic) BOOL shouldDecodeAnimatedImagesLazily;
+
+/**
+ *  解码时是否把 EXIF 方向应用到像素上，默认是 NO
+ *  打开之后内存缓存中的图片方向都是 Up，绘制时不需要再旋转，旋转只在解码线程中做一次
+ */
+@property (assign, nonatomic) BOOL shouldBakeImageOrientation;
+
 /**
  *  默认是 YES
  */
@@ -93,6 +261,14 @@ typedef void(^SDWebImageCalculateSizeBlock)(NSUInteger fileCount, NSUInteger tot
  */
 @property (assign, nonatomic) NSUInteger maxCacheSize;
 
+/**
+ *  disk 查询实际读取文件的次数、解码的次数，以及加入相同 key 正在进行的查询 (不再读取和解码) 的次数
+ *  相同 key 的并发查询共用一次读取和一次解码，可以用这几个计数确认
+ */
+@property (assign, nonatomic, readonly) NSUInteger diskQueryReadCount;
+@property (assign, nonatomic, readonly) NSUInteger diskQueryDecodeCount;
+@property (assign, nonatomic, readonly) NSUInteger joinedDiskQueryCount;
+
 
 /**
  *  获得 SDImageCache 单例
@@ -158,8 +334,27 @@ typedef void(^SDWebImageCalculateSizeBlock)(NSUInteger fileCount, NSUInteger tot
  */
 - (void)storeImage:(UIImage *)image recalculateFromImage:(BOOL)recalculate imageData:(NSData *)imageData forKey:(NSString *)key toDisk:(BOOL)toDisk;
 
+/**
+ *  缓存按 targetPixelSize 缩小解码的图片
+ *  memory 缓存中按 key + targetPixelSize 区分不同大小的图片，disk 缓存中只保存原始数据
+ *  缩小过的图片不会重新编码写入 disk，避免覆盖原图，只有 imageData 会写入 disk
+ *
+ *  @param targetPixelSize 图片解码时的目标像素大小，CGSizeZero 表示原图
+ */
+- (void)storeImage:(UIImage *)image recalculateFromImage:(BOOL)recalculate imageData:(NSData *)imageData forKey:(NSString *)key targetPixelSize:(CGSize)targetPixelSize toDisk:(BOOL)toDisk;
+
+/**
+ *  为 key 生成一个边下载边写入 disk 缓存的 writer
+ *
+ *  @param key 缓存图片的 key
+ *
+ *  @return 写入 disk 缓存的 writer
+ */
+- (SDImageCacheFileWriter *)fileWriterForKey:(NSString *)key;
+
 /**
  *  用一个 key 异步查询 disk 缓存
+ *  相同 key 的查询同时进行时只读取和解码一次，所有的查询共用结果；取消只影响自己的回调，所有查询都取消后才停止解码
  *
  *  @param key       要查询图片的 key
  *  @param doneBlock 查询完成之后回调的 block
@@ -168,11 +363,37 @@ typedef void(^SDWebImageCalculateSizeBlock)(NSUInteger fileCount, NSUInteger tot
  */
 - (NSOperation *)queryDiskCacheForKey:(NSString *)key done:(SDWebImageQueryCompletedBlock)doneBlock;
 
+/**
+ *  异步查询缩小到 targetPixelSize 的图片
+ *  先查 memory 中这个大小的图片，没有的话读取 disk 中的原始数据直接缩小解码，不会解码出原图大小的位图
+ *
+ *  @param targetPixelSize 目标像素大小，CGSizeZero 表示原图
+ */
+- (NSOperation *)queryDiskCacheForKey:(NSString *)key targetPixelSize:(CGSize)targetPixelSize done:(SDWebImageQueryCompletedBlock)doneBlock;
+
+/**
+ *  批量异步查询多个 key
+ *  memory 缓存在调用线程中一次查完，命中的 key 马上回调；没有命中的 key 在 ioQueue 中一次读取，解码之后在主线程回调
+ *  和单个查询一样，相同 key 正在进行的查询会被共用
+ *
+ *  @param keys             要查询图片的 key
+ *  @param targetPixelSizes 和 keys 一一对应的目标像素大小 (NSValue)，为 nil 或者 NSNull 时表示原图
+ *  @param doneBlock        每个 key 查询完成之后回调的 block
+ *
+ *  @return 这一批查询共用的 operation，取消之后所有还没有完成的 key 都不再回调
+ */
+- (NSOperation *)queryDiskCacheForKeys:(NSArray *)keys targetPixelSizes:(NSArray *)targetPixelSizes done:(SDWebImageBatchQueryCompletedBlock)doneBlock;
+
 /**
  *  异步查询 memory 缓存中的图片
  */
 - (UIImage *)imageFromMemoryCacheForKey:(NSString *)key;
 
+/**
+ *  查询 memory 缓存中缩小到 targetPixelSize 的图片
+ */
+- (UIImage *)imageFromMemoryCacheForKey:(NSString *)key targetPixelSize:(CGSize)targetPixelSize;
+
 /**
  *  异步查询 disk 缓存中的图片
  */
@@ -264,6 +485,39 @@ typedef void(^SDWebImageCalculateSizeBlock)(NSUInteger fileCount, NSUInteger tot
  */
 - (BOOL)diskImageExistsWithKey:(NSString *)key;
 
+/**
+ *  同步查询 disk 缓存中图片的元数据 (大小、方向、格式、帧数)，只读取缓存文件的扩展属性，不读取像素数据
+ *  之前版本缓存的文件没有元数据时，只解析一次文件头并补写扩展属性
+ *
+ *  @return 没有缓存时返回 nil
+ */
+- (SDImageCacheMetadata *)metadataForKey:(NSString *)key;
+
+/**
+ *  异步查询图片的元数据，完成后在主线程调用 completionBlock
+ */
+- (void)queryMetadataForKey:(NSString *)key completion:(SDWebImageQueryMetadataCompletedBlock)completionBlock;
+
+/**
+ *  同步读取 disk 缓存中 key 对应的 HTTP 校验值，只读取缓存文件的扩展属性
+ *
+ *  @return 没有缓存或者没有保存过校验值时返回 nil
+ */
+- (SDImageCacheValidators *)validatorsForKey:(NSString *)key;
+
+/**
+ *  在 ioQueue 中读取校验值，完成后在主线程调用 completionBlock
+ *  读取扩展属性是一次系统调用，在主线程中需要校验值时使用这个方法
+ */
+- (void)queryValidatorsForKey:(NSString *)key completion:(SDWebImageQueryValidatorsCompletedBlock)completionBlock;
+
+/**
+ *  把 HTTP 校验值保存到 key 对应的缓存文件上，在 ioQueue 中异步执行，排在之前提交的写入之后
+ *  同时更新缓存文件的修改时间，清理过期缓存时从这次保存开始计算 maxCacheAge
+ *  缓存文件不存在 (例如只缓存在 memory 中) 时什么也不做；缓存文件被重新写入时校验值会一起被清除
+ */
+- (void)storeValidators:(SDImageCacheValidators *)validators forKey:(NSString *)key;
+
 /**
  *  在给定的根文件夹下通过 key 查询图片缓存路径
  *
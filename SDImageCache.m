@@ -9,7 +9,17 @@
 #import "SDImageCache.h"
 #import "SDWebImageDecoder.h"
 #import "UIImage+MultiFormat.h"
-#import <CommonCrypto/CommonDigest.h>
+#import "SDWebImageIncrementalDecoder.h"
+#import "SDWebImageDecodeScheduler.h"
+#import "SDWebImageAnimatedImage.h"
+#import "SDImageFormat.h"
+#import "SDWebImageCacheKey.h"
+#import "SDWebImageTracer.h"
+#import <ImageIO/ImageIO.h>
+#import <fcntl.h>
+#import <unistd.h>
+#import <sys/stat.h>
+#import <sys/xattr.h>
 
 // See https://github.com/rs/SDWebImage/pull/1141 for discussion
 // 自动清除 memory 缓存，监听内存警告通知
@@ -33,28 +43,458 @@
 
 @end
 
+// 元数据保存在缓存文件的这个扩展属性中
+static const char *kMetadataAttributeName = "com.hackemist.SDWebImageCache.metadata";
+static const uint32_t kMetadataRecordVersion = 1;
+
+// 扩展属性中保存的定长记录，版本不一致时当作没有元数据
+typedef struct {
+    uint32_t version;
+    uint32_t pixelWidth;
+    uint32_t pixelHeight;
+    int32_t orientation;
+    int32_t format;
+    uint32_t frameCount;
+    uint64_t byteSize;
+} SDImageCacheMetadataRecord;
+
+// 记录原样写入扩展属性，不同架构 (arm64、armv7、模拟器) 写入的布局必须一致，改动字段时要升级 kMetadataRecordVersion
+_Static_assert(sizeof(SDImageCacheMetadataRecord) == 32 && offsetof(SDImageCacheMetadataRecord, byteSize) == 24, "SDImageCacheMetadataRecord layout changed");
+
+@interface SDImageCacheMetadata ()
+
+- (id)initWithRecord:(SDImageCacheMetadataRecord)record;
+
+- (SDImageCacheMetadataRecord)record;
+
+@end
+
+@implementation SDImageCacheMetadata
+
+- (id)initWithRecord:(SDImageCacheMetadataRecord)record {
+    if ((self = [super init])) {
+        _pixelWidth = record.pixelWidth;
+        _pixelHeight = record.pixelHeight;
+        _orientation = (UIImageOrientation)record.orientation;
+        _format = (SDImageFormat)record.format;
+        _frameCount = record.frameCount;
+        _byteSize = record.byteSize;
+    }
+    return self;
+}
+
+- (SDImageCacheMetadataRecord)record {
+    SDImageCacheMetadataRecord record = {0};
+    record.version = kMetadataRecordVersion;
+    record.pixelWidth = (uint32_t)self.pixelWidth;
+    record.pixelHeight = (uint32_t)self.pixelHeight;
+    record.orientation = (int32_t)self.orientation;
+    record.format = (int32_t)self.format;
+    record.frameCount = (uint32_t)self.frameCount;
+    record.byteSize = self.byteSize;
+    return record;
+}
+
+- (CGSize)orientedPixelSize {
+    switch (self.orientation) {
+        case UIImageOrientationLeft:
+        case UIImageOrientationRight:
+        case UIImageOrientationLeftMirrored:
+        case UIImageOrientationRightMirrored:
+            return CGSizeMake(self.pixelHeight, self.pixelWidth);
+        default:
+            return CGSizeMake(self.pixelWidth, self.pixelHeight);
+    }
+}
+
+@end
+
 /**
- *  默认的存储时间（一周）
+ *  从 image source 解析元数据，CGImageSource 只解析文件头，不会解码像素
+ *
+ *  @param header   数据开头的字节，用来识别格式
+ *  @param byteSize 数据的总大小
  */
-static const NSInteger kDefaultCacheMaxCacheAge = 60 * 60 * 24 * 7; // 1 week
-// PNG signature bytes and data (below)
-static unsigned char kPNGSignatureBytes[8] = {0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A};
-static NSData *kPNGSignatureData = nil;
+static SDImageCacheMetadata *SDMetadataFromImageSource(CGImageSourceRef source, const void *header, NSUInteger headerLength, unsigned long long byteSize) {
+    if (!source) {
+        return nil;
+    }
+    size_t frameCount = CGImageSourceGetCount(source);
+    NSDictionary *properties = frameCount > 0 ? (__bridge_transfer NSDictionary *)CGImageSourceCopyPropertiesAtIndex(source, 0, NULL) : nil;
+    NSNumber *width = properties[(__bridge NSString *)kCGImagePropertyPixelWidth];
+    NSNumber *height = properties[(__bridge NSString *)kCGImagePropertyPixelHeight];
+    if (!width || !height) {
+        return nil;
+    }
+    NSNumber *orientation = properties[(__bridge NSString *)kCGImagePropertyOrientation];
+
+    SDImageCacheMetadataRecord record = {0};
+    record.version = kMetadataRecordVersion;
+    record.pixelWidth = [width unsignedIntValue];
+    record.pixelHeight = [height unsignedIntValue];
+    record.orientation = (int32_t)[SDWebImageIncrementalDecoder orientationFromPropertyValue:(orientation ? [orientation integerValue] : 1)];
+    record.format = (int32_t)SDImageFormatForBytes(header, headerLength);
+    record.frameCount = (uint32_t)frameCount;
+    record.byteSize = byteSize;
+    return [[SDImageCacheMetadata alloc] initWithRecord:record];
+}
+
+static SDImageCacheMetadata *SDMetadataForData(NSData *data) {
+    if (!data) {
+        return nil;
+    }
+    CGImageSourceRef source = CGImageSourceCreateWithData((__bridge CFDataRef)data, NULL);
+    SDImageCacheMetadata *metadata = SDMetadataFromImageSource(source, data.bytes, MIN(data.length, SDImageFormatHeaderLength), data.length);
+    if (source) {
+        CFRelease(source);
+    }
+    return metadata;
+}
+
+// 从缓存文件解析元数据，只读取文件头
+static SDImageCacheMetadata *SDMetadataForFileAtPath(NSString *path) {
+    int fd = open([path fileSystemRepresentation], O_RDONLY);
+    if (fd < 0) {
+        return nil;
+    }
+    struct stat fileStat;
+    uint8_t header[32];
+    ssize_t headerLength = -1;
+    if (fstat(fd, &fileStat) == 0) {
+        headerLength = read(fd, header, MIN(sizeof(header), SDImageFormatHeaderLength));
+    }
+    close(fd);
+    if (headerLength < 0) {
+        return nil;
+    }
+
+    CGImageSourceRef source = CGImageSourceCreateWithURL((__bridge CFURLRef)[NSURL fileURLWithPath:path], NULL);
+    SDImageCacheMetadata *metadata = SDMetadataFromImageSource(source, header, headerLength, fileStat.st_size);
+    if (source) {
+        CFRelease(source);
+    }
+    return metadata;
+}
+
+static BOOL SDWriteMetadataAttribute(NSString *path, SDImageCacheMetadata *metadata) {
+    if (!metadata) {
+        return NO;
+    }
+    SDImageCacheMetadataRecord record = [metadata record];
+    return setxattr([path fileSystemRepresentation], kMetadataAttributeName, &record, sizeof(record), 0, 0) == 0;
+}
+
+static SDImageCacheMetadata *SDReadMetadataAttribute(NSString *path) {
+    SDImageCacheMetadataRecord record;
+    ssize_t length = getxattr([path fileSystemRepresentation], kMetadataAttributeName, &record, sizeof(record), 0, 0);
+    if (length != sizeof(record) || record.version != kMetadataRecordVersion) {
+        return nil;
+    }
+    return [[SDImageCacheMetadata alloc] initWithRecord:record];
+}
+
+// HTTP 校验值保存在缓存文件的这个扩展属性中，内容是一个二进制 plist
+static const char *kValidatorsAttributeName = "com.hackemist.SDWebImageCache.validators";
+static NSString *const kValidatorsETagKey = @"etag";
+static NSString *const kValidatorsLastModifiedKey = @"last-modified";
+static NSString *const kValidatorsExpirationKey = @"expiration";
+
+// 解析 Expires 使用的 RFC 1123 日期格式，NSDateFormatter 创建很慢，共用一个并加锁
+static NSDate *SDDateFromHTTPDateString(NSString *string) {
+    if (!string) {
+        return nil;
+    }
+    static NSDateFormatter *formatter;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        formatter = [NSDateFormatter new];
+        formatter.locale = [[NSLocale alloc] initWithLocaleIdentifier:@"en_US_POSIX"];
+        formatter.timeZone = [NSTimeZone timeZoneWithAbbreviation:@"GMT"];
+        formatter.dateFormat = @"EEE, dd MMM yyyy HH:mm:ss zzz";
+    });
+    @synchronized (formatter) {
+        return [formatter dateFromString:string];
+    }
+}
+
+// 按 Cache-Control 和 Expires 算出过期时间，两者都没有时返回 nil
+static NSDate *SDExpirationDateFromHeaders(NSDictionary *headers) {
+    NSString *cacheControl = [headers[@"Cache-Control"] lowercaseString];
+    if (cacheControl) {
+        for (NSString *component in [cacheControl componentsSeparatedByString:@","]) {
+            NSString *directive = [component stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]];
+            if ([directive isEqualToString:@"no-cache"] || [directive isEqualToString:@"no-store"]) {
+                // 每次使用之前都要重新验证
+                return [NSDate date];
+            }
+            if ([directive hasPrefix:@"max-age="]) {
+                NSTimeInterval maxAge = [[directive substringFromIndex:8] doubleValue];
+                // 响应在中间的缓存中已经存放的时间
+                NSTimeInterval age = [headers[@"Age"] doubleValue];
+                return [NSDate dateWithTimeIntervalSinceNow:MAX(0, maxAge - age)];
+            }
+        }
+    }
+    return SDDateFromHTTPDateString(headers[@"Expires"]);
+}
+
+@implementation SDImageCacheValidators
+
+- (id)initWithETag:(NSString *)ETag lastModified:(NSString *)lastModified expirationDate:(NSDate *)expirationDate {
+    if ((self = [super init])) {
+        _ETag = [ETag copy];
+        _lastModified = [lastModified copy];
+        _expirationDate = expirationDate;
+    }
+    return self;
+}
+
++ (SDImageCacheValidators *)validatorsWithResponse:(NSURLResponse *)response {
+    if (![response isKindOfClass:[NSHTTPURLResponse class]]) {
+        return nil;
+    }
+    NSDictionary *headers = [(NSHTTPURLResponse *)response allHeaderFields];
+    return [[self alloc] initWithETag:headers[@"ETag"] lastModified:headers[@"Last-Modified"] expirationDate:SDExpirationDateFromHeaders(headers)];
+}
+
+- (SDImageCacheValidators *)validatorsByUpdatingWithResponse:(NSURLResponse *)response {
+    SDImageCacheValidators *updated = [SDImageCacheValidators validatorsWithResponse:response];
+    if (!updated) {
+        return self;
+    }
+    return [[SDImageCacheValidators alloc] initWithETag:(updated.ETag ?: self.ETag)
+                                           lastModified:(updated.lastModified ?: self.lastModified)
+                                         expirationDate:(updated.expirationDate ?: self.expirationDate)];
+}
+
+- (BOOL)canRevalidate {
+    return self.ETag.length > 0 || self.lastModified.length > 0;
+}
+
+- (BOOL)isFresh {
+    return self.expirationDate && [self.expirationDate timeIntervalSinceNow] > 0;
+}
+
+@end
+
+static BOOL SDWriteValidatorsAttribute(NSString *path, SDImageCacheValidators *validators) {
+    NSMutableDictionary *dictionary = [NSMutableDictionary new];
+    if (validators.ETag) dictionary[kValidatorsETagKey] = validators.ETag;
+    if (validators.lastModified) dictionary[kValidatorsLastModifiedKey] = validators.lastModified;
+    if (validators.expirationDate) dictionary[kValidatorsExpirationKey] = @([validators.expirationDate timeIntervalSince1970]);
+    NSData *data = [NSPropertyListSerialization dataWithPropertyList:dictionary format:NSPropertyListBinaryFormat_v1_0 options:0 error:NULL];
+    if (!data) {
+        return NO;
+    }
+    // 缓存文件不存在时 setxattr 直接失败，不会创建空文件
+    return setxattr([path fileSystemRepresentation], kValidatorsAttributeName, data.bytes, data.length, 0, 0) == 0;
+}
+
+static SDImageCacheValidators *SDReadValidatorsAttribute(NSString *path) {
+    const char *fileSystemPath = [path fileSystemRepresentation];
+    ssize_t length = getxattr(fileSystemPath, kValidatorsAttributeName, NULL, 0, 0, 0);
+    if (length <= 0) {
+        return nil;
+    }
+    NSMutableData *data = [NSMutableData dataWithLength:length];
+    length = getxattr(fileSystemPath, kValidatorsAttributeName, data.mutableBytes, data.length, 0, 0);
+    if (length <= 0) {
+        return nil;
+    }
+    data.length = length;
+    NSDictionary *dictionary = [NSPropertyListSerialization propertyListWithData:data options:NSPropertyListImmutable format:NULL error:NULL];
+    if (![dictionary isKindOfClass:[NSDictionary class]]) {
+        return nil;
+    }
+    NSNumber *expiration = dictionary[kValidatorsExpirationKey];
+    return [[SDImageCacheValidators alloc] initWithETag:dictionary[kValidatorsETagKey]
+                                           lastModified:dictionary[kValidatorsLastModifiedKey]
+                                         expirationDate:(expiration ? [NSDate dateWithTimeIntervalSince1970:[expiration doubleValue]] : nil)];
+}
+
+@interface SDImageCacheFileWriter ()
+
+// 临时文件路径和最终的缓存文件路径
+@property (copy, nonatomic) NSString *temporaryPath;
+@property (copy, nonatomic) NSString *destinationPath;
+@property (assign, nonatomic) BOOL excludedFromBackup;
+
+- (id)initWithKey:(NSString *)key temporaryPath:(NSString *)temporaryPath destinationPath:(NSString *)destinationPath excludedFromBackup:(BOOL)excludedFromBackup;
+
+@end
+
+@implementation SDImageCacheFileWriter {
+    // 临时文件的文件描述符，-1 表示还没有打开
+    int _fileDescriptor;
+    // 写入失败、已经 commit 或 discard 后不再接受数据
+    BOOL _closed;
+}
+
+- (id)initWithKey:(NSString *)key temporaryPath:(NSString *)temporaryPath destinationPath:(NSString *)destinationPath excludedFromBackup:(BOOL)excludedFromBackup {
+    if ((self = [super init])) {
+        _key = [key copy];
+        _temporaryPath = [temporaryPath copy];
+        _destinationPath = [destinationPath copy];
+        _excludedFromBackup = excludedFromBackup;
+        _fileDescriptor = -1;
+    }
+    return self;
+}
+
+- (void)dealloc {
+    // 没有 commit 的数据都丢弃
+    [self discard];
+}
 
-// 判断图片的二进制数据是否有 PNG 前缀的函数
-BOOL ImageDataHasPNGPreffix(NSData *data);
+- (BOOL)appendData:(NSData *)data {
+    @synchronized (self) {
+        if (_closed) {
+            return NO;
+        }
+        if (_fileDescriptor < 0) {
+            _fileDescriptor = open([self.temporaryPath fileSystemRepresentation], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (_fileDescriptor < 0) {
+                _closed = YES;
+                return NO;
+            }
+        }
 
-BOOL ImageDataHasPNGPreffix(NSData *data) {
-    NSUInteger pngSignatureLength = [kPNGSignatureData length];
-    if ([data length] >= pngSignatureLength) {
-        if ([[data subdataWithRange:NSMakeRange(0, pngSignatureLength)] isEqualToData:kPNGSignatureData]) {
-            return YES;
+        const char *bytes = data.bytes;
+        NSUInteger remaining = data.length;
+        while (remaining > 0) {
+            ssize_t written = write(_fileDescriptor, bytes, remaining);
+            if (written < 0) {
+                // 磁盘满了等错误，之后的数据都不再写入，交给正常的缓存流程处理
+                [self closeAndRemoveTemporaryFile];
+                return NO;
+            }
+            bytes += written;
+            remaining -= written;
         }
+        return YES;
     }
+}
 
-    return NO;
+- (BOOL)commit {
+    @synchronized (self) {
+        if (_closed || _fileDescriptor < 0) {
+            return NO;
+        }
+        close(_fileDescriptor);
+        _fileDescriptor = -1;
+        _closed = YES;
+
+        // 元数据写在临时文件上，rename 之后和缓存文件一起出现
+        SDWriteMetadataAttribute(self.temporaryPath, SDMetadataForFileAtPath(self.temporaryPath));
+        if (self.validators) {
+            SDWriteValidatorsAttribute(self.temporaryPath, self.validators);
+        }
+
+        // rename 在同一个文件系统中是原子的，读取缓存的一方要么看到旧文件，要么看到完整的新文件
+        if (rename([self.temporaryPath fileSystemRepresentation], [self.destinationPath fileSystemRepresentation]) != 0) {
+            unlink([self.temporaryPath fileSystemRepresentation]);
+            return NO;
+        }
+
+        // disable iCloud backup
+        if (self.excludedFromBackup) {
+            NSURL *fileURL = [NSURL fileURLWithPath:self.destinationPath];
+            [fileURL setResourceValue:[NSNumber numberWithBool:YES] forKey:NSURLIsExcludedFromBackupKey error:nil];
+        }
+        _committed = YES;
+        return YES;
+    }
+}
+
+- (void)discard {
+    @synchronized (self) {
+        if (_closed) {
+            return;
+        }
+        [self closeAndRemoveTemporaryFile];
+    }
+}
+
+- (void)closeAndRemoveTemporaryFile {
+    if (_fileDescriptor >= 0) {
+        close(_fileDescriptor);
+        _fileDescriptor = -1;
+        unlink([self.temporaryPath fileSystemRepresentation]);
+    }
+    _closed = YES;
 }
 
+@end
+
+// 同一个 key 正在进行的 disk 查询，所有的等待者共用一次读取和解码
+@interface SDImageCacheDiskQuery : NSObject
+
+// 查询的 key、目标像素大小和 memory 缓存中的 key
+@property (copy, nonatomic) NSString *key;
+@property (assign, nonatomic) CGSize targetPixelSize;
+@property (copy, nonatomic) NSString *memoryKey;
+// 创建这个查询的请求和加入 ioQueue 的时间，用于 SDWebImageTracer
+@property (assign, nonatomic) SDWebImageTraceID traceID;
+@property (assign, nonatomic) uint64_t enqueueTime;
+// 每个等待者的 operation 和 done block，一一对应
+@property (strong, nonatomic) NSMutableArray *operations;
+@property (strong, nonatomic) NSMutableArray *doneBlocks;
+
+- (void)addOperation:(NSOperation *)operation doneBlock:(SDWebImageQueryCompletedBlock)doneBlock;
+
+// 所有的等待者都取消了
+- (BOOL)isCancelled;
+
+// 在主线程中通知所有没有取消的等待者
+- (void)finishWithImage:(UIImage *)image cacheType:(SDImageCacheType)cacheType;
+
+@end
+
+@implementation SDImageCacheDiskQuery
+
+- (id)init {
+    if ((self = [super init])) {
+        _operations = [NSMutableArray new];
+        _doneBlocks = [NSMutableArray new];
+    }
+    return self;
+}
+
+- (void)addOperation:(NSOperation *)operation doneBlock:(SDWebImageQueryCompletedBlock)doneBlock {
+    [self.operations addObject:operation];
+    [self.doneBlocks addObject:[doneBlock copy]];
+}
+
+- (BOOL)isCancelled {
+    for (NSOperation *operation in self.operations) {
+        if (!operation.isCancelled) {
+            return NO;
+        }
+    }
+    return YES;
+}
+
+- (void)finishWithImage:(UIImage *)image cacheType:(SDImageCacheType)cacheType {
+    NSArray *operations = [self.operations copy];
+    NSArray *doneBlocks = [self.doneBlocks copy];
+    dispatch_async(dispatch_get_main_queue(), ^{
+        [operations enumerateObjectsUsingBlock:^(NSOperation *operation, NSUInteger idx, BOOL *stop) {
+            if (!operation.isCancelled) {
+                SDWebImageQueryCompletedBlock doneBlock = doneBlocks[idx];
+                doneBlock(image, cacheType);
+            }
+        }];
+    });
+}
+
+@end
+
+/**
+ *  默认的存储时间（一周）
+ */
+static const NSInteger kDefaultCacheMaxCacheAge = 60 * 60 * 24 * 7; // 1 week
+// 超过这个时间没有写入的下载临时文件，是崩溃或者被杀掉时没有提交也没有删除的，清理缓存时删除
+static const NSTimeInterval kTemporaryFileMaxAge = 60 * 60; // 1 hour
 /**
  *  计算图片缓存的空间
  *
@@ -63,7 +503,31 @@ BOOL ImageDataHasPNGPreffix(NSData *data) {
  *  @return 图片缓存的空间
  */
 FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
-    return image.size.height * image.size.width * image.scale * image.scale;
+    // 按需解码的动图只有海报帧和滑动窗口中的帧占用内存
+    if ([image isKindOfClass:[SDWebImageAnimatedImage class]]) {
+        return [(SDWebImageAnimatedImage *)image memoryCost];
+    }
+    NSUInteger cost = image.size.height * image.size.width * image.scale * image.scale;
+    // 一次解码出所有帧的动图，每一帧都占用内存
+    if (image.images.count > 0) {
+        cost *= image.images.count;
+    }
+    return cost;
+}
+
+// 是否需要缩小解码
+FOUNDATION_STATIC_INLINE BOOL SDIsTargetPixelSizeValid(CGSize targetPixelSize) {
+    return targetPixelSize.width > 0 && targetPixelSize.height > 0;
+}
+
+/**
+ *  缩小解码的图片在 memory 缓存中的 key，不同大小的图片分别缓存
+ */
+FOUNDATION_STATIC_INLINE NSString *SDMemoryCacheKeyForKey(NSString *key, CGSize targetPixelSize) {
+    if (!SDIsTargetPixelSizeValid(targetPixelSize)) {
+        return key;
+    }
+    return [NSString stringWithFormat:@"%@#SDTargetPixelSize=%.0fx%.0f", key, targetPixelSize.width, targetPixelSize.height];
 }
 
 @interface SDImageCache ()
@@ -77,6 +541,16 @@ FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
 // 自定义的 disk cache 路径，可能维持了多个 cache 缓存
 @property (strong, nonatomic) NSMutableArray *customPaths;
 
+// key -> 这个 key 在 memory 缓存中不同大小的图片的 key (NSMutableSet)，移除 key 时一起移除
+@property (strong, nonatomic) NSMutableDictionary *memoryVariantKeys;
+
+// memory 缓存的 key -> 正在进行的 disk 查询 (SDImageCacheDiskQuery)，相同 key 的查询只读取和解码一次
+@property (strong, nonatomic) NSMutableDictionary *diskQueries;
+// 以下的计数在 diskQueries 的锁中修改
+@property (assign, nonatomic, readwrite) NSUInteger diskQueryReadCount;
+@property (assign, nonatomic, readwrite) NSUInteger diskQueryDecodeCount;
+@property (assign, nonatomic, readwrite) NSUInteger joinedDiskQueryCount;
+
 // 串行队列， SDDispatchQueueSetterSementics == assign
 @property (SDDispatchQueueSetterSementics, nonatomic) dispatch_queue_t ioQueue;
 
@@ -115,9 +589,6 @@ FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
         // 拼接出 path 路径下的文件夹名称
         NSString *fullNamespace = [@"com.hackemist.SDWebImageCache." stringByAppendingString:ns];
 
-        // initialise PNG signature data
-        kPNGSignatureData = [NSData dataWithBytes:kPNGSignatureBytes length:8];
-
         // Create IO serial queue
         // 串行队列
         _ioQueue = dispatch_queue_create("com.hackemist.SDWebImageCache", DISPATCH_QUEUE_SERIAL);
@@ -128,6 +599,8 @@ FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
         // Init the memory cache
         _memCache = [[AutoPurgeCache alloc] init];
         _memCache.name = fullNamespace;
+        _memoryVariantKeys = [NSMutableDictionary new];
+        _diskQueries = [NSMutableDictionary new];
 
         // Init the disk cache
         if (directory != nil) {
@@ -222,20 +695,9 @@ FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
 
 #pragma mark SDImageCache (private)
 
-// 为图片 key 生成的唯一缓存文件名
+// 为图片 key 生成的唯一缓存文件名，key 是 SDWebImageCacheKey 时不再重复计算 MD5
 - (NSString *)cachedFileNameForKey:(NSString *)key {
-    // key 就是网络图片对应得 URL，通过 MD5 加密生成唯一的文件名
-    const char *str = [key UTF8String];
-    if (str == NULL) {
-        str = "";
-    }
-    unsigned char r[CC_MD5_DIGEST_LENGTH];
-    CC_MD5(str, (CC_LONG)strlen(str), r);
-    NSString *filename = [NSString stringWithFormat:@"%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%@",
-                          r[0], r[1], r[2], r[3], r[4], r[5], r[6], r[7], r[8], r[9], r[10],
-                          r[11], r[12], r[13], r[14], r[15], [[key pathExtension] isEqualToString:@""] ? @"" : [NSString stringWithFormat:@".%@", [key pathExtension]]];
-
-    return filename;
+    return SDDiskFileNameForKey(key);
 }
 
 #pragma mark ImageCache
@@ -248,6 +710,10 @@ FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
 }
 
 - (void)storeImage:(UIImage *)image recalculateFromImage:(BOOL)recalculate imageData:(NSData *)imageData forKey:(NSString *)key toDisk:(BOOL)toDisk {
+    [self storeImage:image recalculateFromImage:recalculate imageData:imageData forKey:key targetPixelSize:CGSizeZero toDisk:toDisk];
+}
+
+- (void)storeImage:(UIImage *)image recalculateFromImage:(BOOL)recalculate imageData:(NSData *)imageData forKey:(NSString *)key targetPixelSize:(CGSize)targetPixelSize toDisk:(BOOL)toDisk {
     if (!image || !key) {
         return;
     }
@@ -255,17 +721,20 @@ FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
     // if memory cache is enabled
     // 缓存到内存中
     if (self.shouldCacheImagesInMemory) {
-        NSUInteger cost = SDCacheCostForImage(image);
-        [self.memCache setObject:image forKey:key cost:cost];
+        [self setMemoryImage:image forKey:key targetPixelSize:targetPixelSize];
     }
 
+    // 缩小过的图片不能重新编码写入 disk，disk 中只保存原图的数据
+    BOOL downsampled = SDIsTargetPixelSizeValid(targetPixelSize);
     
-    if (toDisk) {
+    if (toDisk && (!downsampled || imageData)) {
+        SDWebImageTraceID traceID = SDWebImageTraceCurrentID();
+        uint64_t storeStart = SDWebImageTraceTimestamp(traceID);
         dispatch_async(self.ioQueue, ^{
             NSData *data = imageData;
 
             // image 有值，要重新计算或者 imageData 没有值，就生成图片的二进制流
-            if (image && (recalculate || !data)) {
+            if (image && !downsampled && (recalculate || !data)) {
 #if TARGET_OS_IPHONE
                 // We need to determine if the image is a PNG or a JPEG
                 // PNGs are easier to detect because they have a unique signature (http://www.w3.org/TR/PNG-Structure.html)
@@ -281,8 +750,10 @@ FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
                 BOOL imageIsPng = hasAlpha;
 
                 // But if we have an image data, we will look at the preffix
-                if ([imageData length] >= [kPNGSignatureData length]) {
-                    imageIsPng = ImageDataHasPNGPreffix(imageData);
+                // 从文件头识别原始数据的格式：PNG 仍然编码成 PNG，JPEG 编码成 JPEG，其他格式有透明通道时编码成 PNG
+                SDImageFormat imageFormat = SDImageFormatForData(imageData);
+                if (imageFormat == SDImageFormatPNG || imageFormat == SDImageFormatJPEG) {
+                    imageIsPng = (imageFormat == SDImageFormatPNG);
                 }
 
                 if (imageIsPng) {
@@ -311,12 +782,15 @@ FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
 
                 // 缓存图片到指定路径
                 [_fileManager createFileAtPath:cachePathForKey contents:data attributes:nil];
+                // 同时保存元数据，之后查询大小等信息不需要读取图片
+                SDWriteMetadataAttribute(cachePathForKey, SDMetadataForData(data));
 
                 // disable iCloud backup
                 if (self.shouldDisableiCloud) {
                     [fileURL setResourceValue:[NSNumber numberWithBool:YES] forKey:NSURLIsExcludedFromBackupKey error:nil];
                 }
             }
+            SDWebImageTraceEnd(traceID, SDWebImageTraceSpanStore, storeStart);
         });
     }
 }
@@ -351,11 +825,100 @@ FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
     });
 }
 
+- (SDImageCacheMetadata *)metadataForKey:(NSString *)key {
+    if (!key) {
+        return nil;
+    }
+
+    NSMutableArray *paths = [NSMutableArray arrayWithObject:[self defaultCachePathForKey:key]];
+    for (NSString *path in [self.customPaths copy]) {
+        [paths addObject:[self cachePathForKey:key inPath:path]];
+    }
+    for (NSString *path in paths) {
+        SDImageCacheMetadata *metadata = SDReadMetadataAttribute(path);
+        if (metadata) {
+            return metadata;
+        }
+        // 之前版本缓存的文件没有元数据，解析文件头之后补写 (只读的自定义路径会写入失败，不影响结果)
+        metadata = SDMetadataForFileAtPath(path);
+        if (metadata) {
+            SDWriteMetadataAttribute(path, metadata);
+            return metadata;
+        }
+    }
+    return nil;
+}
+
+- (void)queryMetadataForKey:(NSString *)key completion:(SDWebImageQueryMetadataCompletedBlock)completionBlock {
+    if (!completionBlock) {
+        return;
+    }
+    dispatch_async(self.ioQueue, ^{
+        SDImageCacheMetadata *metadata = [self metadataForKey:key];
+        dispatch_async(dispatch_get_main_queue(), ^{
+            completionBlock(metadata);
+        });
+    });
+}
+
+- (SDImageCacheValidators *)validatorsForKey:(NSString *)key {
+    if (!key) {
+        return nil;
+    }
+    return SDReadValidatorsAttribute([self defaultCachePathForKey:key]);
+}
+
+- (void)queryValidatorsForKey:(NSString *)key completion:(SDWebImageQueryValidatorsCompletedBlock)completionBlock {
+    if (!completionBlock) {
+        return;
+    }
+    dispatch_async(self.ioQueue, ^{
+        SDImageCacheValidators *validators = [self validatorsForKey:key];
+        dispatch_async(dispatch_get_main_queue(), ^{
+            completionBlock(validators);
+        });
+    });
+}
+
+- (void)storeValidators:(SDImageCacheValidators *)validators forKey:(NSString *)key {
+    if (!validators || !key) {
+        return;
+    }
+    dispatch_async(self.ioQueue, ^{
+        NSString *path = [self defaultCachePathForKey:key];
+        if (SDWriteValidatorsAttribute(path, validators)) {
+            // 服务器刚确认过的缓存，maxCacheAge 从现在开始重新计算
+            [_fileManager setAttributes:@{NSFileModificationDate: [NSDate date]} ofItemAtPath:path error:nil];
+        }
+    });
+}
+
 // 拿到内存中缓存的图片
 - (UIImage *)imageFromMemoryCacheForKey:(NSString *)key {
     return [self.memCache objectForKey:key];
 }
 
+- (UIImage *)imageFromMemoryCacheForKey:(NSString *)key targetPixelSize:(CGSize)targetPixelSize {
+    return [self.memCache objectForKey:SDMemoryCacheKeyForKey(key, targetPixelSize)];
+}
+
+// 缓存到内存中，缩小过的图片用带大小的 key，并记录下来以便移除
+- (void)setMemoryImage:(UIImage *)image forKey:(NSString *)key targetPixelSize:(CGSize)targetPixelSize {
+    NSString *memoryKey = SDMemoryCacheKeyForKey(key, targetPixelSize);
+    if (memoryKey != key) {
+        @synchronized (self.memoryVariantKeys) {
+            NSMutableSet *variantKeys = self.memoryVariantKeys[key];
+            if (!variantKeys) {
+                variantKeys = [NSMutableSet new];
+                self.memoryVariantKeys[key] = variantKeys;
+            }
+            [variantKeys addObject:memoryKey];
+        }
+    }
+    NSUInteger cost = SDCacheCostForImage(image);
+    [self.memCache setObject:image forKey:memoryKey cost:cost];
+}
+
 - (UIImage *)imageFromDiskCacheForKey:(NSString *)key {
 
     // First check the in-memory cache...
@@ -398,26 +961,85 @@ FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
 }
 
 - (UIImage *)diskImageForKey:(NSString *)key {
+    return [self diskImageForKey:key targetPixelSize:CGSizeZero];
+}
+
+- (UIImage *)diskImageForKey:(NSString *)key targetPixelSize:(CGSize)targetPixelSize {
     // 拿到图片对应的二进制数据
     NSData *data = [self diskImageDataBySearchingAllPathsForKey:key];
     if (data) {
-        UIImage *image = [UIImage sd_imageWithData:data];
-        image = [self scaledImageForKey:key image:image];
-        if (self.shouldDecompressImages) {
-            image = [UIImage decodedImageWithImage:image];
-        }
-        return image;
+        // 同步的查询在调用的线程中直接解码 (通常是主线程)，不在解码调度器中排在下载、预加载的解码后面等待
+        return [self diskImageForData:data key:key targetPixelSize:targetPixelSize];
     }
     else {
         return nil;
     }
 }
 
+// 解码 disk 中读出来的数据，在解码线程中调用
+- (UIImage *)diskImageForData:(NSData *)data key:(NSString *)key targetPixelSize:(CGSize)targetPixelSize {
+    // 直接缩小解码，解码出来的图片已经解压缩，动图和 ImageIO 不支持的格式按原图解码
+    if (SDIsTargetPixelSizeValid(targetPixelSize)) {
+        UIImage *image = [SDWebImageIncrementalDecoder decodedImageWithData:data targetPixelSize:targetPixelSize];
+        if (image) {
+            return [self scaledImageForKey:key image:image];
+        }
+    }
+
+    // 多帧的动图只解码第一帧，其他帧在播放时按需解码
+    if (self.shouldDecodeAnimatedImagesLazily) {
+        SDWebImageAnimatedImage *animatedImage = [SDWebImageAnimatedImage animatedImageWithData:data];
+        if (animatedImage) {
+            return [animatedImage animatedImageWithScale:[self scaledImageForKey:key image:animatedImage].scale];
+        }
+    }
+
+    UIImage *image = [UIImage sd_imageWithData:data];
+    image = [self scaledImageForKey:key image:image];
+    // 旋转之后的图片已经是解压缩的位图
+    if (self.shouldBakeImageOrientation && image.imageOrientation != UIImageOrientationUp) {
+        UIImage *bakedImage = [SDWebImageIncrementalDecoder orientationBakedImageWithImage:image];
+        if (bakedImage != image) {
+            return bakedImage;
+        }
+    }
+    if (self.shouldDecompressImages) {
+        image = [UIImage decodedImageWithImage:image];
+    }
+    return image;
+}
+
 - (UIImage *)scaledImageForKey:(NSString *)key image:(UIImage *)image {
     return SDScaledImageForKey(key, image);
 }
 
+- (SDImageCacheFileWriter *)fileWriterForKey:(NSString *)key {
+    if (!key) {
+        return nil;
+    }
+
+    // this is an exception to access the filemanager on another queue than ioQueue, but we are using the shared instance
+    // from apple docs on NSFileManager: The methods of the shared NSFileManager object can be called from multiple threads safely.
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    if (![fileManager fileExistsAtPath:_diskCachePath]) {
+        [fileManager createDirectoryAtPath:_diskCachePath withIntermediateDirectories:YES attributes:nil error:NULL];
+    }
+
+    // 临时文件放在缓存文件夹中 (保证 rename 在同一个文件系统中)，以 . 开头，不计入缓存的清理，
+    // 遗留下来的临时文件由 cleanDisk 单独删除
+    NSString *temporaryName = [NSString stringWithFormat:@".%@.download", [[NSUUID UUID] UUIDString]];
+    NSString *temporaryPath = [self.diskCachePath stringByAppendingPathComponent:temporaryName];
+    return [[SDImageCacheFileWriter alloc] initWithKey:key
+                                         temporaryPath:temporaryPath
+                                       destinationPath:[self defaultCachePathForKey:key]
+                                    excludedFromBackup:self.shouldDisableiCloud];
+}
+
 - (NSOperation *)queryDiskCacheForKey:(NSString *)key done:(SDWebImageQueryCompletedBlock)doneBlock {
+    return [self queryDiskCacheForKey:key targetPixelSize:CGSizeZero done:doneBlock];
+}
+
+- (NSOperation *)queryDiskCacheForKey:(NSString *)key targetPixelSize:(CGSize)targetPixelSize done:(SDWebImageQueryCompletedBlock)doneBlock {
     if (!doneBlock) {
         return nil;
     }
@@ -428,36 +1050,164 @@ FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
     }
 
     // First check the in-memory cache...
-    UIImage *image = [self imageFromMemoryCacheForKey:key];
+    UIImage *image = [self imageFromMemoryCacheForKey:key targetPixelSize:targetPixelSize];
     if (image) {
         doneBlock(image, SDImageCacheTypeMemory);
         return nil;
     }
 
     NSOperation *operation = [NSOperation new];
-    // 异步查找磁盘中对应图片
-    dispatch_async(self.ioQueue, ^{
-        if (operation.isCancelled) {
+    SDImageCacheDiskQuery *query = [self addDiskQueryForKey:key targetPixelSize:targetPixelSize operation:operation doneBlock:doneBlock];
+    if (query) {
+        dispatch_async(self.ioQueue, ^{
+            [self readDiskQuery:query];
+        });
+    }
+
+    return operation;
+}
+
+- (NSOperation *)queryDiskCacheForKeys:(NSArray *)keys targetPixelSizes:(NSArray *)targetPixelSizes done:(SDWebImageBatchQueryCompletedBlock)doneBlock {
+    if (!doneBlock || keys.count == 0) {
+        return nil;
+    }
+
+    // 所有的 key 共用一个 operation，取消之后这一批都不再回调
+    NSOperation *operation = [NSOperation new];
+    NSMutableArray *queries = [NSMutableArray new];
+    [keys enumerateObjectsUsingBlock:^(NSString *key, NSUInteger idx, BOOL *stop) {
+        if (![key isKindOfClass:[NSString class]]) {
+            doneBlock(idx, nil, SDImageCacheTypeNone);
             return;
         }
 
-        @autoreleasepool {
-            UIImage *diskImage = [self diskImageForKey:key];
-            if (diskImage && self.shouldCacheImagesInMemory) {
-                NSUInteger cost = SDCacheCostForImage(diskImage);
-                // 将 image 添加到内存缓存中
-                [self.memCache setObject:diskImage forKey:key cost:cost];
-            }
+        NSValue *targetPixelSizeValue = idx < targetPixelSizes.count ? targetPixelSizes[idx] : nil;
+        CGSize targetPixelSize = [targetPixelSizeValue isKindOfClass:[NSValue class]] ? [targetPixelSizeValue CGSizeValue] : CGSizeZero;
+        UIImage *image = [self imageFromMemoryCacheForKey:key targetPixelSize:targetPixelSize];
+        if (image) {
+            doneBlock(idx, image, SDImageCacheTypeMemory);
+            return;
+        }
 
-            dispatch_async(dispatch_get_main_queue(), ^{
-                doneBlock(diskImage, SDImageCacheTypeDisk);
-            });
+        SDImageCacheDiskQuery *query = [self addDiskQueryForKey:key targetPixelSize:targetPixelSize operation:operation doneBlock:^(UIImage *diskImage, SDImageCacheType cacheType) {
+            doneBlock(idx, diskImage, cacheType);
+        }];
+        if (query) {
+            [queries addObject:query];
         }
-    });
+    }];
+
+    // 这一批新的查询在 ioQueue 中一次读完，不需要为每个 key 调度一次
+    if (queries.count > 0) {
+        dispatch_async(self.ioQueue, ^{
+            for (SDImageCacheDiskQuery *query in queries) {
+                [self readDiskQuery:query];
+            }
+        });
+    }
 
     return operation;
 }
 
+/**
+ *  把一个等待者加入 key 对应的 disk 查询
+ *
+ *  @return 新建的查询，需要调用者放到 ioQueue 中读取；相同 key 的查询已经在进行时返回 nil
+ */
+- (SDImageCacheDiskQuery *)addDiskQueryForKey:(NSString *)key targetPixelSize:(CGSize)targetPixelSize operation:(NSOperation *)operation doneBlock:(SDWebImageQueryCompletedBlock)doneBlock {
+    NSString *memoryKey = SDMemoryCacheKeyForKey(key, targetPixelSize);
+    @synchronized (self.diskQueries) {
+        // 相同 key 的查询正在进行，等待它的结果，不再重复读取和解码
+        SDImageCacheDiskQuery *query = self.diskQueries[memoryKey];
+        if (query) {
+            [query addOperation:operation doneBlock:doneBlock];
+            self.joinedDiskQueryCount++;
+            return nil;
+        }
+        query = [SDImageCacheDiskQuery new];
+        query.key = key;
+        query.targetPixelSize = targetPixelSize;
+        query.memoryKey = memoryKey;
+        query.traceID = SDWebImageTraceCurrentID();
+        query.enqueueTime = SDWebImageTraceTimestamp(query.traceID);
+        [query addOperation:operation doneBlock:doneBlock];
+        self.diskQueries[memoryKey] = query;
+        return query;
+    }
+}
+
+// 在 ioQueue 中调用：ioQueue 中只读取数据，解码放到解码调度器中，不阻塞后面的 disk 读取
+- (void)readDiskQuery:(SDImageCacheDiskQuery *)query {
+    NSString *key = query.key;
+    NSString *memoryKey = query.memoryKey;
+    CGSize targetPixelSize = query.targetPixelSize;
+    SDWebImageTraceID traceID = query.traceID;
+    SDWebImageTraceEnd(traceID, SDWebImageTraceSpanDiskQueryWait, query.enqueueTime);
+    if ([self removeDiskQueryIfCancelled:query forKey:memoryKey]) {
+        return;
+    }
+
+    @synchronized (self.diskQueries) {
+        self.diskQueryReadCount++;
+    }
+    NSData *diskData = nil;
+    uint64_t readStart = SDWebImageTraceTimestamp(traceID);
+    @autoreleasepool {
+        diskData = [self diskImageDataBySearchingAllPathsForKey:key];
+    }
+    SDWebImageTraceEnd(traceID, SDWebImageTraceSpanDiskRead, readStart);
+    if (!diskData) {
+        [self removeDiskQuery:query forKey:memoryKey];
+        [query finishWithImage:nil cacheType:SDImageCacheTypeDisk];
+        return;
+    }
+
+    [[SDWebImageDecodeScheduler sharedScheduler] decodeWithPriority:NSOperationQueuePriorityNormal block:^UIImage *{
+        // 等待解码的过程中所有的等待者都取消了，不再解码
+        if ([self removeDiskQueryIfCancelled:query forKey:memoryKey]) {
+            return nil;
+        }
+        @synchronized (self.diskQueries) {
+            self.diskQueryDecodeCount++;
+        }
+        uint64_t decodeStart = SDWebImageTraceTimestamp(traceID);
+        UIImage *diskImage = [self diskImageForData:diskData key:key targetPixelSize:targetPixelSize];
+        SDWebImageTraceEnd(traceID, SDWebImageTraceSpanDecode, decodeStart);
+        return diskImage;
+    } completion:^(UIImage *diskImage) {
+        if (diskImage && self.shouldCacheImagesInMemory) {
+            // 将 image 添加到内存缓存中
+            [self setMemoryImage:diskImage forKey:key targetPixelSize:targetPixelSize];
+        }
+
+        // 先放到 memory 缓存中再移除，之后的查询直接命中 memory 缓存
+        [self removeDiskQuery:query forKey:memoryKey];
+        [query finishWithImage:diskImage cacheType:SDImageCacheTypeDisk];
+    }];
+}
+
+// 移除正在进行的查询，之后相同 key 的查询会重新开始
+- (void)removeDiskQuery:(SDImageCacheDiskQuery *)query forKey:(NSString *)memoryKey {
+    @synchronized (self.diskQueries) {
+        if (self.diskQueries[memoryKey] == query) {
+            [self.diskQueries removeObjectForKey:memoryKey];
+        }
+    }
+}
+
+// 所有的等待者都取消时移除查询，和加入新的等待者在同一个锁中判断，不会漏掉后加入的等待者
+- (BOOL)removeDiskQueryIfCancelled:(SDImageCacheDiskQuery *)query forKey:(NSString *)memoryKey {
+    @synchronized (self.diskQueries) {
+        if (![query isCancelled]) {
+            return NO;
+        }
+        if (self.diskQueries[memoryKey] == query) {
+            [self.diskQueries removeObjectForKey:memoryKey];
+        }
+        return YES;
+    }
+}
+
 - (void)removeImageForKey:(NSString *)key {
     [self removeImageForKey:key withCompletion:nil];
 }
@@ -478,6 +1228,15 @@ FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
 
     if (self.shouldCacheImagesInMemory) {
         [self.memCache removeObjectForKey:key];
+        // 同时移除这个 key 不同大小的图片
+        NSSet *variantKeys = nil;
+        @synchronized (self.memoryVariantKeys) {
+            variantKeys = self.memoryVariantKeys[key];
+            [self.memoryVariantKeys removeObjectForKey:key];
+        }
+        for (NSString *variantKey in variantKeys) {
+            [self.memCache removeObjectForKey:variantKey];
+        }
     }
 
     if (fromDisk) {
@@ -515,6 +1274,9 @@ FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
 
 - (void)clearMemory {
     [self.memCache removeAllObjects];
+    @synchronized (self.memoryVariantKeys) {
+        [self.memoryVariantKeys removeAllObjects];
+    }
 }
 
 - (void)clearDisk {
@@ -591,6 +1353,8 @@ FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
             [_fileManager removeItemAtURL:fileURL error:nil];
         }
 
+        [self removeStaleTemporaryFilesAtURL:diskCacheURL];
+
         // If our remaining disk cache exceeds a configured maximum size, perform a second
         // size-based cleanup pass.  We delete the oldest files first.
         if (self.maxCacheSize > 0 && currentCacheSize > self.maxCacheSize) {
@@ -645,6 +1409,27 @@ FOUNDATION_STATIC_INLINE NSUInteger SDCacheCostForImage(UIImage *image) {
     }];
 }
 
+// 删除遗留的下载临时文件 (.UUID.download)，正在下载的临时文件一直在写入，修改时间不会超过 kTemporaryFileMaxAge
+// 在 ioQueue 中调用
+- (void)removeStaleTemporaryFilesAtURL:(NSURL *)diskCacheURL {
+    NSDate *expirationDate = [NSDate dateWithTimeIntervalSinceNow:-kTemporaryFileMaxAge];
+    NSArray *fileURLs = [_fileManager contentsOfDirectoryAtURL:diskCacheURL
+                                    includingPropertiesForKeys:@[NSURLContentModificationDateKey]
+                                                       options:0
+                                                         error:NULL];
+    for (NSURL *fileURL in fileURLs) {
+        NSString *fileName = fileURL.lastPathComponent;
+        if (![fileName hasPrefix:@"."] || ![fileName.pathExtension isEqualToString:@"download"]) {
+            continue;
+        }
+        NSDate *modificationDate = nil;
+        [fileURL getResourceValue:&modificationDate forKey:NSURLContentModificationDateKey error:NULL];
+        if (!modificationDate || [modificationDate compare:expirationDate] == NSOrderedAscending) {
+            [_fileManager removeItemAtURL:fileURL error:nil];
+        }
+    }
+}
+
 - (NSUInteger)getSize {
     __block NSUInteger size = 0;
     dispatch_sync(self.ioQueue, ^{
@@ -0,0 +1,44 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import <Foundation/Foundation.h>
+
+/**
+ *  从文件头识别出的图片格式
+ */
+typedef NS_ENUM(NSInteger, SDImageFormat) {
+    /**
+     *  数据不够或者不认识的格式
+     */
+    SDImageFormatUndefined = -1,
+    SDImageFormatJPEG = 0,
+    SDImageFormatPNG,
+    SDImageFormatGIF,
+    SDImageFormatWebP,
+    SDImageFormatHEIF,
+    SDImageFormatAVIF,
+    SDImageFormatBMP
+};
+
+/**
+ *  识别格式最多需要的文件头字节数，更多的数据不会改变识别结果
+ */
+extern const NSUInteger SDImageFormatHeaderLength;
+
+/**
+ *  从文件头识别图片格式，只比较字节，不分配内存
+ *
+ *  @param bytes  数据开头的字节
+ *  @param length 字节数，少于 SDImageFormatHeaderLength 时可能识别不出来
+ */
+extern SDImageFormat SDImageFormatForBytes(const void *bytes, NSUInteger length);
+
+/**
+ *  识别 data 的图片格式，只读取前 SDImageFormatHeaderLength 个字节
+ */
+extern SDImageFormat SDImageFormatForData(NSData *data);
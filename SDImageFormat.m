@@ -0,0 +1,104 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import "SDImageFormat.h"
+
+// 用在栈上的数组长度，需要是编译期常量
+#define SD_IMAGE_FORMAT_HEADER_LENGTH 32
+
+const NSUInteger SDImageFormatHeaderLength = SD_IMAGE_FORMAT_HEADER_LENGTH;
+
+// PNG signature bytes (http://www.w3.org/TR/PNG-Structure.html)
+static const uint8_t kPNGSignatureBytes[8] = {0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A};
+
+FOUNDATION_STATIC_INLINE BOOL SDBytesMatch(const uint8_t *bytes, NSUInteger length, NSUInteger offset, const char *pattern, NSUInteger patternLength) {
+    return length >= offset + patternLength && memcmp(bytes + offset, pattern, patternLength) == 0;
+}
+
+/**
+ *  HEIF 和 AVIF 都是 ISO BMFF 容器：第一个 box 是 ftyp，后面是 major brand 和 compatible brands
+ *  major brand 是通用的 mif1/msf1 时，再看 compatible brands 中有没有 avif
+ */
+static SDImageFormat SDImageFormatForISOBMFF(const uint8_t *bytes, NSUInteger length) {
+    if (!SDBytesMatch(bytes, length, 4, "ftyp", 4) || length < 12) {
+        return SDImageFormatUndefined;
+    }
+    const char *brand = (const char *)bytes + 8;
+    if (memcmp(brand, "avif", 4) == 0 || memcmp(brand, "avis", 4) == 0) {
+        return SDImageFormatAVIF;
+    }
+    if (memcmp(brand, "heic", 4) == 0 || memcmp(brand, "heix", 4) == 0 ||
+        memcmp(brand, "hevc", 4) == 0 || memcmp(brand, "hevx", 4) == 0) {
+        return SDImageFormatHEIF;
+    }
+    if (memcmp(brand, "mif1", 4) == 0 || memcmp(brand, "msf1", 4) == 0) {
+        // ftyp box 的大小 (大端)，compatible brands 从第 16 个字节开始
+        NSUInteger boxSize = ((NSUInteger)bytes[0] << 24) | ((NSUInteger)bytes[1] << 16) | ((NSUInteger)bytes[2] << 8) | bytes[3];
+        if (boxSize > length && length < SD_IMAGE_FORMAT_HEADER_LENGTH) {
+            // compatible brands 还没有收全 (下载中只收到了开头的几个字节)，现在判断可能把 AVIF 当成 HEIF
+            return SDImageFormatUndefined;
+        }
+        NSUInteger end = MIN(boxSize, length);
+        for (NSUInteger offset = 16; offset + 4 <= end; offset += 4) {
+            if (memcmp(bytes + offset, "avif", 4) == 0 || memcmp(bytes + offset, "avis", 4) == 0) {
+                return SDImageFormatAVIF;
+            }
+        }
+        return SDImageFormatHEIF;
+    }
+    return SDImageFormatUndefined;
+}
+
+SDImageFormat SDImageFormatForBytes(const void *bytes, NSUInteger length) {
+    if (!bytes || length < 2) {
+        return SDImageFormatUndefined;
+    }
+    const uint8_t *header = bytes;
+    switch (header[0]) {
+        case 0xFF:
+            if (length >= 3 && header[1] == 0xD8 && header[2] == 0xFF) {
+                return SDImageFormatJPEG;
+            }
+            break;
+        case 0x89:
+            if (SDBytesMatch(header, length, 0, (const char *)kPNGSignatureBytes, sizeof(kPNGSignatureBytes))) {
+                return SDImageFormatPNG;
+            }
+            break;
+        case 'G':
+            if (SDBytesMatch(header, length, 0, "GIF87a", 6) || SDBytesMatch(header, length, 0, "GIF89a", 6)) {
+                return SDImageFormatGIF;
+            }
+            break;
+        case 'R':
+            if (SDBytesMatch(header, length, 0, "RIFF", 4) && SDBytesMatch(header, length, 8, "WEBP", 4)) {
+                return SDImageFormatWebP;
+            }
+            break;
+        case 'B':
+            // BITMAPFILEHEADER 之后至少有 14 个字节，避免把以 BM 开头的文本当成 BMP
+            if (header[1] == 'M' && length >= 14) {
+                return SDImageFormatBMP;
+            }
+            break;
+        default:
+            break;
+    }
+    return SDImageFormatForISOBMFF(header, length);
+}
+
+SDImageFormat SDImageFormatForData(NSData *data) {
+    if (!data) {
+        return SDImageFormatUndefined;
+    }
+    // 拷贝到栈上，NSData 不是连续内存时也不会拼接整个数据
+    uint8_t header[SD_IMAGE_FORMAT_HEADER_LENGTH];
+    NSUInteger length = MIN(data.length, SDImageFormatHeaderLength);
+    [data getBytes:header length:length];
+    return SDImageFormatForBytes(header, length);
+}
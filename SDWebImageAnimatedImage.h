@@ -0,0 +1,83 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import <Foundation/Foundation.h>
+#import "SDWebImageCompat.h"
+
+/**
+ *  按需解码的动图
+ *  只保留原始的图片数据，不像 sd_imageWithData: 那样一次解码出所有的帧 (images)
+ *  图片本身的内容是第一帧 (海报帧)，其他的帧在需要时解码，并在后台预先解码接下来的几帧 (滑动窗口)，窗口外的帧会被释放
+ *
+ *  images 属性为 nil，需要由播放的一方通过 animatedImageFrameAtIndex: 逐帧获取
+ */
+@interface SDWebImageAnimatedImage : UIImage
+
+/**
+ *  原始的图片数据
+ */
+@property (strong, nonatomic, readonly) NSData *animatedImageData;
+
+/**
+ *  帧数
+ */
+@property (assign, nonatomic, readonly) NSUInteger animatedImageFrameCount;
+
+/**
+ *  循环次数，0 表示无限循环
+ */
+@property (assign, nonatomic, readonly) NSUInteger animatedImageLoopCount;
+
+/**
+ *  预先解码并保留的帧数 (滑动窗口的大小)，默认是 3
+ */
+@property (assign, nonatomic) NSUInteger maxBufferedFrameCount;
+
+/**
+ *  占用的内存，和 SDImageCache 的 cost 单位一致 (像素数)：海报帧加上滑动窗口中的帧
+ */
+@property (assign, nonatomic, readonly) NSUInteger memoryCost;
+
+/**
+ *  解码过的帧数 (海报帧除外，包括后台预先解码的) 和取帧时窗口中没有、只能同步解码的次数
+ *  按顺序播放时，除了刚开始和跳帧，同步解码的次数不应该增加
+ */
+@property (assign, nonatomic, readonly) NSUInteger frameDecodeCount;
+@property (assign, nonatomic, readonly) NSUInteger synchronousFrameDecodeCount;
+
+/**
+ *  @return 不是多帧的图片或者 ImageIO 不支持的格式时返回 nil
+ */
++ (instancetype)animatedImageWithData:(NSData *)data;
+
+- (instancetype)initWithAnimatedImageData:(NSData *)data scale:(CGFloat)scale;
+
+/**
+ *  用相同的数据生成一张不同 scale 的动图，已经解析的帧信息会被共用
+ */
+- (instancetype)animatedImageWithScale:(CGFloat)scale;
+
+/**
+ *  每一帧的显示时间 (in seconds)
+ */
+- (NSTimeInterval)animatedImageDurationAtIndex:(NSUInteger)index;
+
+/**
+ *  获取一帧，窗口中已经解码好的帧直接返回，否则在当前线程同步解码
+ *  同时在后台预先解码接下来的 maxBufferedFrameCount 帧，并释放窗口之外的帧
+ *
+ *  @return 解码后的帧，index 越界时返回 nil
+ */
+- (UIImage *)animatedImageFrameAtIndex:(NSUInteger)index;
+
+/**
+ *  释放所有预先解码的帧，收到内存警告时会自动调用
+ */
+- (void)clearBufferedFrames;
+
+@end
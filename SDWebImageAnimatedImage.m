@@ -0,0 +1,248 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import "SDWebImageAnimatedImage.h"
+#import "SDWebImageDecodeScheduler.h"
+#import <ImageIO/ImageIO.h>
+
+static const NSUInteger kDefaultMaxBufferedFrameCount = 3;
+
+// 立刻解码一帧，返回的 CGImage 已经解压缩
+static CGImageRef SDCreateDecodedFrameAtIndex(CGImageSourceRef source, size_t index) {
+    NSDictionary *options = @{(__bridge NSString *)kCGImageSourceShouldCache : @YES,
+                              (__bridge NSString *)kCGImageSourceShouldCacheImmediately : @YES};
+    return CGImageSourceCreateImageAtIndex(source, index, (__bridge CFDictionaryRef)options);
+}
+
+// 从 GIF 的属性中读出一帧的显示时间
+static NSTimeInterval SDFrameDurationAtIndex(CGImageSourceRef source, size_t index) {
+    NSTimeInterval duration = 0.1;
+    NSDictionary *properties = (__bridge_transfer NSDictionary *)CGImageSourceCopyPropertiesAtIndex(source, index, NULL);
+    NSDictionary *gifProperties = properties[(__bridge NSString *)kCGImagePropertyGIFDictionary];
+    NSNumber *delayTime = gifProperties[(__bridge NSString *)kCGImagePropertyGIFUnclampedDelayTime];
+    if (!delayTime) {
+        delayTime = gifProperties[(__bridge NSString *)kCGImagePropertyGIFDelayTime];
+    }
+    if (delayTime) {
+        duration = [delayTime doubleValue];
+    }
+
+    // 和浏览器的处理一致，太短的延迟按 0.1 秒显示
+    if (duration < 0.011) {
+        duration = 0.1;
+    }
+    return duration;
+}
+
+@interface SDWebImageAnimatedImage ()
+
+@property (strong, nonatomic, readwrite) NSData *animatedImageData;
+@property (assign, nonatomic, readwrite) NSUInteger animatedImageFrameCount;
+@property (assign, nonatomic, readwrite) NSUInteger animatedImageLoopCount;
+
+// 每一帧的显示时间 (NSNumber)
+@property (strong, nonatomic) NSArray *frameDurations;
+
+// 预先解码好的帧，index (NSNumber) -> UIImage
+@property (strong, nonatomic) NSMutableDictionary *bufferedFrames;
+
+// 正在后台解码的帧
+@property (strong, nonatomic) NSMutableIndexSet *decodingIndexes;
+
+// 目前的滑动窗口，按播放顺序排列的 index (NSNumber)
+@property (strong, nonatomic) NSArray *bufferWindow;
+
+// 以下的计数在 bufferedFrames 的锁中修改
+@property (assign, nonatomic, readwrite) NSUInteger frameDecodeCount;
+@property (assign, nonatomic, readwrite) NSUInteger synchronousFrameDecodeCount;
+
+@end
+
+@implementation SDWebImageAnimatedImage {
+    CGImageSourceRef _imageSource;
+}
+
++ (instancetype)animatedImageWithData:(NSData *)data {
+    return [[self alloc] initWithAnimatedImageData:data scale:1];
+}
+
+- (instancetype)initWithAnimatedImageData:(NSData *)data scale:(CGFloat)scale {
+    if (!data) {
+        return nil;
+    }
+    CGImageSourceRef source = CGImageSourceCreateWithData((__bridge CFDataRef)data, NULL);
+    if (!source) {
+        return nil;
+    }
+    size_t count = CGImageSourceGetCount(source);
+    if (count <= 1) {
+        CFRelease(source);
+        return nil;
+    }
+
+    NSMutableArray *frameDurations = [NSMutableArray arrayWithCapacity:count];
+    for (size_t i = 0; i < count; i++) {
+        [frameDurations addObject:@(SDFrameDurationAtIndex(source, i))];
+    }
+    NSDictionary *properties = (__bridge_transfer NSDictionary *)CGImageSourceCopyProperties(source, NULL);
+    NSUInteger loopCount = [properties[(__bridge NSString *)kCGImagePropertyGIFDictionary][(__bridge NSString *)kCGImagePropertyGIFLoopCount] unsignedIntegerValue];
+
+    self = [self initWithImageSource:source data:data frameDurations:frameDurations loopCount:loopCount scale:scale];
+    CFRelease(source);
+    return self;
+}
+
+// 所有初始化方法最终调用这个方法，source 会被持有
+- (instancetype)initWithImageSource:(CGImageSourceRef)source data:(NSData *)data frameDurations:(NSArray *)frameDurations loopCount:(NSUInteger)loopCount scale:(CGFloat)scale {
+    // 图片本身的内容是第一帧
+    CGImageRef posterImageRef = SDCreateDecodedFrameAtIndex(source, 0);
+    if (!posterImageRef) {
+        return nil;
+    }
+    self = [super initWithCGImage:posterImageRef scale:scale orientation:UIImageOrientationUp];
+    CGImageRelease(posterImageRef);
+    if (self) {
+        _imageSource = (CGImageSourceRef)CFRetain(source);
+        _animatedImageData = data;
+        _animatedImageFrameCount = frameDurations.count;
+        _animatedImageLoopCount = loopCount;
+        _frameDurations = [frameDurations copy];
+        _maxBufferedFrameCount = kDefaultMaxBufferedFrameCount;
+        _bufferedFrames = [NSMutableDictionary new];
+        _decodingIndexes = [NSMutableIndexSet new];
+
+#if TARGET_OS_IPHONE
+        // 内存紧张，释放预先解码的帧
+        [[NSNotificationCenter defaultCenter] addObserver:self
+                                                 selector:@selector(clearBufferedFrames)
+                                                     name:UIApplicationDidReceiveMemoryWarningNotification
+                                                   object:nil];
+#endif
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [[NSNotificationCenter defaultCenter] removeObserver:self];
+    if (_imageSource) {
+        CFRelease(_imageSource);
+        _imageSource = NULL;
+    }
+}
+
+- (instancetype)animatedImageWithScale:(CGFloat)scale {
+    if (scale == self.scale) {
+        return self;
+    }
+    return [[[self class] alloc] initWithImageSource:_imageSource data:self.animatedImageData frameDurations:self.frameDurations loopCount:self.animatedImageLoopCount scale:scale];
+}
+
+- (NSUInteger)memoryCost {
+    NSUInteger pixelCount = CGImageGetWidth(self.CGImage) * CGImageGetHeight(self.CGImage);
+    return pixelCount * (1 + MIN(self.maxBufferedFrameCount, self.animatedImageFrameCount - 1));
+}
+
+- (NSTimeInterval)animatedImageDurationAtIndex:(NSUInteger)index {
+    if (index >= self.frameDurations.count) {
+        return 0;
+    }
+    return [self.frameDurations[index] doubleValue];
+}
+
+- (UIImage *)animatedImageFrameAtIndex:(NSUInteger)index {
+    if (index >= self.animatedImageFrameCount) {
+        return nil;
+    }
+
+    UIImage *frame = nil;
+    @synchronized (self.bufferedFrames) {
+        frame = self.bufferedFrames[@(index)];
+    }
+    if (!frame) {
+        // 窗口中还没有这一帧 (第一次播放或者跳帧)，只能同步解码
+        @synchronized (self.bufferedFrames) {
+            self.synchronousFrameDecodeCount++;
+        }
+        frame = [self decodedFrameAtIndex:index];
+    }
+
+    [self moveBufferWindowAfterIndex:index];
+    return frame;
+}
+
+- (void)clearBufferedFrames {
+    @synchronized (self.bufferedFrames) {
+        [self.bufferedFrames removeAllObjects];
+    }
+}
+
+#pragma mark SDWebImageAnimatedImage (private)
+
+- (UIImage *)decodedFrameAtIndex:(NSUInteger)index {
+    if (index == 0) {
+        return [UIImage imageWithCGImage:self.CGImage scale:self.scale orientation:self.imageOrientation];
+    }
+    @synchronized (self.bufferedFrames) {
+        self.frameDecodeCount++;
+    }
+    CGImageRef imageRef = SDCreateDecodedFrameAtIndex(_imageSource, index);
+    if (!imageRef) {
+        return nil;
+    }
+    UIImage *frame = [UIImage imageWithCGImage:imageRef scale:self.scale orientation:UIImageOrientationUp];
+    CGImageRelease(imageRef);
+    return frame;
+}
+
+// 窗口移动到 index 之后的 maxBufferedFrameCount 帧：释放窗口之外的帧，在后台解码窗口中还没有的帧
+- (void)moveBufferWindowAfterIndex:(NSUInteger)index {
+    NSUInteger frameCount = self.animatedImageFrameCount;
+    NSUInteger windowSize = MIN(self.maxBufferedFrameCount, frameCount - 1);
+    NSMutableArray *window = [NSMutableArray arrayWithCapacity:windowSize];
+    for (NSUInteger i = 1; i <= windowSize; i++) {
+        [window addObject:@((index + i) % frameCount)];
+    }
+
+    NSMutableArray *indexesToDecode = [NSMutableArray array];
+    @synchronized (self.bufferedFrames) {
+        self.bufferWindow = window;
+        for (NSNumber *bufferedIndex in [self.bufferedFrames allKeys]) {
+            if (![window containsObject:bufferedIndex]) {
+                [self.bufferedFrames removeObjectForKey:bufferedIndex];
+            }
+        }
+        for (NSNumber *windowIndex in window) {
+            if (!self.bufferedFrames[windowIndex] && ![self.decodingIndexes containsIndex:windowIndex.unsignedIntegerValue]) {
+                [self.decodingIndexes addIndex:windowIndex.unsignedIntegerValue];
+                [indexesToDecode addObject:windowIndex];
+            }
+        }
+    }
+
+    // 预先解码的优先级比下载和 disk 缓存的解码低
+    __weak __typeof(self) wself = self;
+    for (NSNumber *windowIndex in indexesToDecode) {
+        [[SDWebImageDecodeScheduler sharedScheduler] decodeWithPriority:NSOperationQueuePriorityLow block:^UIImage *{
+            return [wself decodedFrameAtIndex:windowIndex.unsignedIntegerValue];
+        } completion:^(UIImage *frame) {
+            __strong __typeof(wself) sself = wself;
+            if (!sself) {
+                return;
+            }
+            @synchronized (sself.bufferedFrames) {
+                [sself.decodingIndexes removeIndex:windowIndex.unsignedIntegerValue];
+                // 解码的过程中窗口可能已经移走了
+                if (frame && [sself.bufferWindow containsObject:windowIndex]) {
+                    sself.bufferedFrames[windowIndex] = frame;
+                }
+            }
+        }];
+    }
+}
+
+@end
@@ -0,0 +1,70 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import <Foundation/Foundation.h>
+#import <CoreGraphics/CoreGraphics.h>
+#import "SDWebImageCompat.h"
+
+/**
+ *  解码和渐进式重绘用的位图内存池，按大小分级复用 width * height * 4 的大块内存
+ *  大小相近的图片 (例如列表中的同一种 cell) 会落在同一个级别中，复用时不需要重新分配和触发缺页
+ *  池子里保留的内存总量有上限，内存紧张时会清空池子
+ *
+ *  线程安全
+ */
+@interface SDWebImageBitmapPool : NSObject
+
+/**
+ *  池子里最多保留的空闲内存 (in bytes)，默认是 16MB
+ */
+@property (assign, nonatomic) NSUInteger maxRetainedBytes;
+
+/**
+ *  目前池子里空闲的内存 (in bytes)
+ */
+@property (assign, nonatomic, readonly) NSUInteger retainedBytes;
+
+/**
+ *  新分配内存的次数、从池子中复用的次数
+ */
+@property (assign, nonatomic, readonly) NSUInteger allocationCount;
+@property (assign, nonatomic, readonly) NSUInteger reuseCount;
+
++ (SDWebImageBitmapPool *)sharedPool;
+
+/**
+ *  借出一块至少 length 字节的内存，内容是未定义的 (复用的内存中可能有之前的数据)
+ *  返回的内存长度是 length 所在的大小级别：不小于 length，超过 16KB 时多出的部分小于 length 的 25%，
+ *  使用者可以用满整个长度；不要修改长度，归还时按长度找回所在的级别
+ */
+- (NSMutableData *)dequeueBufferWithLength:(size_t)length;
+
+/**
+ *  同上，reused 返回这块内存是从池子中复用的还是新分配的
+ */
+- (NSMutableData *)dequeueBufferWithLength:(size_t)length reused:(BOOL *)reused;
+
+/**
+ *  归还内存，超出 maxRetainedBytes 时直接释放
+ */
+- (void)enqueueBuffer:(NSMutableData *)buffer;
+
+/**
+ *  用借出的内存创建 CGDataProvider，provider 释放 (也就是用它创建的 CGImage 释放) 时内存自动还给池子
+ *
+ *  @param buffer 从这个池子借出的内存
+ *  @param length 有效数据的长度
+ */
+- (CGDataProviderRef)createDataProviderWithBuffer:(NSMutableData *)buffer length:(size_t)length CF_RETURNS_RETAINED;
+
+/**
+ *  释放所有空闲的内存
+ */
+- (void)trim;
+
+@end
@@ -0,0 +1,138 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import "SDWebImageBitmapPool.h"
+
+static const NSUInteger kDefaultMaxRetainedBytes = 16 * 1024 * 1024;
+static const size_t kMinimumBufferSizeClass = 16 * 1024;
+
+/**
+ *  内存块的大小级别：每个 2 的幂之间分成 4 级，浪费的内存不超过 25%
+ */
+FOUNDATION_STATIC_INLINE size_t SDBitmapSizeClassForLength(size_t length) {
+    if (length <= kMinimumBufferSizeClass) {
+        return kMinimumBufferSizeClass;
+    }
+    size_t power = kMinimumBufferSizeClass;
+    while (power * 2 < length) {
+        power *= 2;
+    }
+    size_t step = power / 4;
+    return (length + step - 1) / step * step;
+}
+
+// CGDataProvider 释放时把内存还给池子，info 是 @[pool, buffer]
+static void SDBitmapPoolReleaseData(void *info, const void *data, size_t size) {
+    NSArray *poolAndBuffer = (__bridge_transfer NSArray *)info;
+    [(SDWebImageBitmapPool *)poolAndBuffer[0] enqueueBuffer:poolAndBuffer[1]];
+}
+
+@interface SDWebImageBitmapPool ()
+
+// 大小级别 (NSNumber) -> 空闲的内存块 (NSMutableArray)
+@property (strong, nonatomic) NSMutableDictionary *buffers;
+@property (assign, nonatomic, readwrite) NSUInteger retainedBytes;
+@property (assign, nonatomic, readwrite) NSUInteger allocationCount;
+@property (assign, nonatomic, readwrite) NSUInteger reuseCount;
+
+@end
+
+@implementation SDWebImageBitmapPool
+
++ (SDWebImageBitmapPool *)sharedPool {
+    static dispatch_once_t once;
+    static id instance;
+    dispatch_once(&once, ^{
+        instance = [self new];
+    });
+    return instance;
+}
+
+- (id)init {
+    if ((self = [super init])) {
+        _maxRetainedBytes = kDefaultMaxRetainedBytes;
+        _buffers = [NSMutableDictionary new];
+
+#if TARGET_OS_IPHONE
+        // 内存紧张，释放池子里的内存
+        [[NSNotificationCenter defaultCenter] addObserver:self
+                                                 selector:@selector(trim)
+                                                     name:UIApplicationDidReceiveMemoryWarningNotification
+                                                   object:nil];
+#endif
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [[NSNotificationCenter defaultCenter] removeObserver:self];
+}
+
+- (NSMutableData *)dequeueBufferWithLength:(size_t)length {
+    return [self dequeueBufferWithLength:length reused:NULL];
+}
+
+- (NSMutableData *)dequeueBufferWithLength:(size_t)length reused:(BOOL *)reused {
+    size_t sizeClass = SDBitmapSizeClassForLength(length);
+    @synchronized (self.buffers) {
+        NSMutableArray *buffers = self.buffers[@(sizeClass)];
+        NSMutableData *buffer = [buffers lastObject];
+        if (buffer) {
+            [buffers removeLastObject];
+            self.retainedBytes -= buffer.length;
+            self.reuseCount++;
+            if (reused) *reused = YES;
+            return buffer;
+        }
+        self.allocationCount++;
+    }
+    if (reused) *reused = NO;
+    // 长度固定为大小级别，之后不会再改变长度，bytes 的地址一直有效
+    return [[NSMutableData alloc] initWithLength:sizeClass];
+}
+
+- (void)enqueueBuffer:(NSMutableData *)buffer {
+    size_t sizeClass = buffer.length;
+    // 不是从池子里借出的内存 (长度不是大小级别) 不收回
+    if (!buffer || sizeClass != SDBitmapSizeClassForLength(sizeClass)) {
+        return;
+    }
+    @synchronized (self.buffers) {
+        if (self.retainedBytes + sizeClass > self.maxRetainedBytes) {
+            return;
+        }
+        NSMutableArray *buffers = self.buffers[@(sizeClass)];
+        if (!buffers) {
+            buffers = [NSMutableArray new];
+            self.buffers[@(sizeClass)] = buffers;
+        }
+        [buffers addObject:buffer];
+        self.retainedBytes += sizeClass;
+    }
+}
+
+- (CGDataProviderRef)createDataProviderWithBuffer:(NSMutableData *)buffer length:(size_t)length {
+    if (!buffer || length > buffer.length) {
+        return NULL;
+    }
+    void *info = (__bridge_retained void *)@[self, buffer];
+    CGDataProviderRef provider = CGDataProviderCreateWithData(info, buffer.mutableBytes, length, SDBitmapPoolReleaseData);
+    if (!provider) {
+        CFRelease(info);
+    }
+    return provider;
+}
+
+- (void)trim {
+    @synchronized (self.buffers) {
+        [self.buffers removeAllObjects];
+        self.retainedBytes = 0;
+    }
+}
+
+@end
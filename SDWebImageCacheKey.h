@@ -0,0 +1,40 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import <Foundation/Foundation.h>
+
+/**
+ *  一个请求的 cache key，在 SDWebImageManager 中计算一次，之后经过 downloader 和 SDImageCache 都使用同一个对象
+ *  本身是一个不可变的 NSString，可以直接传给所有接收 key 的方法
+ *  hash 在创建时算好，disk 缓存的文件名 (MD5) 第一次使用时算一次，之后不再重复计算
+ */
+@interface SDWebImageCacheKey : NSString
+
+/**
+ *  key 的字符串
+ */
+@property (copy, nonatomic, readonly) NSString *string;
+
+/**
+ *  disk 缓存中的文件名，和 SDDiskFileNameForKey(string) 相同
+ */
+@property (copy, nonatomic, readonly) NSString *diskFileName;
+
+/**
+ *  @param string key 的字符串，本身已经是 SDWebImageCacheKey 时直接返回，为 nil 时返回 nil
+ */
++ (SDWebImageCacheKey *)cacheKeyWithString:(NSString *)string;
+
+@end
+
+/**
+ *  key 在 disk 缓存中的文件名：key 的 MD5 加上 key 的扩展名
+ *  key 是 SDWebImageCacheKey 时直接返回算好的文件名
+ *  和以前 SDImageCache 的 cachedFileNameForKey: 算出的文件名完全相同，升级之后已有的 disk 缓存仍然可以读到
+ */
+extern NSString *SDDiskFileNameForKey(NSString *key);
@@ -0,0 +1,110 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import "SDWebImageCacheKey.h"
+#import <CommonCrypto/CommonDigest.h>
+
+static NSString *SDComputeDiskFileNameForKey(NSString *key) {
+    // key 就是网络图片对应得 URL，通过 MD5 加密生成唯一的文件名
+    const char *str = [key UTF8String];
+    if (str == NULL) {
+        str = "";
+    }
+    unsigned char r[CC_MD5_DIGEST_LENGTH];
+    CC_MD5(str, (CC_LONG)strlen(str), r);
+    NSString *pathExtension = [key pathExtension];
+    return [NSString stringWithFormat:@"%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%@",
+            r[0], r[1], r[2], r[3], r[4], r[5], r[6], r[7], r[8], r[9], r[10],
+            r[11], r[12], r[13], r[14], r[15], [pathExtension isEqualToString:@""] ? @"" : [NSString stringWithFormat:@".%@", pathExtension]];
+}
+
+NSString *SDDiskFileNameForKey(NSString *key) {
+    if ([key isKindOfClass:[SDWebImageCacheKey class]]) {
+        return [(SDWebImageCacheKey *)key diskFileName];
+    }
+    return SDComputeDiskFileNameForKey(key);
+}
+
+@implementation SDWebImageCacheKey {
+    NSString *_string;
+    NSUInteger _hash;
+    NSString *_diskFileName;
+}
+
++ (SDWebImageCacheKey *)cacheKeyWithString:(NSString *)string {
+    if (!string) {
+        return nil;
+    }
+    if ([string isKindOfClass:[SDWebImageCacheKey class]]) {
+        return (SDWebImageCacheKey *)string;
+    }
+    SDWebImageCacheKey *key = [[self alloc] init];
+    key->_string = [string copy];
+    // 和普通 NSString 的 hash 相同，在 NSCache、NSDictionary 中可以和相同内容的 NSString 互换
+    key->_hash = [key->_string hash];
+    return key;
+}
+
+- (NSString *)string {
+    return _string;
+}
+
+// 只有 disk 操作会用到，第一次访问时才计算
+- (NSString *)diskFileName {
+    @synchronized (self) {
+        if (!_diskFileName) {
+            _diskFileName = SDComputeDiskFileNameForKey(_string);
+        }
+        return _diskFileName;
+    }
+}
+
+#pragma mark NSString
+
+// NSString 子类需要实现的基本方法，都转给 string
+- (NSUInteger)length {
+    return _string.length;
+}
+
+- (unichar)characterAtIndex:(NSUInteger)index {
+    return [_string characterAtIndex:index];
+}
+
+- (void)getCharacters:(unichar *)buffer range:(NSRange)range {
+    [_string getCharacters:buffer range:range];
+}
+
+- (const char *)UTF8String {
+    return [_string UTF8String];
+}
+
+- (NSUInteger)hash {
+    return _hash;
+}
+
+- (BOOL)isEqual:(id)object {
+    if (object == self) {
+        return YES;
+    }
+    if ([object isKindOfClass:[SDWebImageCacheKey class]]) {
+        SDWebImageCacheKey *other = object;
+        return _hash == other->_hash && [_string isEqualToString:other->_string];
+    }
+    return [_string isEqual:object];
+}
+
+- (BOOL)isEqualToString:(NSString *)aString {
+    return [self isEqual:aString];
+}
+
+// 不可变，copy 时返回自己，作为 NSDictionary 的 key 或者 copy 属性时不会丢掉算好的值
+- (id)copyWithZone:(NSZone *)zone {
+    return self;
+}
+
+@end
@@ -0,0 +1,70 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import <Foundation/Foundation.h>
+#import "SDWebImageCompat.h"
+
+/**
+ *  每批回调执行完之后调用的统计 block，在目标队列中调用
+ *
+ *  @param batchSize 这一批的回调个数
+ *  @param latency   这一批中第一个回调从提交到开始执行等待的时间 (in seconds)，反映目标队列的繁忙程度
+ */
+typedef void(^SDWebImageCompletionMetricsBlock)(NSUInteger batchSize, NSTimeInterval latency);
+
+/**
+ *  异步、合并的回调队列
+ *  提交回调的线程 (下载线程、ioQueue、解码线程) 不会等待目标队列，马上返回
+ *  目标队列忙的时候到达的回调合并成一批，只调度一次，主队列上相当于每个 run loop 执行一批
+ *  同一个队列中的回调按提交的顺序执行，queue 是并发队列时也一样 (回调经过一个以 queue 为目标的串行队列)
+ */
+@interface SDWebImageCompletionQueue : NSObject
+
+/**
+ *  回调执行的队列
+ */
+@property (strong, nonatomic, readonly) dispatch_queue_t queue;
+
+/**
+ *  已经执行的回调个数和批数
+ */
+@property (assign, nonatomic, readonly) NSUInteger deliveredCount;
+@property (assign, nonatomic, readonly) NSUInteger batchCount;
+
+/**
+ *  最大的一批的回调个数
+ */
+@property (assign, nonatomic, readonly) NSUInteger maxBatchSize;
+
+/**
+ *  所有批的等待时间的总和、最长的一次等待时间 (in seconds)
+ */
+@property (assign, nonatomic, readonly) NSTimeInterval totalLatency;
+@property (assign, nonatomic, readonly) NSTimeInterval maxLatency;
+
+/**
+ *  每批回调执行完之后调用的统计 block
+ */
+@property (copy, nonatomic) SDWebImageCompletionMetricsBlock metricsBlock;
+
+/**
+ *  在主队列中执行回调的共享实例
+ */
++ (SDWebImageCompletionQueue *)mainCompletionQueue;
+
+/**
+ *  @param queue 回调执行的队列，为 NULL 时使用主队列；可以是并发队列，回调仍然一批一批按顺序执行
+ */
+- (id)initWithQueue:(dispatch_queue_t)queue;
+
+/**
+ *  提交一个回调，马上返回
+ */
+- (void)enqueueBlock:(dispatch_block_t)block;
+
+@end
@@ -0,0 +1,110 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import "SDWebImageCompletionQueue.h"
+
+@interface SDWebImageCompletionQueue ()
+
+@property (strong, nonatomic, readwrite) dispatch_queue_t queue;
+// 实际调度 flush 的串行队列，保证上一批执行完之前下一批不会开始
+@property (strong, nonatomic) dispatch_queue_t flushQueue;
+// 还没有执行的回调，用 self 作为锁
+@property (strong, nonatomic) NSMutableArray *pendingBlocks;
+// 这一批中第一个回调提交的时间
+@property (assign, nonatomic) CFAbsoluteTime batchEnqueueTime;
+@property (assign, nonatomic, readwrite) NSUInteger deliveredCount;
+@property (assign, nonatomic, readwrite) NSUInteger batchCount;
+@property (assign, nonatomic, readwrite) NSUInteger maxBatchSize;
+@property (assign, nonatomic, readwrite) NSTimeInterval totalLatency;
+@property (assign, nonatomic, readwrite) NSTimeInterval maxLatency;
+
+@end
+
+@implementation SDWebImageCompletionQueue
+
++ (SDWebImageCompletionQueue *)mainCompletionQueue {
+    static dispatch_once_t once;
+    static id instance;
+    dispatch_once(&once, ^{
+        instance = [[self alloc] initWithQueue:dispatch_get_main_queue()];
+    });
+    return instance;
+}
+
+- (id)init {
+    return [self initWithQueue:NULL];
+}
+
+- (id)initWithQueue:(dispatch_queue_t)queue {
+    if ((self = [super init])) {
+        _queue = queue ?: dispatch_get_main_queue();
+        _pendingBlocks = [NSMutableArray new];
+        // 主队列本身是串行的，直接使用；其他队列可能是并发的，两次 flush 会同时执行并且乱序
+        if (_queue == dispatch_get_main_queue()) {
+            _flushQueue = _queue;
+        }
+        else {
+            _flushQueue = dispatch_queue_create("com.hackemist.SDWebImageCompletionQueue", DISPATCH_QUEUE_SERIAL);
+            dispatch_set_target_queue(_flushQueue, _queue);
+        }
+    }
+    return self;
+}
+
+- (void)enqueueBlock:(dispatch_block_t)block {
+    if (!block) {
+        return;
+    }
+
+    BOOL needsFlush = NO;
+    @synchronized (self) {
+        [self.pendingBlocks addObject:[block copy]];
+        // 这一批的第一个回调负责调度，之后到达的回调在执行之前都会合并进来
+        if (self.pendingBlocks.count == 1) {
+            self.batchEnqueueTime = CFAbsoluteTimeGetCurrent();
+            needsFlush = YES;
+        }
+    }
+    if (needsFlush) {
+        dispatch_async(self.flushQueue, ^{
+            [self flush];
+        });
+    }
+}
+
+#pragma mark SDWebImageCompletionQueue (private)
+
+- (void)flush {
+    NSArray *blocks = nil;
+    NSTimeInterval latency = 0;
+    @synchronized (self) {
+        blocks = self.pendingBlocks;
+        self.pendingBlocks = [NSMutableArray new];
+        latency = CFAbsoluteTimeGetCurrent() - self.batchEnqueueTime;
+    }
+
+    for (dispatch_block_t block in blocks) {
+        @autoreleasepool {
+            block();
+        }
+    }
+
+    @synchronized (self) {
+        self.deliveredCount += blocks.count;
+        self.batchCount++;
+        self.maxBatchSize = MAX(self.maxBatchSize, blocks.count);
+        self.totalLatency += latency;
+        self.maxLatency = MAX(self.maxLatency, latency);
+    }
+    SDWebImageCompletionMetricsBlock metricsBlock = self.metricsBlock;
+    if (metricsBlock) {
+        metricsBlock(blocks.count, latency);
+    }
+}
+
+@end
@@ -0,0 +1,134 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import <Foundation/Foundation.h>
+#import "SDWebImageCompat.h"
+
+@class SDWebImageBitmapPool;
+
+/**
+ *  下载数据用的固定大小的内存块池，所有的下载 operation 共用
+ *  内存紧张时会清空池子
+ */
+@interface SDWebImageDataBufferPool : NSObject
+
+/**
+ *  每个内存块的大小 (in bytes)，默认是 64KB
+ */
+@property (assign, nonatomic, readonly) NSUInteger chunkSize;
+
+/**
+ *  池子里最多保留的空闲内存块数量，默认是 32 (2MB)
+ */
+@property (assign, nonatomic) NSUInteger maxPooledChunkCount;
+
+/**
+ *  从池子中取出复用的内存块次数、新分配的内存块次数
+ */
+@property (assign, nonatomic, readonly) NSUInteger reusedChunkCount;
+@property (assign, nonatomic, readonly) NSUInteger allocatedChunkCount;
+
++ (SDWebImageDataBufferPool *)sharedPool;
+
+- (id)initWithChunkSize:(NSUInteger)chunkSize;
+
+/**
+ *  取出一个长度为 chunkSize 的内存块 (内容未定义)，池子为空时新分配一个
+ *  使用者自己记录写入了多少数据，不要修改内存块的长度
+ */
+- (NSMutableData *)dequeueChunk;
+
+/**
+ *  归还内存块，池子满了或者长度不是 chunkSize 时直接释放
+ */
+- (void)enqueueChunk:(NSMutableData *)chunk;
+
+/**
+ *  释放所有空闲的内存块
+ */
+- (void)trim;
+
+@end
+
+/**
+ *  分段的下载数据缓冲区，代替不断 appendData: 的 NSMutableData
+ *  知道数据总长度时只分配一段刚好大小的内存，实际数据超出时在这一段上扩容，数据一直是连续的；
+ *  不知道长度时 (chunked 编码) 使用池子里的固定大小内存块拼接，不会因为扩容而 realloc 和拷贝已有的数据；
+ *  不知道长度又需要连续的数据时 (边下载边解码) 使用连续模式，见 initContiguousWithCapacity:bitmapPool:
+ *  写入 disk 时可以逐段写入，不需要先拼成连续的内存
+ *
+ *  不是线程安全的，只在下载 operation 的线程中使用
+ */
+@interface SDWebImageDataBuffer : NSObject
+
+/**
+ *  目前缓冲区中数据的总长度
+ */
+@property (assign, nonatomic, readonly) NSUInteger length;
+
+/**
+ *  这个缓冲区分配内存的次数 (不包括从池子中复用的内存块)
+ */
+@property (assign, nonatomic, readonly) NSUInteger allocationCount;
+
+/**
+ *  这个缓冲区拷贝的字节数 (包括接收数据时的拷贝和拼接成连续内存时的拷贝)
+ */
+@property (assign, nonatomic, readonly) NSUInteger copiedBytes;
+
+/**
+ *  @param capacity 预计的数据总长度，0 表示未知
+ */
+- (id)initWithCapacity:(NSUInteger)capacity;
+
+/**
+ *  @param capacity 预计的数据总长度，0 表示未知
+ *  @param pool     不知道长度时使用的内存块池；nil 表示不分段，所有数据追加到一段按需扩容的内存中，
+ *                  contiguousData 总是可用，代价是扩容时的 realloc 和拷贝；
+ *                  不知道长度又需要连续的数据时应该使用 initContiguousWithCapacity:bitmapPool:
+ */
+- (id)initWithCapacity:(NSUInteger)capacity pool:(SDWebImageDataBufferPool *)pool;
+
+/**
+ *  连续模式：数据一直在一段连续的内存中，contiguousData 总是可用
+ *  内存从 bitmapPool 中按大小级别借出，空间不够时换一段至少两倍大的，已有的数据只在换的时候拷贝一次，
+ *  扩容时拷贝的总量小于数据长度的两倍；换下来的内存在不再被引用 (包括之前 contiguousData 返回的数据) 之后还给池子
+ *
+ *  @param capacity   预计的数据总长度，0 表示未知
+ *  @param bitmapPool 借出内存的池子
+ */
+- (id)initContiguousWithCapacity:(NSUInteger)capacity bitmapPool:(SDWebImageBitmapPool *)bitmapPool;
+
+- (void)appendData:(NSData *)data;
+
+/**
+ *  数据在一段连续内存中时直接返回这段内存，不拷贝；否则 (使用了池子里的内存块) 返回 nil
+ *  用于增量解码，ImageIO 每次更新都需要目前为止的全部数据
+ *  连续模式下返回的数据只包含目前为止的数据，之后追加的数据不会改变它的内容
+ */
+- (NSData *)contiguousData;
+
+/**
+ *  返回所有数据，数据分成多段时会拼接成一段 (只拷贝一次)，之后使用的内存块会还给池子
+ */
+- (NSData *)data;
+
+/**
+ *  拷贝开头的最多 length 个字节到 buffer 中，不拼接，用于识别文件头
+ *
+ *  @return 实际拷贝的字节数
+ */
+- (NSUInteger)getBytes:(void *)buffer length:(NSUInteger)length;
+
+/**
+ *  按顺序遍历每一段数据，不拼接
+ *  segment 可能直接引用池子里的内存块，只在 block 中有效，需要保留时拷贝一份
+ */
+- (void)enumerateSegmentsUsingBlock:(void (^)(NSData *segment, BOOL *stop))block;
+
+@end
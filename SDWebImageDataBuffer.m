@@ -0,0 +1,378 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import "SDWebImageDataBuffer.h"
+#import "SDWebImageBitmapPool.h"
+
+static const NSUInteger kDefaultChunkSize = 64 * 1024;
+static const NSUInteger kDefaultMaxPooledChunkCount = 32;
+
+@interface SDWebImageDataBufferPool ()
+
+@property (strong, nonatomic) NSMutableArray *chunks;
+@property (assign, nonatomic, readwrite) NSUInteger reusedChunkCount;
+@property (assign, nonatomic, readwrite) NSUInteger allocatedChunkCount;
+
+// 取出内存块，同时告诉调用者这个内存块是复用的还是新分配的
+- (NSMutableData *)dequeueChunkReused:(BOOL *)reused;
+
+@end
+
+@implementation SDWebImageDataBufferPool
+
++ (SDWebImageDataBufferPool *)sharedPool {
+    static dispatch_once_t once;
+    static id instance;
+    dispatch_once(&once, ^{
+        instance = [self new];
+    });
+    return instance;
+}
+
+- (id)init {
+    return [self initWithChunkSize:kDefaultChunkSize];
+}
+
+- (id)initWithChunkSize:(NSUInteger)chunkSize {
+    if ((self = [super init])) {
+        _chunkSize = chunkSize > 0 ? chunkSize : kDefaultChunkSize;
+        _maxPooledChunkCount = kDefaultMaxPooledChunkCount;
+        _chunks = [NSMutableArray new];
+
+#if TARGET_OS_IPHONE
+        // 内存紧张，释放池子里的内存块
+        [[NSNotificationCenter defaultCenter] addObserver:self
+                                                 selector:@selector(trim)
+                                                     name:UIApplicationDidReceiveMemoryWarningNotification
+                                                   object:nil];
+#endif
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [[NSNotificationCenter defaultCenter] removeObserver:self];
+}
+
+- (NSMutableData *)dequeueChunk {
+    return [self dequeueChunkReused:NULL];
+}
+
+- (NSMutableData *)dequeueChunkReused:(BOOL *)reused {
+    @synchronized (self.chunks) {
+        NSMutableData *chunk = [self.chunks lastObject];
+        if (chunk) {
+            [self.chunks removeLastObject];
+            self.reusedChunkCount++;
+            if (reused) *reused = YES;
+            return chunk;
+        }
+        self.allocatedChunkCount++;
+    }
+    if (reused) *reused = NO;
+    return [[NSMutableData alloc] initWithLength:self.chunkSize];
+}
+
+- (void)enqueueChunk:(NSMutableData *)chunk {
+    // 内存块的长度一直是 chunkSize，用了多少由使用者记录，归还时不修改长度，已分配的内存不会被释放
+    // 长度不对的不是池子里出去的内存块 (或者被改过长度)，不收
+    if (chunk.length != self.chunkSize) {
+        return;
+    }
+    @synchronized (self.chunks) {
+        if (self.chunks.count < self.maxPooledChunkCount) {
+            [self.chunks addObject:chunk];
+        }
+    }
+}
+
+- (void)trim {
+    @synchronized (self.chunks) {
+        [self.chunks removeAllObjects];
+    }
+}
+
+@end
+
+/**
+ *  连续模式下从 SDWebImageBitmapPool 借出的一段内存，最后一个引用 (缓冲区自己或者 contiguousData 返回的数据) 释放时还给池子
+ */
+@interface SDWebImageDataBufferBlock : NSObject
+
+@property (strong, nonatomic, readonly) NSMutableData *buffer;
+@property (strong, nonatomic, readonly) SDWebImageBitmapPool *pool;
+
+- (id)initWithBuffer:(NSMutableData *)buffer pool:(SDWebImageBitmapPool *)pool;
+
+@end
+
+@implementation SDWebImageDataBufferBlock
+
+- (id)initWithBuffer:(NSMutableData *)buffer pool:(SDWebImageBitmapPool *)pool {
+    if ((self = [super init])) {
+        _buffer = buffer;
+        _pool = pool;
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [_pool enqueueBuffer:_buffer];
+}
+
+@end
+
+/**
+ *  内存块开头 length 个字节的只读视图，不拷贝，持有内存块
+ *  缓冲区只在 length 之后追加数据，视图的内容不会改变
+ */
+@interface SDWebImageDataBufferView : NSData
+
+- (id)initWithBlock:(SDWebImageDataBufferBlock *)block length:(NSUInteger)length;
+
+@end
+
+@implementation SDWebImageDataBufferView {
+    SDWebImageDataBufferBlock *_block;
+    NSUInteger _length;
+}
+
+- (id)initWithBlock:(SDWebImageDataBufferBlock *)block length:(NSUInteger)length {
+    if ((self = [super init])) {
+        _block = block;
+        _length = length;
+    }
+    return self;
+}
+
+- (NSUInteger)length {
+    return _length;
+}
+
+- (const void *)bytes {
+    return _block.buffer.bytes;
+}
+
+@end
+
+@interface SDWebImageDataBuffer ()
+
+@property (strong, nonatomic) SDWebImageDataBufferPool *pool;
+// 连续模式借出内存的池子和目前使用的内存块，不是连续模式时为 nil
+@property (strong, nonatomic) SDWebImageBitmapPool *bitmapPool;
+@property (strong, nonatomic) SDWebImageDataBufferBlock *contiguousBlock;
+// 每一段数据 (NSMutableData)
+@property (strong, nonatomic) NSMutableArray *segments;
+// segments 中哪些是从池子里取出来的，这些用完要还回去
+@property (strong, nonatomic) NSHashTable *pooledSegments;
+// 最后一段是池子里的内存块时，这一段已经写入的字节数 (之前的内存块都是写满的)
+@property (assign, nonatomic) NSUInteger pooledTailLength;
+// 初始化时预计的数据总长度
+@property (assign, nonatomic) NSUInteger initialCapacity;
+@property (assign, nonatomic, readwrite) NSUInteger length;
+@property (assign, nonatomic, readwrite) NSUInteger allocationCount;
+@property (assign, nonatomic, readwrite) NSUInteger copiedBytes;
+
+@end
+
+@implementation SDWebImageDataBuffer
+
+- (id)init {
+    return [self initWithCapacity:0];
+}
+
+- (id)initWithCapacity:(NSUInteger)capacity {
+    return [self initWithCapacity:capacity pool:[SDWebImageDataBufferPool sharedPool]];
+}
+
+- (id)initWithCapacity:(NSUInteger)capacity pool:(SDWebImageDataBufferPool *)pool {
+    if ((self = [super init])) {
+        _pool = pool;
+        _segments = [NSMutableArray new];
+        _pooledSegments = [NSHashTable hashTableWithOptions:NSPointerFunctionsObjectPointerPersonality];
+        _initialCapacity = capacity;
+        if (capacity > 0) {
+            // 知道总长度，一次分配好，数据一直在一段连续的内存中
+            [_segments addObject:[[NSMutableData alloc] initWithCapacity:capacity]];
+            _allocationCount = 1;
+        }
+    }
+    return self;
+}
+
+- (id)initContiguousWithCapacity:(NSUInteger)capacity bitmapPool:(SDWebImageBitmapPool *)bitmapPool {
+    if ((self = [self initWithCapacity:0 pool:nil])) {
+        _bitmapPool = bitmapPool ?: [SDWebImageBitmapPool sharedPool];
+        _initialCapacity = capacity;
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [self recyclePooledSegments];
+}
+
+- (void)appendData:(NSData *)data {
+    const char *bytes = data.bytes;
+    NSUInteger remaining = data.length;
+    if (remaining == 0) {
+        return;
+    }
+    if (self.bitmapPool) {
+        [self appendContiguousBytes:bytes length:remaining];
+        return;
+    }
+
+    NSMutableData *segment = [self.segments lastObject];
+    if (!segment && !self.pool) {
+        // 不使用池子：数据都追加到一段内存中，按需扩容
+        segment = [[NSMutableData alloc] initWithCapacity:remaining];
+        [self.segments addObject:segment];
+        self.allocationCount++;
+    }
+    if (segment && ![self.pooledSegments containsObject:segment]) {
+        // 预分配的一段：超出预计长度 (例如服务器返回的长度不准) 时直接扩容，数据仍然在一段连续的内存中，
+        // 增量解码可以继续使用；扩容按一次分配计算
+        if (self.initialCapacity > 0 && segment.length <= self.initialCapacity && segment.length + remaining > self.initialCapacity) {
+            self.allocationCount++;
+        }
+        [segment appendBytes:bytes length:remaining];
+        self.copiedBytes += remaining;
+        self.length += remaining;
+        return;
+    }
+
+    while (remaining > 0) {
+        NSUInteger chunkSize = self.pool.chunkSize;
+        segment = [self.segments lastObject];
+        if (!segment || self.pooledTailLength == chunkSize) {
+            BOOL reused = NO;
+            segment = [self.pool dequeueChunkReused:&reused];
+            if (!reused) {
+                self.allocationCount++;
+            }
+            [self.segments addObject:segment];
+            [self.pooledSegments addObject:segment];
+            self.pooledTailLength = 0;
+        }
+        NSUInteger count = MIN(chunkSize - self.pooledTailLength, remaining);
+        memcpy((char *)segment.mutableBytes + self.pooledTailLength, bytes, count);
+        self.pooledTailLength += count;
+        bytes += count;
+        remaining -= count;
+        self.copiedBytes += count;
+        self.length += count;
+    }
+}
+
+- (NSData *)contiguousData {
+    if (self.bitmapPool) {
+        return self.contiguousBlock ? [[SDWebImageDataBufferView alloc] initWithBlock:self.contiguousBlock length:self.length] : nil;
+    }
+    if (self.segments.count == 1 && ![self.pooledSegments containsObject:self.segments[0]]) {
+        return self.segments[0];
+    }
+    return nil;
+}
+
+- (NSData *)data {
+    NSData *contiguousData = [self contiguousData];
+    if (contiguousData) {
+        return contiguousData;
+    }
+    if (self.length == 0 || self.bitmapPool) {
+        return [NSData data];
+    }
+
+    // 拼接成一段刚好大小的内存，只拷贝这一次
+    NSMutableData *flattenedData = [[NSMutableData alloc] initWithCapacity:self.length];
+    self.allocationCount++;
+    [self enumerateSegmentsUsingBlock:^(NSData *segment, BOOL *stop) {
+        [flattenedData appendData:segment];
+    }];
+    self.copiedBytes += self.length;
+
+    [self recyclePooledSegments];
+    [self.segments removeAllObjects];
+    [self.segments addObject:flattenedData];
+    return flattenedData;
+}
+
+- (NSUInteger)getBytes:(void *)buffer length:(NSUInteger)length {
+    __block NSUInteger copied = 0;
+    [self enumerateSegmentsUsingBlock:^(NSData *segment, BOOL *stop) {
+        NSUInteger count = MIN(segment.length, length - copied);
+        [segment getBytes:(char *)buffer + copied length:count];
+        copied += count;
+        *stop = (copied >= length);
+    }];
+    return copied;
+}
+
+- (void)enumerateSegmentsUsingBlock:(void (^)(NSData *segment, BOOL *stop))block {
+    if (!block) {
+        return;
+    }
+    BOOL stop = NO;
+    if (self.bitmapPool) {
+        NSData *contiguousData = [self contiguousData];
+        if (contiguousData.length > 0) {
+            block(contiguousData, &stop);
+        }
+        return;
+    }
+    NSMutableData *lastSegment = [self.segments lastObject];
+    for (NSMutableData *segment in self.segments) {
+        NSData *usedData = segment;
+        if ([self.pooledSegments containsObject:segment]) {
+            // 池子里的内存块长度固定，只给出写入了数据的部分，不拷贝
+            NSUInteger usedLength = segment == lastSegment ? self.pooledTailLength : segment.length;
+            usedData = [NSData dataWithBytesNoCopy:segment.mutableBytes length:usedLength freeWhenDone:NO];
+        }
+        if (usedData.length == 0) {
+            continue;
+        }
+        block(usedData, &stop);
+        if (stop) {
+            break;
+        }
+    }
+}
+
+#pragma mark SDWebImageDataBuffer (private)
+
+// 连续模式追加数据：空间不够时按两倍换一段更大的内存，换下来的内存块没有其他引用时自动还给池子
+- (void)appendContiguousBytes:(const char *)bytes length:(NSUInteger)length {
+    NSMutableData *buffer = self.contiguousBlock.buffer;
+    if (self.length + length > buffer.length) {
+        NSUInteger capacity = MAX(MAX(buffer.length * 2, self.length + length), self.initialCapacity);
+        BOOL reused = NO;
+        NSMutableData *newBuffer = [self.bitmapPool dequeueBufferWithLength:capacity reused:&reused];
+        if (!reused) {
+            self.allocationCount++;
+        }
+        if (self.length > 0) {
+            memcpy(newBuffer.mutableBytes, buffer.bytes, self.length);
+            self.copiedBytes += self.length;
+        }
+        self.contiguousBlock = [[SDWebImageDataBufferBlock alloc] initWithBuffer:newBuffer pool:self.bitmapPool];
+    }
+    memcpy((char *)self.contiguousBlock.buffer.mutableBytes + self.length, bytes, length);
+    self.copiedBytes += length;
+    self.length += length;
+}
+
+- (void)recyclePooledSegments {
+    for (NSMutableData *segment in self.pooledSegments) {
+        [self.pool enqueueChunk:segment];
+    }
+    [self.pooledSegments removeAllObjects];
+    self.pooledTailLength = 0;
+}
+
+@end
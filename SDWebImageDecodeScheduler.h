@@ -0,0 +1,98 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import <Foundation/Foundation.h>
+#import "SDWebImageCompat.h"
+
+/**
+ *  在解码线程中执行的解码 block
+ *
+ *  @return 解码后的图片
+ */
+typedef UIImage *(^SDWebImageDecodeBlock)(void);
+
+/**
+ *  解码完成后调用的 block，在解码线程中调用
+ *
+ *  @param image 解码后的图片
+ */
+typedef void(^SDWebImageDecodeCompletionBlock)(UIImage *image);
+
+/**
+ *  每次解码完成后调用的统计 block，在解码线程中调用
+ *
+ *  @param waitTime   解码任务在队列中等待的时间 (in seconds)
+ *  @param decodeTime 解码耗费的时间 (in seconds)
+ */
+typedef void(^SDWebImageDecodeMetricsBlock)(NSTimeInterval waitTime, NSTimeInterval decodeTime);
+
+/**
+ *  统一的解码调度器
+ *  下载完成、disk 缓存读取、transform 的解码都放在这里执行，和网络线程、ioQueue 分开，
+ *  并且限制同时解码的数量，避免快速滑动时 CPU 突增和线程爆炸
+ */
+@interface SDWebImageDecodeScheduler : NSObject
+
+/**
+ *  同时解码的最大数量，默认是 CPU 核数 (至少为 2)
+ */
+@property (assign, nonatomic) NSInteger maxConcurrentDecodes;
+
+/**
+ *  已经完成的解码数量
+ */
+@property (assign, nonatomic, readonly) NSUInteger decodeCount;
+
+/**
+ *  所有解码耗费的总时间、最长的一次解码时间 (in seconds)
+ */
+@property (assign, nonatomic, readonly) NSTimeInterval totalDecodeTime;
+@property (assign, nonatomic, readonly) NSTimeInterval maxDecodeTime;
+
+/**
+ *  所有解码任务在队列中等待的总时间 (in seconds)
+ */
+@property (assign, nonatomic, readonly) NSTimeInterval totalWaitTime;
+
+/**
+ *  正在执行的解码数量、同时执行的解码数量的最大值
+ *  正常情况下最大值不会超过 maxConcurrentDecodes；在解码线程中同步调用的嵌套解码在同一个线程中执行，也计算在内
+ */
+@property (assign, nonatomic, readonly) NSUInteger activeDecodeCount;
+@property (assign, nonatomic, readonly) NSUInteger peakActiveDecodeCount;
+
+/**
+ *  每次解码完成后调用的统计 block
+ */
+@property (copy, nonatomic) SDWebImageDecodeMetricsBlock metricsBlock;
+
++ (SDWebImageDecodeScheduler *)sharedScheduler;
+
+/**
+ *  异步解码
+ *
+ *  @param priority        解码的优先级
+ *  @param decodeBlock     解码的 block
+ *  @param completionBlock 解码完成后调用的 block，任务在开始前被取消时不会调用
+ *
+ *  @return 解码任务，开始解码之前可以取消
+ */
+- (NSOperation *)decodeWithPriority:(NSOperationQueuePriority)priority
+                              block:(SDWebImageDecodeBlock)decodeBlock
+                         completion:(SDWebImageDecodeCompletionBlock)completionBlock;
+
+/**
+ *  同步解码，会阻塞当前线程直到解码完成
+ *  用于本来就在后台线程中、需要马上拿到结果的地方；在解码线程中调用时直接执行
+ *
+ *  @return 解码后的图片
+ */
+- (UIImage *)decodeSynchronouslyWithPriority:(NSOperationQueuePriority)priority
+                                       block:(SDWebImageDecodeBlock)decodeBlock;
+
+@end
@@ -0,0 +1,136 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import "SDWebImageDecodeScheduler.h"
+
+@interface SDWebImageDecodeScheduler ()
+
+@property (strong, nonatomic) NSOperationQueue *decodeQueue;
+@property (assign, nonatomic, readwrite) NSUInteger decodeCount;
+@property (assign, nonatomic, readwrite) NSTimeInterval totalDecodeTime;
+@property (assign, nonatomic, readwrite) NSTimeInterval maxDecodeTime;
+@property (assign, nonatomic, readwrite) NSTimeInterval totalWaitTime;
+@property (assign, nonatomic, readwrite) NSUInteger activeDecodeCount;
+@property (assign, nonatomic, readwrite) NSUInteger peakActiveDecodeCount;
+
+@end
+
+@implementation SDWebImageDecodeScheduler
+
++ (SDWebImageDecodeScheduler *)sharedScheduler {
+    static dispatch_once_t once;
+    static id instance;
+    dispatch_once(&once, ^{
+        instance = [self new];
+    });
+    return instance;
+}
+
+- (id)init {
+    if ((self = [super init])) {
+        _decodeQueue = [NSOperationQueue new];
+        _decodeQueue.name = @"com.hackemist.SDWebImageDecodeQueue";
+        _decodeQueue.maxConcurrentOperationCount = MAX([[NSProcessInfo processInfo] activeProcessorCount], 2);
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [self.decodeQueue cancelAllOperations];
+}
+
+- (void)setMaxConcurrentDecodes:(NSInteger)maxConcurrentDecodes {
+    _decodeQueue.maxConcurrentOperationCount = maxConcurrentDecodes;
+}
+
+- (NSInteger)maxConcurrentDecodes {
+    return _decodeQueue.maxConcurrentOperationCount;
+}
+
+- (NSOperation *)decodeWithPriority:(NSOperationQueuePriority)priority
+                              block:(SDWebImageDecodeBlock)decodeBlock
+                         completion:(SDWebImageDecodeCompletionBlock)completionBlock {
+    if (!decodeBlock) {
+        return nil;
+    }
+
+    NSOperation *operation = [self operationWithPriority:priority block:decodeBlock completion:completionBlock];
+    // 被取消的任务在开始之前会被 NSOperationQueue 跳过，不会解码
+    [self.decodeQueue addOperation:operation];
+    return operation;
+}
+
+- (UIImage *)decodeSynchronouslyWithPriority:(NSOperationQueuePriority)priority
+                                       block:(SDWebImageDecodeBlock)decodeBlock {
+    if (!decodeBlock) {
+        return nil;
+    }
+
+    __block UIImage *decodedImage = nil;
+    NSOperation *operation = [self operationWithPriority:priority block:decodeBlock completion:^(UIImage *image) {
+        decodedImage = image;
+    }];
+
+    // 已经在解码线程中了，再等待其他的解码线程可能会导致所有的线程互相等待
+    if ([NSOperationQueue currentQueue] == self.decodeQueue) {
+        [operation start];
+    }
+    else {
+        [self.decodeQueue addOperation:operation];
+        [operation waitUntilFinished];
+    }
+    return decodedImage;
+}
+
+#pragma mark SDWebImageDecodeScheduler (private)
+
+- (NSOperation *)operationWithPriority:(NSOperationQueuePriority)priority
+                                 block:(SDWebImageDecodeBlock)decodeBlock
+                            completion:(SDWebImageDecodeCompletionBlock)completionBlock {
+    CFAbsoluteTime enqueueTime = CFAbsoluteTimeGetCurrent();
+    __weak __typeof(self) wself = self;
+    NSBlockOperation *operation = [NSBlockOperation blockOperationWithBlock:^{
+        CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
+        [wself decodeDidStart];
+        UIImage *image = nil;
+        @autoreleasepool {
+            image = decodeBlock();
+        }
+        CFAbsoluteTime endTime = CFAbsoluteTimeGetCurrent();
+        [wself recordWaitTime:startTime - enqueueTime decodeTime:endTime - startTime];
+
+        if (completionBlock) {
+            completionBlock(image);
+        }
+    }];
+    operation.queuePriority = priority;
+    return operation;
+}
+
+- (void)decodeDidStart {
+    @synchronized (self) {
+        self.activeDecodeCount++;
+        self.peakActiveDecodeCount = MAX(self.peakActiveDecodeCount, self.activeDecodeCount);
+    }
+}
+
+- (void)recordWaitTime:(NSTimeInterval)waitTime decodeTime:(NSTimeInterval)decodeTime {
+    @synchronized (self) {
+        self.activeDecodeCount--;
+        self.decodeCount++;
+        self.totalWaitTime += waitTime;
+        self.totalDecodeTime += decodeTime;
+        self.maxDecodeTime = MAX(self.maxDecodeTime, decodeTime);
+    }
+    SDWebImageDecodeMetricsBlock metricsBlock = self.metricsBlock;
+    if (metricsBlock) {
+        metricsBlock(waitTime, decodeTime);
+    }
+}
+
+@end
@@ -10,6 +10,8 @@
 #import "SDWebImageCompat.h"
 #import "SDWebImageOperation.h"
 
+@class SDImageCacheFileWriter;
+
 typedef NS_OPTIONS(NSUInteger, SDWebImageDownloaderOptions) {
     // 图片的下载在较低的优先级队列
     SDWebImageDownloaderLowPriority = 1 << 0,
@@ -36,6 +38,11 @@ typedef NS_OPTIONS(NSUInteger, SDWebImageDownloaderOptions) {
     
     // 将图片的下载放在优先级较高的队列中
     SDWebImageDownloaderHighPriority = 1 << 7,
+    
+    // 边下载边解码，数据到达时就交给增量解码器解析，下载完成后马上得到解码好的图片
+    // 与 SDWebImageDownloaderProgressiveDownload 不同，不会回调部分图片
+    // 响应没有给出长度时 (chunked 编码) 数据放在一段按需扩容的内存中，不使用分段的内存块池
+    SDWebImageDownloaderStreamingDecode = 1 << 8,
 };
 
 typedef NS_ENUM(NSInteger, SDWebImageDownloaderExecutionOrder) {
@@ -47,6 +54,28 @@ typedef NS_ENUM(NSInteger, SDWebImageDownloaderExecutionOrder) {
 
 // 下载开始的通知
 extern NSString *const SDWebImageDownloadStartNotification;
+
+/**
+ *  下载图片时附带的上下文 (context) 中可以使用的键
+ *  同一个 URL 同时有多个下载请求时只会创建一个 operation，使用第一个请求的 context
+ */
+// SDWebImageDownloaderCacheFileWriterBlock，收到有效的响应时调用一次，创建边下载边写入 disk 缓存的 writer
+// 接收到的数据会同时写入这个 writer，下载成功后直接提交到 disk 缓存；合并进来的请求不会调用自己的 block
+extern NSString *const SDWebImageDownloaderContextCacheFileWriterBlockKey;
+// NSValue (CGSize)，下载完成后直接缩小解码到这个像素大小，见 SDImageCache 的 targetPixelSize
+extern NSString *const SDWebImageDownloaderContextTargetPixelSizeKey;
+// id<SDWebImageTransformer>，解码之后马上在解码线程中执行的 transform，回调拿到的是 transform 之后的图片
+extern NSString *const SDWebImageDownloaderContextTransformerKey;
+// NSString (通常是 SDWebImageCacheKey)，图片的 cache key，用来从 key 中的 @2x/@3x 判断图片的 scale
+// 没有设置时使用 URL 的 absoluteString
+extern NSString *const SDWebImageDownloaderContextCacheKeyKey;
+// SDImageCacheValidators，disk 缓存中保存的 HTTP 校验值，有的话发送条件请求 (If-None-Match / If-Modified-Since)
+// 服务器返回 304 时不会下载数据，completedBlock 的 image、data、error 都是 nil，finished 是 YES
+// 条件请求只和相同 URL 的条件请求合并
+extern NSString *const SDWebImageDownloaderContextValidatorsKey;
+// SDWebImageDownloaderResponseBlock，收到响应时调用
+// 和其他的键不同，合并到同一个下载中的每个请求自己的 block 都会被调用 (收到响应之后才合并进来的请求不会被调用)
+extern NSString *const SDWebImageDownloaderContextResponseBlockKey;
 // 下载停止的通知
 extern NSString *const SDWebImageDownloadStopNotification;
 
@@ -68,6 +97,20 @@ typedef void(^SDWebImageDownloaderProgressBlock)(NSInteger receivedSize, NSInteg
  */
 typedef void(^SDWebImageDownloaderCompletedBlock)(UIImage *image, NSData *data, NSError *error, BOOL finished);
 
+/**
+ *  收到响应时调用的 block，在下载线程中调用，在接收数据之前
+ *
+ *  @param response        下载的响应，包括 304
+ *  @param cacheFileWriter 这个下载边下载边写入的 writer (可能是合并的另一个请求创建的)，没有时为 nil
+ *                         下载成功、completedBlock 调用时 writer 已经提交，isCommitted 为 YES 时数据已经在 disk 缓存中
+ */
+typedef void(^SDWebImageDownloaderResponseBlock)(NSURLResponse *response, SDImageCacheFileWriter *cacheFileWriter);
+
+/**
+ *  创建边下载边写入 disk 缓存的 writer，只有真正发起下载的请求会被调用，在下载线程中调用
+ */
+typedef SDImageCacheFileWriter *(^SDWebImageDownloaderCacheFileWriterBlock)(void);
+
 // TODO: More details
 /**
  *  Header 过滤
@@ -88,6 +131,15 @@ typedef NSDictionary *(^SDWebImageDownloaderHeadersFilterBlock)(NSURL *url, NSDi
 // 默认是 YES，当你因为内存消耗而 crash 时，将这个属性设为 NO
 @property (assign, nonatomic) BOOL shouldDecompressImages;
 
+// 多帧的动图是否解码成 SDWebImageAnimatedImage (按需解码每一帧)，默认是 NO
+@property (assign, nonatomic) BOOL shouldDecodeAnimatedImagesLazily;
+
+// 解码时是否把 EXIF 方向应用到像素上，得到方向为 Up 的图片，默认是 NO
+@property (assign, nonatomic) BOOL shouldBakeImageOrientation;
+
+// 阶段性下载时两次生成部分图片之间的最小间隔 (in seconds)，默认是 0.1s
+@property (assign, nonatomic) NSTimeInterval minimumProgressiveInterval;
+
 // 最多的并发数（最多能同时下载多少张图片）
 @property (assign, nonatomic) NSInteger maxConcurrentDownloads;
 
@@ -97,6 +149,10 @@ typedef NSDictionary *(^SDWebImageDownloaderHeadersFilterBlock)(NSURL *url, NSDi
 // 下载图片的 timeout(in seconds)，默认是 15.0s
 @property (assign, nonatomic) NSTimeInterval downloadTimeout;
 
+// 被取消的下载保留的部分数据的总大小上限 (in bytes)，用于再次请求同一个 URL 时断点续传
+// 默认是 10MB，设为 0 则不保留部分数据
+@property (assign, nonatomic) NSUInteger maxPartialDataSize;
+
 // 图片下载顺序(FIFO/FILO)
 @property (assign, nonatomic) SDWebImageDownloaderExecutionOrder executionOrder;
 
@@ -157,6 +213,17 @@ typedef NSDictionary *(^SDWebImageDownloaderHeadersFilterBlock)(NSURL *url, NSDi
                                          options:(SDWebImageDownloaderOptions)options
                                         progress:(SDWebImageDownloaderProgressBlock)progressBlock
                                        completed:(SDWebImageDownloaderCompletedBlock)completedBlock;
+
+/**
+ *  与上面的方法相同，多了一个下载的上下文
+ *
+ *  @param context 下载的上下文，可用的键见 SDWebImageDownloaderContext...Key
+ */
+- (id <SDWebImageOperation>)downloadImageWithURL:(NSURL *)url
+                                         options:(SDWebImageDownloaderOptions)options
+                                         context:(NSDictionary *)context
+                                        progress:(SDWebImageDownloaderProgressBlock)progressBlock
+                                       completed:(SDWebImageDownloaderCompletedBlock)completedBlock;
 /**
  *  设置下载队列的挂起状态
  */
@@ -8,10 +8,23 @@
 
 #import "SDWebImageDownloader.h"
 #import "SDWebImageDownloaderOperation.h"
+#import "SDWebImageTransformer.h"
+#import "SDImageCache.h"
 #import <ImageIO/ImageIO.h>
 
+NSString *const SDWebImageDownloaderContextCacheFileWriterBlockKey = @"SDWebImageDownloaderContextCacheFileWriterBlockKey";
+NSString *const SDWebImageDownloaderContextTargetPixelSizeKey = @"SDWebImageDownloaderContextTargetPixelSizeKey";
+NSString *const SDWebImageDownloaderContextTransformerKey = @"SDWebImageDownloaderContextTransformerKey";
+NSString *const SDWebImageDownloaderContextCacheKeyKey = @"SDWebImageDownloaderContextCacheKeyKey";
+NSString *const SDWebImageDownloaderContextValidatorsKey = @"SDWebImageDownloaderContextValidatorsKey";
+NSString *const SDWebImageDownloaderContextResponseBlockKey = @"SDWebImageDownloaderContextResponseBlockKey";
+
 static NSString *const kProgressCallbackKey = @"progress";
 static NSString *const kCompletedCallbackKey = @"completed";
+static NSString *const kResponseCallbackKey = @"response";
+
+// 默认保留的部分数据大小上限 10MB
+static const NSUInteger kDefaultMaxPartialDataSize = 10 * 1024 * 1024;
 
 @interface SDWebImageDownloader ()
 
@@ -19,7 +32,11 @@ static NSString *const kCompletedCallbackKey = @"completed";
 @property (weak, nonatomic) NSOperation *lastAddedOperation;
 @property (assign, nonatomic) Class operationClass;
 @property (strong, nonatomic) NSMutableDictionary *URLCallbacks;
+// callbacksKey -> 正在执行的下载 operation，和 URLCallbacks 一起在 barrierQueue 中读写
+@property (strong, nonatomic) NSMapTable *URLOperations;
 @property (strong, nonatomic) NSMutableDictionary *HTTPHeaders;
+// 被取消的下载的部分数据，URL -> SDWebImageDownloaderPartialData，按字节数计算 cost
+@property (strong, nonatomic) NSCache *partialDataCache;
 
 // This queue is used to serialize the handling of the network responses of all the download operation in a single queue
 // 这个队列是用来按顺序处理所有的网络响应
@@ -72,6 +89,7 @@ static NSString *const kCompletedCallbackKey = @"completed";
         _downloadQueue = [NSOperationQueue new];
         _downloadQueue.maxConcurrentOperationCount = 6; // 最多同时下载6张图片
         _URLCallbacks = [NSMutableDictionary new];
+        _URLOperations = [NSMapTable strongToWeakObjectsMapTable];
 #ifdef SD_WEBP
         _HTTPHeaders = [@{@"Accept": @"image/webp,image/*;q=0.8"} mutableCopy];
 #else
@@ -79,6 +97,11 @@ static NSString *const kCompletedCallbackKey = @"completed";
 #endif
         _barrierQueue = dispatch_queue_create("com.hackemist.SDWebImageDownloaderBarrierQueue", DISPATCH_QUEUE_CONCURRENT); // 并行队列
         _downloadTimeout = 15.0;
+        _minimumProgressiveInterval = 0.1;
+        _partialDataCache = [NSCache new];
+        _partialDataCache.name = @"com.hackemist.SDWebImageDownloaderPartialDataCache";
+        _maxPartialDataSize = kDefaultMaxPartialDataSize;
+        _partialDataCache.totalCostLimit = kDefaultMaxPartialDataSize;
     }
     return self;
 }
@@ -118,26 +141,65 @@ static NSString *const kCompletedCallbackKey = @"completed";
     return _downloadQueue.maxConcurrentOperationCount;
 }
 
+// 设置保留部分数据的上限，NSCache 的 totalCostLimit 为 0 表示不限制，所以 0 时直接清空
+- (void)setMaxPartialDataSize:(NSUInteger)maxPartialDataSize {
+    _maxPartialDataSize = maxPartialDataSize;
+    _partialDataCache.totalCostLimit = maxPartialDataSize;
+    if (maxPartialDataSize == 0) {
+        [_partialDataCache removeAllObjects];
+    }
+}
+
 // 设置 operation class，默认是 SDWebImageDownloaderOperation
 - (void)setOperationClass:(Class)operationClass {
     _operationClass = operationClass ?: [SDWebImageDownloaderOperation class];
 }
 
+- (id <SDWebImageOperation>)downloadImageWithURL:(NSURL *)url options:(SDWebImageDownloaderOptions)options progress:(SDWebImageDownloaderProgressBlock)progressBlock completed:(SDWebImageDownloaderCompletedBlock)completedBlock {
+    return [self downloadImageWithURL:url options:options context:nil progress:progressBlock completed:completedBlock];
+}
+
 /** MOST IMPORTANT
  *  下载网络图片
  *
  *  @param url            图片的 URL
  *  @param options        下载时的选项
+ *  @param context        下载的上下文
  *  @param progressBlock  下载过程中会不断调用的 block
  *  @param completedBlock 下载完成后会调用的 block
  *
  *  @return 下载的 operation，可以给外面用来取消下载操作
  */
-- (id <SDWebImageOperation>)downloadImageWithURL:(NSURL *)url options:(SDWebImageDownloaderOptions)options progress:(SDWebImageDownloaderProgressBlock)progressBlock completed:(SDWebImageDownloaderCompletedBlock)completedBlock {
+- (id <SDWebImageOperation>)downloadImageWithURL:(NSURL *)url options:(SDWebImageDownloaderOptions)options context:(NSDictionary *)context progress:(SDWebImageDownloaderProgressBlock)progressBlock completed:(SDWebImageDownloaderCompletedBlock)completedBlock {
     __block SDWebImageDownloaderOperation *operation;
+    // cancelled block 由 operation 持有，只能弱引用 operation
+    __block __weak SDWebImageDownloaderOperation *weakOperation = nil;
     __weak __typeof(self)wself = self;
+    // 调用方 (SDWebImageManager) 在调用之前设置的当前请求
+    SDWebImageTraceID traceID = SDWebImageTraceCurrentID();
+
+    // 同一个 URL 只有解码的目标大小和 transform 都相同时才合并成一个下载，否则回调拿到的图片会不对
+    id callbacksKey = url;
+    NSValue *targetPixelSizeValue = context[SDWebImageDownloaderContextTargetPixelSizeKey];
+    id<SDWebImageTransformer> transformer = context[SDWebImageDownloaderContextTransformerKey];
+    if (url && (targetPixelSizeValue || transformer)) {
+        NSString *variantKey = url.absoluteString;
+        if (targetPixelSizeValue) {
+            CGSize targetPixelSize = [targetPixelSizeValue CGSizeValue];
+            variantKey = [NSString stringWithFormat:@"%@#SDTargetPixelSize=%.0fx%.0f", variantKey, targetPixelSize.width, targetPixelSize.height];
+        }
+        if (transformer) {
+            variantKey = SDTransformedKeyForKey(variantKey, transformer.transformerKey);
+        }
+        callbacksKey = variantKey;
+    }
+    // 条件请求可能得到没有数据的 304，不能和需要图片数据的普通请求合并
+    SDImageCacheValidators *validators = context[SDWebImageDownloaderContextValidatorsKey];
+    if (url && validators) {
+        callbacksKey = [NSString stringWithFormat:@"%@#SDConditional", [callbacksKey isKindOfClass:[NSURL class]] ? [callbacksKey absoluteString] : callbacksKey];
+    }
 
-    [self addProgressCallback:progressBlock andCompletedBlock:completedBlock forURL:url createCallback:^{
+    [self addProgressCallback:progressBlock andCompletedBlock:completedBlock responseBlock:context[SDWebImageDownloaderContextResponseBlockKey] forURL:url callbacksKey:callbacksKey createCallback:^{
         // 设置 timeout，默认 15.0s
         NSTimeInterval timeoutInterval = wself.downloadTimeout;
         if (timeoutInterval == 0.0) {
@@ -156,6 +218,22 @@ static NSString *const kCompletedCallbackKey = @"completed";
         else {
             request.allHTTPHeaderFields = wself.HTTPHeaders;
         }
+
+        // 用 disk 缓存中保存的校验值发送条件请求，图片没有变化时服务器返回 304，不需要重新下载
+        if (validators) {
+            if (validators.ETag) [request setValue:validators.ETag forHTTPHeaderField:@"If-None-Match"];
+            if (validators.lastModified) [request setValue:validators.lastModified forHTTPHeaderField:@"If-Modified-Since"];
+        }
+
+        // 之前被取消的下载留下了部分数据，用 Range 请求续传剩余的部分
+        // If-Range 保证资源改变时服务器返回完整的 200 响应，而不是拼接出错误的数据
+        // 条件请求不续传，部分数据留给之后的普通请求
+        SDWebImageDownloaderPartialData *partialData = validators ? nil : [wself.partialDataCache objectForKey:url];
+        if (partialData) {
+            [wself.partialDataCache removeObjectForKey:url];
+            [request setValue:[NSString stringWithFormat:@"bytes=%lu-", (unsigned long)partialData.data.length] forHTTPHeaderField:@"Range"];
+            [request setValue:partialData.validator forHTTPHeaderField:@"If-Range"];
+        }
         // 初始化一个 SDWebImageDownloaderOperation
         // operation 只有在被添加到 NSOperationQueue 或者调用 start 方法时，会开始执行
         operation = [[wself.operationClass alloc] initWithRequest:request
@@ -165,7 +243,7 @@ static NSString *const kCompletedCallbackKey = @"completed";
                                                              if (!sself) return;
                                                              __block NSArray *callbacksForURL;
                                                              dispatch_sync(sself.barrierQueue, ^{
-                                                                 callbacksForURL = [sself.URLCallbacks[url] copy];
+                                                                 callbacksForURL = [sself.URLCallbacks[callbacksKey] copy];
                                                              });
                                                              // 调用 URL 对应所有的 progress block
                                                              for (NSDictionary *callbacks in callbacksForURL) {
@@ -180,9 +258,10 @@ static NSString *const kCompletedCallbackKey = @"completed";
                                                             if (!sself) return;
                                                             __block NSArray *callbacksForURL;
                                                             dispatch_barrier_sync(sself.barrierQueue, ^{
-                                                                callbacksForURL = [sself.URLCallbacks[url] copy];
+                                                                callbacksForURL = [sself.URLCallbacks[callbacksKey] copy];
                                                                 if (finished) { // 如果下载完成，就从 URLCallbacks 删除对应的 MutableArray
-                                                                    [sself.URLCallbacks removeObjectForKey:url];
+                                                                    [sself.URLCallbacks removeObjectForKey:callbacksKey];
+                                                                    [sself.URLOperations removeObjectForKey:callbacksKey];
                                                                 }
                                                             });
                                                             // 调用 URL 对应的所有的 completion block
@@ -194,13 +273,41 @@ static NSString *const kCompletedCallbackKey = @"completed";
                                                         cancelled:^{
                                                             SDWebImageDownloader *sself = wself;
                                                             if (!sself) return;
+                                                            // 保留已经下载的部分数据，下次请求这个 URL 时续传
+                                                            // cancelBlock 在 operation reset 之前调用，此时数据还在
+                                                            if (sself.maxPartialDataSize > 0) {
+                                                                SDWebImageDownloaderPartialData *partialData = [weakOperation partialDataForResume];
+                                                                if (partialData) {
+                                                                    [sself.partialDataCache setObject:partialData forKey:url cost:partialData.data.length];
+                                                                }
+                                                            }
                                                             // 下载取消，就从 URLCallbacks 删除对应的 MutableArray
                                                             dispatch_barrier_async(sself.barrierQueue, ^{
-                                                                [sself.URLCallbacks removeObjectForKey:url];
+                                                                [sself.URLCallbacks removeObjectForKey:callbacksKey];
+                                                                [sself.URLOperations removeObjectForKey:callbacksKey];
                                                             });
                                                         }];
+        weakOperation = operation;
         // 设置 operation 的各项属性
         operation.shouldDecompressImages = wself.shouldDecompressImages;
+        operation.shouldDecodeAnimatedImagesLazily = wself.shouldDecodeAnimatedImagesLazily;
+        operation.shouldBakeImageOrientation = wself.shouldBakeImageOrientation;
+        operation.minimumProgressiveInterval = wself.minimumProgressiveInterval;
+        operation.resumeData = partialData;
+        operation.context = context;
+        // 调用合并到这个下载中的所有请求的 response block
+        operation.responseBlock = ^(NSURLResponse *response, SDImageCacheFileWriter *cacheFileWriter) {
+            SDWebImageDownloader *sself = wself;
+            if (!sself) return;
+            __block NSArray *callbacksForURL;
+            dispatch_sync(sself.barrierQueue, ^{
+                callbacksForURL = [sself.URLCallbacks[callbacksKey] copy];
+            });
+            for (NSDictionary *callbacks in callbacksForURL) {
+                SDWebImageDownloaderResponseBlock callback = callbacks[kResponseCallbackKey];
+                if (callback) callback(response, cacheFileWriter);
+            }
+        };
         
         if (wself.username && wself.password) {
             operation.credential = [NSURLCredential credentialWithUser:wself.username password:wself.password persistence:NSURLCredentialPersistenceForSession];
@@ -212,6 +319,11 @@ static NSString *const kCompletedCallbackKey = @"completed";
             operation.queuePriority = NSOperationQueuePriorityLow;
         }
 
+        // createCallback 在 barrierQueue 中执行，可以直接记录
+        [wself.URLOperations setObject:operation forKey:callbacksKey];
+
+        operation.traceID = traceID;
+
         // 添加 operation，开始执行 operation
         [wself.downloadQueue addOperation:operation];
         if (wself.executionOrder == SDWebImageDownloaderLIFOExecutionOrder) {
@@ -222,10 +334,28 @@ static NSString *const kCompletedCallbackKey = @"completed";
         }
     }];
 
+    // 合并到已有的下载中时，这个请求的优先级更高就提升已有下载的优先级
+    // 例如预加载的低优先级下载，在同一个 URL 要显示时不再排在其他下载后面
+    if (!operation && url && !(options & SDWebImageDownloaderLowPriority)) {
+        NSOperationQueuePriority priority = (options & SDWebImageDownloaderHighPriority) ? NSOperationQueuePriorityHigh : NSOperationQueuePriorityNormal;
+        [self promoteOperationForCallbacksKey:callbacksKey toPriority:priority];
+    }
+
     return operation;
 }
 
-- (void)addProgressCallback:(SDWebImageDownloaderProgressBlock)progressBlock andCompletedBlock:(SDWebImageDownloaderCompletedBlock)completedBlock forURL:(NSURL *)url createCallback:(SDWebImageNoParamsBlock)createCallback {
+- (void)promoteOperationForCallbacksKey:(id)callbacksKey toPriority:(NSOperationQueuePriority)priority {
+    __block NSOperation *existingOperation = nil;
+    dispatch_sync(self.barrierQueue, ^{
+        existingOperation = [self.URLOperations objectForKey:callbacksKey];
+    });
+    if (existingOperation && existingOperation.queuePriority < priority) {
+        existingOperation.queuePriority = priority;
+    }
+}
+
+// callbacksKey 是 URLCallbacks 中的键，一般就是 url 本身
+- (void)addProgressCallback:(SDWebImageDownloaderProgressBlock)progressBlock andCompletedBlock:(SDWebImageDownloaderCompletedBlock)completedBlock responseBlock:(SDWebImageDownloaderResponseBlock)responseBlock forURL:(NSURL *)url callbacksKey:(id)callbacksKey createCallback:(SDWebImageNoParamsBlock)createCallback {
     // The URL will be used as the key to the callbacks dictionary so it cannot be nil. If it is nil immediately call the completed block with no image or data.
     // URL 会被用在字典 callbacks 中当做键，所以不能是 nil
     if (url == nil) {
@@ -239,21 +369,22 @@ static NSString *const kCompletedCallbackKey = @"completed";
     // 阻塞后面的 operation，保证在某一时刻这有这个 block 在执行
     dispatch_barrier_sync(self.barrierQueue, ^{
         BOOL first = NO; // 标识，判断是否是第一次创建这个 URL 的回调 block
-        if (!self.URLCallbacks[url]) {
+        if (!self.URLCallbacks[callbacksKey]) {
             // 初始化这个 URL 对应的可变数组
-            self.URLCallbacks[url] = [NSMutableArray new];
+            self.URLCallbacks[callbacksKey] = [NSMutableArray new];
             first = YES;
         }
 
         // Handle single download of simultaneous download request for the same URL
         // URLCallbacks(NSDictionary) -> (NSURL: NSMutableArray) -> (NSMutableDictionary) -> { kProgressCallbackKey : progressBlock, kCompletedCallbackKey : completedBlock }
         // 一个 URL 可能会有多个 progressBlock、completedBlock
-        NSMutableArray *callbacksForURL = self.URLCallbacks[url];
+        NSMutableArray *callbacksForURL = self.URLCallbacks[callbacksKey];
         NSMutableDictionary *callbacks = [NSMutableDictionary new];
         if (progressBlock) callbacks[kProgressCallbackKey] = [progressBlock copy];
         if (completedBlock) callbacks[kCompletedCallbackKey] = [completedBlock copy];
+        if (responseBlock) callbacks[kResponseCallbackKey] = [responseBlock copy];
         [callbacksForURL addObject:callbacks];
-        self.URLCallbacks[url] = callbacksForURL;
+        self.URLCallbacks[callbacksKey] = callbacksForURL;
 
         if (first) {
             // 初始化 HTTP 请求
@@ -9,6 +9,8 @@
 #import <Foundation/Foundation.h>
 #import "SDWebImageDownloader.h"
 #import "SDWebImageOperation.h"
+#import "SDImageFormat.h"
+#import "SDWebImageTracer.h"
 
 // 定义通知常量
 extern NSString *const SDWebImageDownloadStartNotification;
@@ -16,6 +18,29 @@ extern NSString *const SDWebImageDownloadReceiveResponseNotification;
 extern NSString *const SDWebImageDownloadStopNotification;
 extern NSString *const SDWebImageDownloadFinishNotification;
 
+/**
+ *  被取消的下载中已经接收到的部分数据，用于下次请求同一个 URL 时断点续传
+ */
+@interface SDWebImageDownloaderPartialData : NSObject
+
+/**
+ *  已经下载的二进制数据
+ */
+@property (strong, nonatomic, readonly) NSData *data;
+
+/**
+ *  资源的校验值，优先使用 ETag，没有（或者是弱 ETag）时使用 Last-Modified，续传时作为 If-Range 的值
+ */
+@property (copy, nonatomic, readonly) NSString *validator;
+
+/**
+ *  图片完整的大小 (in bytes)
+ */
+@property (assign, nonatomic, readonly) NSInteger expectedSize;
+
+- (id)initWithData:(NSData *)data validator:(NSString *)validator expectedSize:(NSInteger)expectedSize;
+
+@end
 
 // SDWebImageDownloader 用的默认 operation
 @interface SDWebImageDownloaderOperation : NSOperation <SDWebImageOperation>
@@ -30,6 +55,22 @@ extern NSString *const SDWebImageDownloadFinishNotification;
  */
 @property (assign, nonatomic) BOOL shouldDecompressImages;
 
+/**
+ *  多帧的动图是否解码成 SDWebImageAnimatedImage
+ */
+@property (assign, nonatomic) BOOL shouldDecodeAnimatedImagesLazily;
+
+/**
+ *  解码时是否把 EXIF 方向应用到像素上
+ */
+@property (assign, nonatomic) BOOL shouldBakeImageOrientation;
+
+/**
+ *  阶段性下载时两次生成部分图片之间的最小间隔 (in seconds)，默认是 0.1s
+ *  数据到达得再快，部分图片也不会比这个频率更高地解码和回调
+ */
+@property (assign, nonatomic) NSTimeInterval minimumProgressiveInterval;
+
 // ----------------------------------------不懂------------------------------------
 /**
  * Whether the URL connection should consult the credential storage for authenticating the connection. `YES` by default.
@@ -57,12 +98,39 @@ extern NSString *const SDWebImageDownloadFinishNotification;
  */
 @property (assign, nonatomic) NSInteger expectedSize;
 
+/**
+ *  从最先收到的几个字节识别出的图片格式，还没有识别出来时是 SDImageFormatUndefined
+ */
+@property (assign, nonatomic, readonly) SDImageFormat imageFormat;
+
 /**
  *  The response returned by the operation's connection.
  *  下载图片返回的 response
  */
 @property (strong, nonatomic) NSURLResponse *response;
 
+/**
+ *  断点续传用的部分数据，由 downloader 在 operation 开始前设置
+ *  服务器返回 206 时会拼接在新接收的数据前面，返回 200 时丢弃
+ */
+@property (strong, nonatomic) SDWebImageDownloaderPartialData *resumeData;
+
+/**
+ *  下载的上下文，由 downloader 设置，可用的键见 SDWebImageDownloaderContext...Key
+ */
+@property (copy, nonatomic) NSDictionary *context;
+
+/**
+ *  收到响应时调用的 block，由 downloader 在 operation 开始前设置
+ */
+@property (copy, nonatomic) SDWebImageDownloaderResponseBlock responseBlock;
+
+/**
+ *  创建这个下载的请求，用于 SDWebImageTracer
+ *  由 downloader 在加入 downloadQueue 之前设置，设置的时间作为开始排队的时间
+ */
+@property (assign, nonatomic) SDWebImageTraceID traceID;
+
 /**
  *  初始化 SDWebImageDownloaderOperation 对象
  *
@@ -80,4 +148,13 @@ extern NSString *const SDWebImageDownloadFinishNotification;
             completed:(SDWebImageDownloaderCompletedBlock)completedBlock
             cancelled:(SDWebImageNoParamsBlock)cancelBlock;
 
+/**
+ *  取出当前已下载的部分数据，以便之后用 Range 请求续传
+ *  只有在响应带有校验值 (ETag/Last-Modified)、服务器没有声明不支持 Range 并且数据还没有下载完时才会返回
+ *  需要在 operation 被 reset 之前调用（例如在 cancelBlock 中）
+ *
+ *  @return 可以续传的部分数据，不能续传时返回 nil
+ */
+- (SDWebImageDownloaderPartialData *)partialDataForResume;
+
 @end
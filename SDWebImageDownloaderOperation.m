@@ -8,9 +8,16 @@
 
 #import "SDWebImageDownloaderOperation.h"
 #import "SDWebImageDecoder.h"
+#import "SDWebImageIncrementalDecoder.h"
+#import "SDWebImageDataBuffer.h"
+#import "SDWebImageBitmapPool.h"
+#import "SDWebImageDecodeScheduler.h"
+#import "SDWebImageAnimatedImage.h"
+#import "SDImageFormat.h"
+#import "SDWebImageTransformer.h"
 #import "UIImage+MultiFormat.h"
 #import <ImageIO/ImageIO.h>
-#import "SDWebImageManager.h"
+#import "SDImageCache.h"
 
 // 通知常量
 NSString *const SDWebImageDownloadStartNotification = @"SDWebImageDownloadStartNotification";
@@ -18,18 +25,43 @@ NSString *const SDWebImageDownloadReceiveResponseNotification = @"SDWebImageDown
 NSString *const SDWebImageDownloadStopNotification = @"SDWebImageDownloadStopNotification";
 NSString *const SDWebImageDownloadFinishNotification = @"SDWebImageDownloadFinishNotification";
 
+// 解析 Content-Range: bytes start-end/total，total 是 * (未知) 时为 -1
+static BOOL SDParseContentRange(NSString *contentRange, long long *start, long long *total) {
+    if (!contentRange) {
+        return NO;
+    }
+    NSScanner *scanner = [NSScanner scannerWithString:contentRange];
+    long long end = 0;
+    if (![scanner scanString:@"bytes" intoString:NULL] || ![scanner scanLongLong:start] || ![scanner scanString:@"-" intoString:NULL] || ![scanner scanLongLong:&end] || ![scanner scanString:@"/" intoString:NULL]) {
+        return NO;
+    }
+    if ([scanner scanString:@"*" intoString:NULL]) {
+        *total = -1;
+        return YES;
+    }
+    return [scanner scanLongLong:total];
+}
+
 @interface SDWebImageDownloaderOperation () <NSURLConnectionDataDelegate>
 
+// 续传失败重新请求时会换成去掉 Range 的请求
+@property (strong, nonatomic, readwrite) NSURLRequest *request;
+
 @property (copy, nonatomic) SDWebImageDownloaderProgressBlock progressBlock;
 @property (copy, nonatomic) SDWebImageDownloaderCompletedBlock completedBlock;
 @property (copy, nonatomic) SDWebImageNoParamsBlock cancelBlock;
 
 @property (assign, nonatomic, getter = isExecuting) BOOL executing;
 @property (assign, nonatomic, getter = isFinished) BOOL finished;
-// 图片的二进制流数据
-@property (strong, nonatomic) NSMutableData *imageData;
+// 图片的二进制流数据，分段存储，避免不断扩容带来的 realloc 和拷贝
+@property (strong, nonatomic) SDWebImageDataBuffer *imageBuffer;
 // 下载图片的 connection
 @property (strong, nonatomic) NSURLConnection *connection;
+// 阶段性下载或边下载边解码时使用的增量解码器
+@property (strong, nonatomic) SDWebImageIncrementalDecoder *incrementalDecoder;
+@property (assign, nonatomic, readwrite) SDImageFormat imageFormat;
+// 边下载边写入 disk 缓存的 writer，收到有效的响应时用 context 中的 block 创建，没有设置时为 nil
+@property (strong, nonatomic) SDImageCacheFileWriter *cacheFileWriter;
 //
 @property (strong, atomic) NSThread *thread;
 
@@ -40,10 +72,29 @@ NSString *const SDWebImageDownloadFinishNotification = @"SDWebImageDownloadFinis
 
 @end
 
+@implementation SDWebImageDownloaderPartialData
+
+- (id)initWithData:(NSData *)data validator:(NSString *)validator expectedSize:(NSInteger)expectedSize {
+    if ((self = [super init])) {
+        _data = data;
+        _validator = [validator copy];
+        _expectedSize = expectedSize;
+    }
+    return self;
+}
+
+@end
+
 @implementation SDWebImageDownloaderOperation {
-    size_t width, height;
-    UIImageOrientation orientation;
     BOOL responseFromCached;
+    // 上一次生成部分图片的时间
+    CFAbsoluteTime lastProgressiveTime;
+    // 文件头已经识别过了 (识别出了格式，或者数据足够多仍然不认识)
+    BOOL imageFormatSniffed;
+    // SDWebImageTracer 使用的时间：加入 downloadQueue、开始连接、收到响应
+    uint64_t traceEnqueueTime;
+    uint64_t traceConnectTime;
+    uint64_t traceResponseTime;
 }
 
 @synthesize executing = _executing;
@@ -65,6 +116,8 @@ NSString *const SDWebImageDownloadFinishNotification = @"SDWebImageDownloadFinis
         _executing = NO;
         _finished = NO;
         _expectedSize = 0;
+        _minimumProgressiveInterval = 0.1;
+        _imageFormat = SDImageFormatUndefined;
         responseFromCached = YES; // Initially wrong until `connection:willCacheResponse:` is called or not called
     }
     return self;
@@ -103,6 +156,8 @@ NSString *const SDWebImageDownloadFinishNotification = @"SDWebImageDownloadFinis
 #endif
 
         self.executing = YES;
+        SDWebImageTraceEnd(self.traceID, SDWebImageTraceSpanDownloadQueueWait, traceEnqueueTime);
+        traceConnectTime = SDWebImageTraceTimestamp(self.traceID);
         // 实例化 NSURLConnection（下载图片）
         self.connection = [[NSURLConnection alloc] initWithRequest:self.request delegate:self startImmediately:NO];
         self.thread = [NSThread currentThread];
@@ -180,6 +235,9 @@ NSString *const SDWebImageDownloadFinishNotification = @"SDWebImageDownloadFinis
     [super cancel];
     if (self.cancelBlock) self.cancelBlock();
 
+    // 没下载完的数据不能进入 disk 缓存
+    [self.cacheFileWriter discard];
+
     // 取消下载 connection
     if (self.connection) {
         [self.connection cancel];
@@ -208,11 +266,48 @@ NSString *const SDWebImageDownloadFinishNotification = @"SDWebImageDownloadFinis
     self.cancelBlock = nil;
     self.completedBlock = nil;
     self.progressBlock = nil;
+    self.responseBlock = nil;
     self.connection = nil;
-    self.imageData = nil;
+    self.imageBuffer = nil;
+    self.incrementalDecoder = nil;
+    self.resumeData = nil;
+    self.cacheFileWriter = nil;
     self.thread = nil;
 }
 
+- (void)setTraceID:(SDWebImageTraceID)traceID {
+    _traceID = traceID;
+    traceEnqueueTime = SDWebImageTraceTimestamp(traceID);
+}
+
+- (SDWebImageDownloaderPartialData *)partialDataForResume {
+    NSUInteger receivedSize = self.imageBuffer.length;
+    // 没有数据，或者已经下载完的数据没有续传的意义
+    if (receivedSize == 0 || self.expectedSize <= 0 || (NSInteger)receivedSize >= self.expectedSize) {
+        return nil;
+    }
+    if (![self.response isKindOfClass:[NSHTTPURLResponse class]]) {
+        return nil;
+    }
+
+    NSDictionary *headers = [(NSHTTPURLResponse *)self.response allHeaderFields];
+    NSString *acceptRanges = headers[@"Accept-Ranges"];
+    if (acceptRanges && [acceptRanges caseInsensitiveCompare:@"none"] == NSOrderedSame) {
+        return nil;
+    }
+
+    // If-Range 只能使用强 ETag，弱 ETag (W/"...") 时退回使用 Last-Modified
+    NSString *validator = headers[@"ETag"];
+    if (!validator || [validator hasPrefix:@"W/"]) {
+        validator = headers[@"Last-Modified"];
+    }
+    if (!validator) {
+        return nil;
+    }
+
+    return [[SDWebImageDownloaderPartialData alloc] initWithData:[self.imageBuffer data] validator:validator expectedSize:self.expectedSize];
+}
+
 - (void)setFinished:(BOOL)finished {
     [self willChangeValueForKey:@"isFinished"];
     _finished = finished;
@@ -235,19 +330,72 @@ NSString *const SDWebImageDownloadFinishNotification = @"SDWebImageDownloadFinis
 // connection 的代理方法
 // 在接收到响应时会调用
 - (void)connection:(NSURLConnection *)connection didReceiveResponse:(NSURLResponse *)response {
-    
+    // 续传的 206 要从已有数据的末尾开始，并且总大小没有变化，否则拼接出来的数据是错误的
+    // 这时丢弃部分数据，不带 Range 重新请求完整的图片 (此时 writer 中还没有写入任何数据)
+    SDWebImageDownloaderPartialData *resumeData = self.resumeData;
+    if (resumeData && [response respondsToSelector:@selector(statusCode)] && [((NSHTTPURLResponse *)response) statusCode] == 206) {
+        long long rangeStart = 0;
+        long long rangeTotal = 0;
+        NSString *contentRange = [((NSHTTPURLResponse *)response) allHeaderFields][@"Content-Range"];
+        if (!SDParseContentRange(contentRange, &rangeStart, &rangeTotal) || rangeStart != (long long)resumeData.data.length || rangeTotal != (long long)resumeData.expectedSize) {
+            [self restartWithoutRange];
+            return;
+        }
+    }
+
+    SDWebImageTraceEnd(self.traceID, SDWebImageTraceSpanTimeToFirstByte, traceConnectTime);
+    traceResponseTime = SDWebImageTraceTimestamp(self.traceID);
+
     //'304 Not Modified' is an exceptional one
     // 判断返回的 response 是否合法
-    if (![response respondsToSelector:@selector(statusCode)] || ([((NSHTTPURLResponse *)response) statusCode] < 400 && [((NSHTTPURLResponse *)response) statusCode] != 304)) {
+    BOOL validResponse = ![response respondsToSelector:@selector(statusCode)] || ([((NSHTTPURLResponse *)response) statusCode] < 400 && [((NSHTTPURLResponse *)response) statusCode] != 304);
+    // 确定要接收数据时才创建 writer (在下载线程中，不在调用方的线程)，合并进来的请求共用这一个
+    if (validResponse && !self.cacheFileWriter) {
+        SDWebImageDownloaderCacheFileWriterBlock cacheFileWriterBlock = self.context[SDWebImageDownloaderContextCacheFileWriterBlockKey];
+        if (cacheFileWriterBlock) {
+            self.cacheFileWriter = cacheFileWriterBlock();
+        }
+    }
+    if (self.responseBlock) {
+        self.responseBlock(response, self.cacheFileWriter);
+    }
+
+    if (validResponse) {
         // 图片的二进制流长度
         NSInteger expected = response.expectedContentLength > 0 ? (NSInteger)response.expectedContentLength : 0;
+
+        // 206 Partial Content 表示服务器接受了 Range 续传，接收到的数据要拼接在之前的部分数据后面
+        // 其他情况（200 等）说明资源已经改变或者服务器不支持 Range，丢弃之前的部分数据
+        BOOL resumed = resumeData && [response respondsToSelector:@selector(statusCode)] && [((NSHTTPURLResponse *)response) statusCode] == 206;
+        NSUInteger resumedSize = resumed ? resumeData.data.length : 0;
+        if (resumed && expected > 0) {
+            expected += resumedSize;
+        }
+        self.resumeData = nil;
+
         self.expectedSize = expected;
         if (self.progressBlock) {
-            self.progressBlock(0, expected);
+            self.progressBlock(resumedSize, expected);
         }
+
+        // 响应中的校验值和数据一起提交到 disk 缓存，之后可以用来发送条件请求
+        self.cacheFileWriter.validators = [SDImageCacheValidators validatorsWithResponse:response];
         
         // 根据图片的二进制流长度 data
-        self.imageData = [[NSMutableData alloc] initWithCapacity:expected];
+        // 长度未知又要边下载边解码时，增量解码器每次都需要连续的数据，不使用分段的内存块池，
+        // 使用按两倍扩容的连续模式，内存从位图池中借出，用完还回去
+        if (expected == 0 && (self.options & SDWebImageDownloaderStreamingDecode)) {
+            self.imageBuffer = [[SDWebImageDataBuffer alloc] initContiguousWithCapacity:0 bitmapPool:[SDWebImageBitmapPool sharedPool]];
+        }
+        else {
+            self.imageBuffer = [[SDWebImageDataBuffer alloc] initWithCapacity:expected];
+        }
+        self.imageFormat = SDImageFormatUndefined;
+        imageFormatSniffed = NO;
+        if (resumed) {
+            [self.imageBuffer appendData:resumeData.data];
+            [self.cacheFileWriter appendData:resumeData.data];
+        }
         self.response = response;
         // 在主线程抛出通知
         dispatch_async(dispatch_get_main_queue(), ^{
@@ -258,96 +406,65 @@ NSString *const SDWebImageDownloadFinishNotification = @"SDWebImageDownloadFinis
         NSUInteger code = [((NSHTTPURLResponse *)response) statusCode];
         
         //This is the case when server returns '304 Not Modified'. It means that remote image is not changed.
-        //In case of 304 we need just cancel the operation and return cached image from the cache.
-        if (code == 304) {
-            [self cancelInternal];
-        } else {
-            [self.connection cancel];
-        }
+        // 304 表示条件请求的图片没有变化，不接收数据，回调中没有图片也没有错误，调用方继续使用缓存的图片
+        [self.connection cancel];
         dispatch_async(dispatch_get_main_queue(), ^{
             [[NSNotificationCenter defaultCenter] postNotificationName:SDWebImageDownloadStopNotification object:self];
         });
 
         if (self.completedBlock) {
-            self.completedBlock(nil, nil, [NSError errorWithDomain:NSURLErrorDomain code:[((NSHTTPURLResponse *)response) statusCode] userInfo:nil], YES);
+            NSError *error = (code == 304) ? nil : [NSError errorWithDomain:NSURLErrorDomain code:code userInfo:nil];
+            self.completedBlock(nil, nil, error, YES);
         }
         CFRunLoopStop(CFRunLoopGetCurrent());
         [self done];
     }
 }
 
+// 取消当前的续传请求，去掉 Range 和 If-Range 重新请求，在下载线程中调用
+- (void)restartWithoutRange {
+    @synchronized (self) {
+        [self.connection cancel];
+        self.resumeData = nil;
+        NSMutableURLRequest *request = [self.request mutableCopy];
+        [request setValue:nil forHTTPHeaderField:@"Range"];
+        [request setValue:nil forHTTPHeaderField:@"If-Range"];
+        self.request = request;
+        self.connection = [[NSURLConnection alloc] initWithRequest:request delegate:self startImmediately:NO];
+    }
+    [self.connection start];
+}
+
 // 接收到二进制数据，会调用多次
 - (void)connection:(NSURLConnection *)connection didReceiveData:(NSData *)data {
     // 拼接 data
-    [self.imageData appendData:data];
-
-    if ((self.options & SDWebImageDownloaderProgressiveDownload) && self.expectedSize > 0 && self.completedBlock) {
-        // The following code is from http://www.cocoaintheshell.com/2011/05/progressive-images-download-imageio/
-        // Thanks to the author @Nyx0uf
+    [self.imageBuffer appendData:data];
+    // 同时写入 disk 缓存的临时文件
+    [self.cacheFileWriter appendData:data];
+    // 从最先收到的几个字节识别图片格式，决定要不要使用增量解码器
+    [self sniffImageFormatIfNeeded];
 
+    if ((self.options & SDWebImageDownloaderProgressiveDownload) && self.expectedSize > 0 && self.completedBlock && [self canDecodeIncrementally]) {
         // Get the total bytes downloaded
-        const NSInteger totalSize = self.imageData.length;
-
-        // -----------------------------------对图像的处理-----------------------------------------------------不懂
-        // Update the data source, we must pass ALL the data, not just the new bytes
-        CGImageSourceRef imageSource = CGImageSourceCreateWithData((__bridge CFDataRef)self.imageData, NULL);
-
-        if (width + height == 0) {
-            CFDictionaryRef properties = CGImageSourceCopyPropertiesAtIndex(imageSource, 0, NULL);
-            if (properties) {
-                NSInteger orientationValue = -1;
-                CFTypeRef val = CFDictionaryGetValue(properties, kCGImagePropertyPixelHeight);
-                if (val) CFNumberGetValue(val, kCFNumberLongType, &height);
-                val = CFDictionaryGetValue(properties, kCGImagePropertyPixelWidth);
-                if (val) CFNumberGetValue(val, kCFNumberLongType, &width);
-                val = CFDictionaryGetValue(properties, kCGImagePropertyOrientation);
-                if (val) CFNumberGetValue(val, kCFNumberNSIntegerType, &orientationValue);
-                CFRelease(properties);
-
-                // When we draw to Core Graphics, we lose orientation information,
-                // which means the image below born of initWithCGIImage will be
-                // oriented incorrectly sometimes. (Unlike the image born of initWithData
-                // in connectionDidFinishLoading.) So save it here and pass it on later.
-                orientation = [[self class] orientationFromPropertyValue:(orientationValue == -1 ? 1 : orientationValue)];
-            }
+        const NSInteger totalSize = self.imageBuffer.length;
+        const BOOL finished = totalSize >= self.expectedSize;
 
+        // 整个下载过程共用一个增量解码器，每次只解析新到达的数据
+        if (!self.incrementalDecoder) {
+            self.incrementalDecoder = [SDWebImageIncrementalDecoder new];
         }
-
-        if (width + height > 0 && totalSize < self.expectedSize) {
-            // Create the image
-            CGImageRef partialImageRef = CGImageSourceCreateImageAtIndex(imageSource, 0, NULL);
-
-#ifdef TARGET_OS_IPHONE
-            // Workaround for iOS anamorphic image
-            if (partialImageRef) {
-                const size_t partialHeight = CGImageGetHeight(partialImageRef);
-                CGColorSpaceRef colorSpace = CGColorSpaceCreateDeviceRGB();
-                CGContextRef bmContext = CGBitmapContextCreate(NULL, width, height, 8, width * 4, colorSpace, kCGBitmapByteOrderDefault | kCGImageAlphaPremultipliedFirst);
-                CGColorSpaceRelease(colorSpace);
-                if (bmContext) {
-                    CGContextDrawImage(bmContext, (CGRect){.origin.x = 0.0f, .origin.y = 0.0f, .size.width = width, .size.height = partialHeight}, partialImageRef);
-                    CGImageRelease(partialImageRef);
-                    partialImageRef = CGBitmapContextCreateImage(bmContext);
-                    CGContextRelease(bmContext);
-                }
-                else {
-                    CGImageRelease(partialImageRef);
-                    partialImageRef = nil;
-                }
-            }
-#endif
-
-            if (partialImageRef) {
-                UIImage *image = [UIImage imageWithCGImage:partialImageRef scale:1 orientation:orientation];
-                NSString *key = [[SDWebImageManager sharedManager] cacheKeyForURL:self.request.URL];
-                UIImage *scaledImage = [self scaledImageForKey:key image:image];
-                if (self.shouldDecompressImages) {
-                    image = [UIImage decodedImageWithImage:scaledImage];
-                }
-                else {
-                    image = scaledImage;
-                }
-                CGImageRelease(partialImageRef);
+        // expectedSize 已知，数据总是在一段连续的内存中 (超出预计长度时原地扩容)，不会拷贝
+        [self.incrementalDecoder updateData:[self.imageBuffer contiguousData] finished:finished];
+
+        // 限制生成部分图片的频率，两次之间至少间隔 minimumProgressiveInterval
+        CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+        if (!finished && now - lastProgressiveTime >= self.minimumProgressiveInterval) {
+            // 部分图片的解码也交给解码调度器，限制同时解码的数量
+            UIImage *image = [[SDWebImageDecodeScheduler sharedScheduler] decodeSynchronouslyWithPriority:[self decodePriority] block:^UIImage *{
+                return [self decodedPartialImage];
+            }];
+            if (image) {
+                lastProgressiveTime = now;
                 dispatch_main_sync_safe(^{
                     if (self.completedBlock) {
                         self.completedBlock(image, nil, nil, NO);
@@ -355,46 +472,157 @@ NSString *const SDWebImageDownloadFinishNotification = @"SDWebImageDownloadFinis
                 });
             }
         }
-
-        CFRelease(imageSource);
     }
-    // ----------------------------------------------------------------------------------------
+    else if ((self.options & SDWebImageDownloaderStreamingDecode) && [self canDecodeIncrementally]) {
+        // 边下载边解码：数据一到就交给增量解码器解析，但不生成部分图片
+        // 下载完成时解码器已经处理完了之前的数据，只需要收尾
+        if (!self.incrementalDecoder) {
+            self.incrementalDecoder = [SDWebImageIncrementalDecoder new];
+        }
+        // 缓冲区在收到响应时按连续内存创建 (长度未知时是按两倍扩容的连续模式)，这里不会拷贝
+        [self.incrementalDecoder updateData:[self.imageBuffer contiguousData] finished:NO];
+    }
     
     // 在图片下载中间会调用不断调用的 progress block
     if (self.progressBlock) {
-        self.progressBlock(self.imageData.length, self.expectedSize);
+        self.progressBlock(self.imageBuffer.length, self.expectedSize);
     }
 }
 
-+ (UIImageOrientation)orientationFromPropertyValue:(NSInteger)value {
-    switch (value) {
-        case 1:
-            return UIImageOrientationUp;
-        case 3:
-            return UIImageOrientationDown;
-        case 8:
-            return UIImageOrientationLeft;
-        case 6:
-            return UIImageOrientationRight;
-        case 2:
-            return UIImageOrientationUpMirrored;
-        case 4:
-            return UIImageOrientationDownMirrored;
-        case 5:
-            return UIImageOrientationLeftMirrored;
-        case 7:
-            return UIImageOrientationRightMirrored;
-        default:
-            return UIImageOrientationUp;
-    }
+// 请求的 cache key 由 manager 算好放在 context 中，不再依赖 SDWebImageManager 单例
+- (NSString *)cacheKey {
+    NSString *key = self.context[SDWebImageDownloaderContextCacheKeyKey];
+    return key ?: self.request.URL.absoluteString;
 }
 
 - (UIImage *)scaledImageForKey:(NSString *)key image:(UIImage *)image {
     return SDScaledImageForKey(key, image);
 }
 
+- (void)sniffImageFormatIfNeeded {
+    if (imageFormatSniffed) {
+        return;
+    }
+    // 只拷贝开头的字节，不拼接数据
+    uint8_t header[32];
+    NSUInteger length = [self.imageBuffer getBytes:header length:MIN(sizeof(header), SDImageFormatHeaderLength)];
+    self.imageFormat = SDImageFormatForBytes(header, length);
+    imageFormatSniffed = (self.imageFormat != SDImageFormatUndefined || length >= SDImageFormatHeaderLength);
+}
+
+// 格式是否适合用增量解码器边下载边解析
+// WebP、AVIF 在旧系统上 ImageIO 不支持，动图最后要整个交给 sd_imageWithData:，这些格式边下载边解析只是浪费
+// 格式还没识别出来时先不创建解码器，之后创建的解码器会解析已经收到的全部数据
+- (BOOL)canDecodeIncrementally {
+    switch (self.imageFormat) {
+        case SDImageFormatJPEG:
+        case SDImageFormatPNG:
+        case SDImageFormatBMP:
+        case SDImageFormatHEIF:
+            return YES;
+        case SDImageFormatGIF:
+            // 阶段性下载仍然显示第一帧的部分图片
+            return (self.options & SDWebImageDownloaderProgressiveDownload) != 0;
+        default:
+            return NO;
+    }
+}
+
+// 解码下载完成的图片数据，在解码线程中调用
+- (UIImage *)decodedImageWithData:(NSData *)imageData {
+    // 下载过程中已经有增量解码器时，直接用它解出最终的图片，不用再从头解析一遍数据
+    // 动图或者 ImageIO 不支持的格式 (例如 WebP) 解码器会返回 nil，这时仍然用 sd_imageWithData:
+    // 设置了目标大小时直接缩小解码，不会生成原图大小的位图
+    CGSize targetPixelSize = [self.context[SDWebImageDownloaderContextTargetPixelSizeKey] CGSizeValue];
+    UIImage *image = nil;
+    if (self.incrementalDecoder) {
+        [self.incrementalDecoder updateData:imageData finished:YES];
+        image = [self.incrementalDecoder decodedImageWithTargetPixelSize:targetPixelSize];
+    }
+    else if (targetPixelSize.width > 0 && targetPixelSize.height > 0) {
+        image = [SDWebImageIncrementalDecoder decodedImageWithData:imageData targetPixelSize:targetPixelSize];
+    }
+    NSString *key = [self cacheKey];
+    // 多帧的动图只解码第一帧，其他帧在播放时按需解码
+    if (!image && self.shouldDecodeAnimatedImagesLazily) {
+        SDWebImageAnimatedImage *animatedImage = [SDWebImageAnimatedImage animatedImageWithData:imageData];
+        if (animatedImage) {
+            return [animatedImage animatedImageWithScale:[self scaledImageForKey:key image:animatedImage].scale];
+        }
+    }
+    // 解码器返回的图片已经解压缩过了，不需要再重绘一次
+    BOOL alreadyDecoded = (image != nil);
+    if (!image) {
+        image = [UIImage sd_imageWithData:imageData];
+    }
+    image = [self scaledImageForKey:key image:image];
+
+    // 旋转之后的图片已经是解压缩的位图
+    // 在 transform 之前旋转，transformer 拿到的是方向为 Up 的图片，不需要在重绘时再处理一次方向
+    if (self.shouldBakeImageOrientation && image.imageOrientation != UIImageOrientationUp) {
+        UIImage *bakedImage = [SDWebImageIncrementalDecoder orientationBakedImageWithImage:image];
+        alreadyDecoded = alreadyDecoded || bakedImage != image;
+        image = bakedImage;
+    }
+
+    // 解码之后马上在解码线程中 transform，transform 重绘出来的新图片已经是解压缩的，不需要再重绘一次
+    // transformer 原样返回传入的图片时 (例如没有需要缩小的)，仍然按下面的规则解压缩
+    id<SDWebImageTransformer> transformer = self.context[SDWebImageDownloaderContextTransformerKey];
+    if (transformer && image && !image.images) {
+        uint64_t transformStart = SDWebImageTraceTimestamp(self.traceID);
+        UIImage *transformedImage = [transformer transformedImageWithImage:image];
+        SDWebImageTraceEnd(self.traceID, SDWebImageTraceSpanTransform, transformStart);
+        if (transformedImage != image) {
+            return transformedImage;
+        }
+    }
+
+    // Do not force decoding animated GIFs
+    // GIF 图片
+    if (!image.images && !alreadyDecoded) {
+        if (self.shouldDecompressImages) {
+            image = [UIImage decodedImageWithImage:image];
+        }
+    }
+    return image;
+}
+
+// 用目前接收到的数据解码出部分图片，在解码线程中调用
+- (UIImage *)decodedPartialImage {
+    UIImage *image = [self.incrementalDecoder partialImage];
+    if (!image) {
+        return nil;
+    }
+    NSString *key = [self cacheKey];
+    UIImage *scaledImage = [self scaledImageForKey:key image:image];
+    // transform 重绘出来的图片已经是解压缩的
+    id<SDWebImageTransformer> transformer = self.context[SDWebImageDownloaderContextTransformerKey];
+    if (transformer) {
+        UIImage *transformedImage = [transformer transformedImageWithImage:scaledImage];
+        if (transformedImage != scaledImage) {
+            return transformedImage;
+        }
+    }
+    if (self.shouldDecompressImages) {
+        return [UIImage decodedImageWithImage:scaledImage];
+    }
+    return scaledImage;
+}
+
+// 按下载的优先级解码
+- (NSOperationQueuePriority)decodePriority {
+    if (self.options & SDWebImageDownloaderHighPriority) {
+        return NSOperationQueuePriorityHigh;
+    }
+    if (self.options & SDWebImageDownloaderLowPriority) {
+        return NSOperationQueuePriorityLow;
+    }
+    return NSOperationQueuePriorityNormal;
+}
+
 // 完成图片下载
 - (void)connectionDidFinishLoading:(NSURLConnection *)aConnection {
+    SDWebImageTraceEnd(self.traceID, SDWebImageTraceSpanTransfer, traceResponseTime);
     SDWebImageDownloaderCompletedBlock completionBlock = self.completedBlock;
     @synchronized(self) {
         CFRunLoopStop(CFRunLoopGetCurrent());
@@ -413,28 +641,32 @@ NSString *const SDWebImageDownloadFinishNotification = @"SDWebImageDownloadFinis
     if (completionBlock) {
         if (self.options & SDWebImageDownloaderIgnoreCachedResponse && responseFromCached) {
             completionBlock(nil, nil, nil, YES);
-        } else if (self.imageData) {
-            UIImage *image = [UIImage sd_imageWithData:self.imageData];
-            NSString *key = [[SDWebImageManager sharedManager] cacheKeyForURL:self.request.URL];
-            image = [self scaledImageForKey:key image:image];
-            
-            // Do not force decoding animated GIFs
-            // GIF 图片
-            if (!image.images) {
-                if (self.shouldDecompressImages) {
-                    image = [UIImage decodedImageWithImage:image];
-                }
-            }
+        } else if (self.imageBuffer) {
+            // 只有数据分成了多段时才会拼接 (拷贝) 一次
+            NSData *imageData = [self.imageBuffer data];
+            // 解码放到解码调度器中，和网络线程分开并且限制同时解码的数量
+            UIImage *image = [[SDWebImageDecodeScheduler sharedScheduler] decodeSynchronouslyWithPriority:[self decodePriority] block:^UIImage *{
+                uint64_t decodeStart = SDWebImageTraceTimestamp(self.traceID);
+                UIImage *decodedImage = [self decodedImageWithData:imageData];
+                SDWebImageTraceEnd(self.traceID, SDWebImageTraceSpanDecode, decodeStart);
+                return decodedImage;
+            }];
             if (CGSizeEqualToSize(image.size, CGSizeZero)) {
                 completionBlock(nil, nil, [NSError errorWithDomain:SDWebImageErrorDomain code:0 userInfo:@{NSLocalizedDescriptionKey : @"Downloaded image has 0 pixels"}], YES);
             }
             else {
-                completionBlock(image, self.imageData, nil, YES);
+                // 图片有效，将边下载边写入的临时文件提交到 disk 缓存，completion block 调用时缓存文件已经存在
+                uint64_t storeStart = SDWebImageTraceTimestamp(self.traceID);
+                [self.cacheFileWriter commit];
+                SDWebImageTraceEnd(self.traceID, SDWebImageTraceSpanStore, storeStart);
+                completionBlock(image, imageData, nil, YES);
             }
         } else {
             completionBlock(nil, nil, [NSError errorWithDomain:SDWebImageErrorDomain code:0 userInfo:@{NSLocalizedDescriptionKey : @"Image data is nil"}], YES);
         }
     }
+    // 没有提交的 (被忽略的缓存响应、无效的图片) 都丢弃，已经提交的不受影响
+    [self.cacheFileWriter discard];
     self.completionBlock = nil;
     [self done];
 }
@@ -450,6 +682,7 @@ NSString *const SDWebImageDownloadFinishNotification = @"SDWebImageDownloadFinis
         });
     }
 
+    [self.cacheFileWriter discard];
     if (self.completedBlock) {
         self.completedBlock(nil, nil, error, YES);
     }
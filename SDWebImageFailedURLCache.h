@@ -0,0 +1,83 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import <Foundation/Foundation.h>
+#import "SDWebImageCompat.h"
+
+/**
+ *  记录下载失败的 URL，失败过的 URL 在一段时间内不再请求
+ *
+ *  - 有上限：超过 maxCount 时按记录的先后淘汰最早的 URL
+ *  - 指数退避：同一个 URL 第 n 次失败后 baseRetryInterval * 2^(n-1) 之内不再请求，最长 maxRetryInterval
+ *  - 会过期：退避结束之后再过 maxRetryInterval 没有失败，失败次数清零
+ *  - 按 host 熔断：同一个 host 连续 hostFailureThreshold 次出现说明 host 不可用的失败 (连接不上、超时、5xx 等) 之后，
+ *    hostOpenInterval 之内这个 host 的所有 URL 都不再请求；404 这类只和 URL 有关的失败不计入 host
+ *
+ *  绝大多数 URL 都没有失败过，isBlockedURL: 先查一个用原子计数器实现的计数过滤器，计数为 0 时不加锁直接返回 NO
+ *  所有方法都是线程安全的
+ */
+@interface SDWebImageFailedURLCache : NSObject
+
+/**
+ *  最多记录的 URL 个数，默认是 4096
+ */
+@property (assign, nonatomic) NSUInteger maxCount;
+
+/**
+ *  第一次失败之后不再请求的时间 (in seconds)，默认是 10s
+ */
+@property (assign, nonatomic) NSTimeInterval baseRetryInterval;
+
+/**
+ *  退避时间的上限 (in seconds)，默认是 1 小时
+ */
+@property (assign, nonatomic) NSTimeInterval maxRetryInterval;
+
+/**
+ *  同一个 host 连续失败多少次之后熔断，默认是 8，设为 0 关闭熔断
+ */
+@property (assign, nonatomic) NSUInteger hostFailureThreshold;
+
+/**
+ *  熔断的时间 (in seconds)，默认是 30s，之后放行请求，再次失败会马上重新熔断
+ */
+@property (assign, nonatomic) NSTimeInterval hostOpenInterval;
+
+/**
+ *  目前记录的 URL 个数
+ */
+@property (assign, nonatomic, readonly) NSUInteger count;
+
+/**
+ *  这个 URL 现在是否不应该请求 (还在退避时间内，或者 host 已经熔断)
+ */
+- (BOOL)isBlockedURL:(NSURL *)url;
+
+/**
+ *  记录一次和这个 URL 本身有关的失败 (4xx、数据不是有效的图片等)，延长这个 URL 的退避时间，不影响 host
+ */
+- (void)recordFailureForURL:(NSURL *)url;
+
+/**
+ *  记录一次说明 host 不可用的失败 (连接不上、找不到 host、超时、5xx 等)，累加 host 的连续失败次数，
+ *  达到 hostFailureThreshold 时熔断；不单独延长这个 URL 的退避时间
+ */
+- (void)recordHostFailureForURL:(NSURL *)url;
+
+/**
+ *  记录一次成功，清除这个 URL 的失败记录和 host 的记录 (连续失败次数清零)
+ *  没有熔断的 host 在最后一次失败之后再过 maxRetryInterval 也会清除记录
+ */
+- (void)recordSuccessForURL:(NSURL *)url;
+
+/**
+ *  清除所有的记录
+ */
+- (void)removeAllURLs;
+
+@end
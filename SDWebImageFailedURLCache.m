@@ -0,0 +1,336 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import "SDWebImageFailedURLCache.h"
+#import <stdatomic.h>
+
+// 计数过滤器的计数器个数，必须是 2 的幂
+static const NSUInteger kSDFailedURLFilterSize = 1 << 15;
+// 计数器到达这个值之后不再增减，只会多一些需要加锁确认的误判，不会漏判
+static const uint8_t kSDFailedURLFilterSaturated = UINT8_MAX;
+
+FOUNDATION_STATIC_INLINE NSUInteger SDFailedURLFilterIndex(NSString *key) {
+    return key.hash & (kSDFailedURLFilterSize - 1);
+}
+
+@interface SDWebImageFailedURLEntry : NSObject
+
+@property (copy, nonatomic) NSString *key;
+@property (assign, nonatomic) NSUInteger failureCount;
+// 在这个时间之前不再请求
+@property (assign, nonatomic) CFAbsoluteTime retryTime;
+
+@end
+
+@implementation SDWebImageFailedURLEntry
+
+@end
+
+@interface SDWebImageFailedHostEntry : NSObject
+
+@property (assign, nonatomic) NSUInteger consecutiveFailures;
+// 是否已经熔断，熔断的 host 计入 trippedHostCount
+@property (assign, nonatomic, getter = isTripped) BOOL tripped;
+@property (assign, nonatomic) CFAbsoluteTime openUntil;
+@property (assign, nonatomic) CFAbsoluteTime lastFailureTime;
+
+@end
+
+@implementation SDWebImageFailedHostEntry
+
+@end
+
+@implementation SDWebImageFailedURLCache {
+    // 每个计数器是 key 落在这个位置的 entry 个数，只在锁内修改，读的时候不加锁
+    _Atomic(uint8_t) *_filter;
+    // 熔断中的 host 个数，为 0 时读的时候不需要检查 host
+    atomic_uint _trippedHostCount;
+    // 有失败记录的 host 个数，为 0 时成功的请求不需要加锁
+    atomic_uint _failingHostCount;
+    // 以下的成员都用 self 作为锁
+    NSMutableDictionary *_entries;
+    // entry 按记录的先后排列，用于淘汰；被移除的 entry 留在这里，淘汰时跳过
+    NSMutableArray *_insertionOrder;
+    NSMutableDictionary *_hosts;
+    // 最早有 host 恢复 (熔断结束) 或者过期 (移除记录) 的时间，到了这个时间才需要检查所有的 host
+    CFAbsoluteTime _nextHostSweepTime;
+}
+
+- (id)init {
+    if ((self = [super init])) {
+        _maxCount = 4096;
+        _baseRetryInterval = 10;
+        _maxRetryInterval = 60 * 60;
+        _hostFailureThreshold = 8;
+        _hostOpenInterval = 30;
+        _filter = calloc(kSDFailedURLFilterSize, sizeof(_Atomic(uint8_t)));
+        atomic_init(&_trippedHostCount, 0);
+        atomic_init(&_failingHostCount, 0);
+        _entries = [NSMutableDictionary new];
+        _insertionOrder = [NSMutableArray new];
+        _hosts = [NSMutableDictionary new];
+        _nextHostSweepTime = DBL_MAX;
+    }
+    return self;
+}
+
+- (void)dealloc {
+    free(_filter);
+}
+
+- (NSUInteger)count {
+    @synchronized (self) {
+        return _entries.count;
+    }
+}
+
+#pragma mark - Query
+
+- (BOOL)isBlockedURL:(NSURL *)url {
+    NSString *key = url.absoluteString;
+    if (!key) {
+        return NO;
+    }
+    BOOL mayContainURL = atomic_load_explicit(&_filter[SDFailedURLFilterIndex(key)], memory_order_acquire) != 0;
+    BOOL mayTripHost = atomic_load_explicit(&_trippedHostCount, memory_order_acquire) != 0;
+    if (!mayContainURL && !mayTripHost) {
+        return NO;
+    }
+
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    @synchronized (self) {
+        if (mayContainURL) {
+            SDWebImageFailedURLEntry *entry = _entries[key];
+            if (entry && now < entry.retryTime) {
+                return YES;
+            }
+        }
+        if (mayTripHost) {
+            [self sweepHostsAtTime:now];
+            if (url.host && [_hosts[url.host] isTripped]) {
+                return YES;
+            }
+        }
+    }
+    return NO;
+}
+
+#pragma mark - Record
+
+- (void)recordFailureForURL:(NSURL *)url {
+    NSString *key = url.absoluteString;
+    if (!key) {
+        return;
+    }
+
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    @synchronized (self) {
+        SDWebImageFailedURLEntry *entry = _entries[key];
+        if (entry && now > entry.retryTime + self.maxRetryInterval) {
+            // 很久没有再失败，按第一次失败重新计算
+            entry.failureCount = 0;
+        }
+        if (!entry) {
+            entry = [SDWebImageFailedURLEntry new];
+            entry.key = key;
+            _entries[key] = entry;
+            [_insertionOrder addObject:entry];
+            [self incrementFilterForKey:key];
+        }
+        entry.failureCount++;
+        NSTimeInterval retryInterval = self.baseRetryInterval * pow(2, MIN(entry.failureCount - 1, 30));
+        entry.retryTime = now + MIN(retryInterval, self.maxRetryInterval);
+        [self evictEntriesIfNeededAtTime:now];
+    }
+}
+
+- (void)recordHostFailureForURL:(NSURL *)url {
+    NSString *host = url.host;
+    if (!host || self.hostFailureThreshold == 0) {
+        return;
+    }
+
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    @synchronized (self) {
+        [self sweepHostsAtTime:now];
+        SDWebImageFailedHostEntry *hostEntry = _hosts[host];
+        if (!hostEntry) {
+            [self trimHostsIfNeeded];
+            hostEntry = [SDWebImageFailedHostEntry new];
+            _hosts[host] = hostEntry;
+            atomic_store_explicit(&_failingHostCount, (unsigned int)_hosts.count, memory_order_release);
+        }
+        hostEntry.consecutiveFailures++;
+        hostEntry.lastFailureTime = now;
+        if (hostEntry.consecutiveFailures >= self.hostFailureThreshold) {
+            if (!hostEntry.isTripped) {
+                hostEntry.tripped = YES;
+                atomic_fetch_add_explicit(&_trippedHostCount, 1, memory_order_release);
+            }
+            hostEntry.openUntil = now + self.hostOpenInterval;
+        }
+        _nextHostSweepTime = MIN(_nextHostSweepTime, [self sweepTimeForHostEntry:hostEntry]);
+    }
+}
+
+- (void)recordSuccessForURL:(NSURL *)url {
+    NSString *key = url.absoluteString;
+    if (!key) {
+        return;
+    }
+    // 没有失败过的 URL 和 host 不需要加锁
+    BOOL mayContainURL = atomic_load_explicit(&_filter[SDFailedURLFilterIndex(key)], memory_order_acquire) != 0;
+    BOOL mayContainHost = atomic_load_explicit(&_failingHostCount, memory_order_acquire) != 0;
+    if (!mayContainURL && !mayContainHost) {
+        return;
+    }
+
+    @synchronized (self) {
+        SDWebImageFailedURLEntry *entry = _entries[key];
+        if (entry) {
+            [self removeEntry:entry];
+        }
+        NSString *host = url.host;
+        if (host && _hosts[host]) {
+            [self removeHostEntryForHost:host];
+        }
+        // 其他 host 的记录过期之后 failingHostCount 回到 0，成功的请求又不需要加锁了
+        [self sweepHostsAtTime:CFAbsoluteTimeGetCurrent()];
+    }
+}
+
+- (void)removeAllURLs {
+    @synchronized (self) {
+        [_entries removeAllObjects];
+        [_insertionOrder removeAllObjects];
+        [_hosts removeAllObjects];
+        for (NSUInteger i = 0; i < kSDFailedURLFilterSize; i++) {
+            atomic_store_explicit(&_filter[i], 0, memory_order_relaxed);
+        }
+        atomic_store_explicit(&_trippedHostCount, 0, memory_order_release);
+        atomic_store_explicit(&_failingHostCount, 0, memory_order_release);
+        _nextHostSweepTime = DBL_MAX;
+    }
+}
+
+#pragma mark - Private (called with the lock held)
+
+- (void)incrementFilterForKey:(NSString *)key {
+    _Atomic(uint8_t) *counter = &_filter[SDFailedURLFilterIndex(key)];
+    uint8_t value = atomic_load_explicit(counter, memory_order_relaxed);
+    if (value != kSDFailedURLFilterSaturated) {
+        atomic_store_explicit(counter, value + 1, memory_order_release);
+    }
+}
+
+- (void)decrementFilterForKey:(NSString *)key {
+    _Atomic(uint8_t) *counter = &_filter[SDFailedURLFilterIndex(key)];
+    uint8_t value = atomic_load_explicit(counter, memory_order_relaxed);
+    if (value != 0 && value != kSDFailedURLFilterSaturated) {
+        atomic_store_explicit(counter, value - 1, memory_order_release);
+    }
+}
+
+- (void)removeEntry:(SDWebImageFailedURLEntry *)entry {
+    [_entries removeObjectForKey:entry.key];
+    [self decrementFilterForKey:entry.key];
+}
+
+- (void)removeHostEntryForHost:(NSString *)host {
+    SDWebImageFailedHostEntry *hostEntry = _hosts[host];
+    if (hostEntry.isTripped) {
+        atomic_fetch_sub_explicit(&_trippedHostCount, 1, memory_order_release);
+    }
+    [_hosts removeObjectForKey:host];
+    atomic_store_explicit(&_failingHostCount, (unsigned int)_hosts.count, memory_order_release);
+}
+
+/**
+ *  从最早记录的 entry 开始，淘汰超出上限的和已经过期的 entry
+ *  entry 的退避时间各不相同，过期的 entry 不一定都在最前面，剩下的在之后轮到时再淘汰
+ */
+- (void)evictEntriesIfNeededAtTime:(CFAbsoluteTime)now {
+    NSUInteger index = 0;
+    while (index < _insertionOrder.count) {
+        SDWebImageFailedURLEntry *entry = _insertionOrder[index];
+        if (_entries[entry.key] != entry) {
+            // 已经被移除或者被同一个 URL 新的 entry 替换
+            index++;
+            continue;
+        }
+        BOOL expired = now > entry.retryTime + self.maxRetryInterval;
+        if (!expired && _entries.count <= self.maxCount) {
+            break;
+        }
+        [self removeEntry:entry];
+        index++;
+    }
+    [_insertionOrder removeObjectsInRange:NSMakeRange(0, index)];
+
+    // 成功的请求会留下不再使用的 entry，数量过多时整理一次
+    if (_insertionOrder.count > MAX(self.maxCount, 16) * 2) {
+        NSIndexSet *liveIndexes = [_insertionOrder indexesOfObjectsPassingTest:^BOOL(SDWebImageFailedURLEntry *entry, NSUInteger idx, BOOL *stop) {
+            return _entries[entry.key] == entry;
+        }];
+        _insertionOrder = [[_insertionOrder objectsAtIndexes:liveIndexes] mutableCopy];
+    }
+}
+
+// host 下一次需要处理的时间：熔断中的 host 是熔断结束的时间，其他 host 是记录过期的时间
+- (CFAbsoluteTime)sweepTimeForHostEntry:(SDWebImageFailedHostEntry *)hostEntry {
+    if (hostEntry.isTripped) {
+        return hostEntry.openUntil;
+    }
+    return MAX(hostEntry.lastFailureTime, hostEntry.openUntil) + self.maxRetryInterval;
+}
+
+/**
+ *  熔断时间已过的 host 恢复成没有熔断，trippedHostCount 随之减少，全部恢复之后读的时候又不需要加锁了
+ *  consecutiveFailures 保留，恢复之后的请求再失败一次就马上重新熔断
+ *  和 URL 一样，最后一次失败 (或者熔断结束) 之后再过 maxRetryInterval 没有失败的 host 移除记录，failingHostCount 随之减少
+ */
+- (void)sweepHostsAtTime:(CFAbsoluteTime)now {
+    if (now < _nextHostSweepTime) {
+        return;
+    }
+    CFAbsoluteTime nextSweepTime = DBL_MAX;
+    NSMutableArray *expiredHosts = nil;
+    for (NSString *host in _hosts) {
+        SDWebImageFailedHostEntry *hostEntry = _hosts[host];
+        if (hostEntry.isTripped && now >= hostEntry.openUntil) {
+            hostEntry.tripped = NO;
+            atomic_fetch_sub_explicit(&_trippedHostCount, 1, memory_order_release);
+        }
+        CFAbsoluteTime sweepTime = [self sweepTimeForHostEntry:hostEntry];
+        if (!hostEntry.isTripped && now >= sweepTime) {
+            if (!expiredHosts) expiredHosts = [NSMutableArray new];
+            [expiredHosts addObject:host];
+            continue;
+        }
+        nextSweepTime = MIN(nextSweepTime, sweepTime);
+    }
+    if (expiredHosts) {
+        [_hosts removeObjectsForKeys:expiredHosts];
+        atomic_store_explicit(&_failingHostCount, (unsigned int)_hosts.count, memory_order_release);
+    }
+    _nextHostSweepTime = nextSweepTime;
+}
+
+// host 的记录也有上限，超过时丢掉没有熔断的 host (熔断时间已过的 host 在调用之前已经恢复)
+- (void)trimHostsIfNeeded {
+    if (_hosts.count < MAX(self.maxCount, 16)) {
+        return;
+    }
+    NSArray *hosts = [_hosts keysOfEntriesPassingTest:^BOOL(NSString *host, SDWebImageFailedHostEntry *hostEntry, BOOL *stop) {
+        return !hostEntry.isTripped;
+    }].allObjects;
+    [_hosts removeObjectsForKeys:hosts];
+    atomic_store_explicit(&_failingHostCount, (unsigned int)_hosts.count, memory_order_release);
+}
+
+@end
@@ -0,0 +1,102 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import <Foundation/Foundation.h>
+#import "SDWebImageCompat.h"
+
+/**
+ *  增量解码器，每个下载 operation 持有一个
+ *  内部是一个 CGImageSourceCreateIncremental 创建的 image source，ImageIO 会保留解析的状态，
+ *  每次更新数据时只解析新到达的部分，而不是对所有数据重新创建 image source 从头解析
+ */
+@interface SDWebImageIncrementalDecoder : NSObject
+
+/**
+ *  图片的像素宽高，在数据足够解析出图片头之前都是 0
+ */
+@property (assign, nonatomic, readonly) size_t pixelWidth;
+@property (assign, nonatomic, readonly) size_t pixelHeight;
+
+/**
+ *  从 EXIF 中读出的图片方向
+ */
+@property (assign, nonatomic, readonly) UIImageOrientation orientation;
+
+/**
+ *  是否已经收到所有的数据
+ */
+@property (assign, nonatomic, readonly, getter = isFinished) BOOL finished;
+
+/**
+ *  updateData:finished: 调用的次数和生成部分图片的次数
+ *  整个下载共用一个解码器，接收了 N 次数据就是同一个 image source 上的 N 次更新，可以用来确认没有重新创建
+ */
+@property (assign, nonatomic, readonly) NSUInteger updateCount;
+@property (assign, nonatomic, readonly) NSUInteger partialImageCount;
+
+/**
+ *  用目前接收到的数据更新解码器
+ *
+ *  @param data     目前为止接收到的所有数据 (ImageIO 要求传入全部数据，但只会解析新增的部分)
+ *  @param finished 数据是否已经接收完毕
+ */
+- (void)updateData:(NSData *)data finished:(BOOL)finished;
+
+/**
+ *  用目前已解析的数据生成一张部分图片，未到达的部分为空白
+ *
+ *  @return 部分图片，图片头还没有解析出来时返回 nil
+ */
+- (UIImage *)partialImage;
+
+/**
+ *  数据接收完毕后，解码出最终的完整图片
+ *  会立刻解压缩 (kCGImageSourceShouldCacheImmediately)，返回的图片不需要再调用 decodedImageWithImage:
+ *
+ *  @return 完整的图片，数据没有接收完、图片不完整或者是多帧的动图时返回 nil
+ */
+- (UIImage *)decodedImage;
+
+/**
+ *  与 decodedImage 相同，但是直接解码成缩小后的图片 (ImageIO 的缩略图解码，JPEG 会利用 DCT 缩放)
+ *  缩小后的图片刚好能以 aspect fill 的方式填满 targetPixelSize，方向已经处理好
+ *
+ *  @param targetPixelSize 需要的像素大小，CGSizeZero 或者比原图大时按原图大小解码
+ */
+- (UIImage *)decodedImageWithTargetPixelSize:(CGSize)targetPixelSize;
+
+/**
+ *  直接从完整的图片数据解码出缩小后的图片，不会先解码出原图大小的位图
+ *
+ *  @param data            图片数据
+ *  @param targetPixelSize 需要的像素大小
+ *
+ *  @return 缩小后的图片，动图或者 ImageIO 不支持的格式返回 nil
+ */
++ (UIImage *)decodedImageWithData:(NSData *)data targetPixelSize:(CGSize)targetPixelSize;
+
+/**
+ *  把图片的方向应用到像素上，返回方向为 UIImageOrientationUp、已经解压缩的图片
+ *  绘制时不再需要按方向做变换，在解码线程中调用一次，之后每次绘制都省掉了旋转的开销
+ *  常见的像素格式用分块的旋转 kernel 直接转换，其他格式用 UIKit 按方向重绘
+ *
+ *  @return 方向已经是 Up 的图片或者动图原样返回
+ */
++ (UIImage *)orientationBakedImageWithImage:(UIImage *)image;
+
+/**
+ *  将 EXIF 中的方向值转化为 UIImageOrientation
+ */
++ (UIImageOrientation)orientationFromPropertyValue:(NSInteger)value;
+
+/**
+ *  将 UIImageOrientation 转化为 EXIF 中的方向值
+ */
++ (NSInteger)propertyValueFromOrientation:(UIImageOrientation)orientation;
+
+@end
@@ -0,0 +1,343 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import "SDWebImageIncrementalDecoder.h"
+#import "SDWebImagePixelConversion.h"
+#import "SDWebImageBitmapPool.h"
+#import <ImageIO/ImageIO.h>
+
+/**
+ *  从 image source 中解码第一帧，targetPixelSize 不为零时用缩略图的方式直接解码成缩小的图片
+ *
+ *  @param orientation 图片的方向，缩小解码时方向已经应用到像素上，会被设为 UIImageOrientationUp
+ */
+static CGImageRef SDCreateDecodedImageFromSource(CGImageSourceRef source, CGSize targetPixelSize, UIImageOrientation *orientation) {
+    if (targetPixelSize.width > 0 && targetPixelSize.height > 0) {
+        CFDictionaryRef properties = CGImageSourceCopyPropertiesAtIndex(source, 0, NULL);
+        long width = 0, height = 0;
+        NSInteger exifOrientation = 1;
+        if (properties) {
+            CFTypeRef val = CFDictionaryGetValue(properties, kCGImagePropertyPixelWidth);
+            if (val) CFNumberGetValue(val, kCFNumberLongType, &width);
+            val = CFDictionaryGetValue(properties, kCGImagePropertyPixelHeight);
+            if (val) CFNumberGetValue(val, kCFNumberLongType, &height);
+            val = CFDictionaryGetValue(properties, kCGImagePropertyOrientation);
+            if (val) CFNumberGetValue(val, kCFNumberNSIntegerType, &exifOrientation);
+            CFRelease(properties);
+        }
+        // 缩略图带 transform 解码，出来的是按方向显示之后的图片，EXIF 方向 5 - 8 时宽高交换之后再和 targetPixelSize 比较
+        if (exifOrientation >= 5 && exifOrientation <= 8) {
+            long swap = width;
+            width = height;
+            height = swap;
+        }
+
+        // aspect fill：缩放后要能完全覆盖 targetPixelSize，缩略图解码限制的是最长边
+        CGFloat scale = (width > 0 && height > 0) ? MAX(targetPixelSize.width / width, targetPixelSize.height / height) : 1;
+        if (scale < 1) {
+            NSInteger maxPixelSize = (NSInteger)ceil(MAX(width, height) * scale);
+            NSDictionary *options = @{(__bridge NSString *)kCGImageSourceCreateThumbnailFromImageAlways : @YES,
+                                      (__bridge NSString *)kCGImageSourceCreateThumbnailWithTransform : @YES,
+                                      (__bridge NSString *)kCGImageSourceShouldCacheImmediately : @YES,
+                                      (__bridge NSString *)kCGImageSourceThumbnailMaxPixelSize : @(maxPixelSize)};
+            CGImageRef imageRef = CGImageSourceCreateThumbnailAtIndex(source, 0, (__bridge CFDictionaryRef)options);
+            if (imageRef) {
+                if (orientation) *orientation = UIImageOrientationUp;
+                return imageRef;
+            }
+        }
+    }
+
+    NSDictionary *options = @{(__bridge NSString *)kCGImageSourceShouldCache : @YES,
+                              (__bridge NSString *)kCGImageSourceShouldCacheImmediately : @YES};
+    return CGImageSourceCreateImageAtIndex(source, 0, (__bridge CFDictionaryRef)options);
+}
+
+/**
+ *  把部分解码的图片重绘到一张 width * height 的位图中，位图的内存从 SDWebImageBitmapPool 中借出，图片释放时还回去
+ *  常见的像素格式直接用向量化的 kernel 转换成预乘的 BGRA，其他格式仍然用 CGContext 绘制
+ *  和绘制的版本一样，部分图片放在位图的底部 (CG 的坐标原点在左下角)，其余部分是透明的
+ */
+static CGImageRef SDCreateRedrawnPartialImage(CGImageRef partialImageRef, size_t width, size_t height) {
+    SDWebImageBitmapPool *pool = [SDWebImageBitmapPool sharedPool];
+    const size_t partialHeight = CGImageGetHeight(partialImageRef);
+    const size_t bytesPerRow = width * 4;
+    const size_t length = height * bytesPerRow;
+    NSMutableData *buffer = [pool dequeueBufferWithLength:length];
+    uint8_t *bitmapData = buffer.mutableBytes;
+
+    CGColorSpaceRef colorSpace = NULL;
+    CGBitmapInfo bitmapInfo = 0;
+    if (CGImageGetWidth(partialImageRef) == width && partialHeight <= height &&
+        SDPixelConvertImageToPremultipliedBGRA(partialImageRef, bitmapData + (height - partialHeight) * bytesPerRow, bytesPerRow)) {
+        // 复用的内存中可能有之前的数据，上面还没有数据的部分要清空成透明的
+        memset(bitmapData, 0, (height - partialHeight) * bytesPerRow);
+        colorSpace = CGColorSpaceRetain(CGImageGetColorSpace(partialImageRef));
+        bitmapInfo = kCGBitmapByteOrder32Little | kCGImageAlphaPremultipliedFirst;
+    }
+    else {
+        memset(bitmapData, 0, length);
+        colorSpace = CGColorSpaceCreateDeviceRGB();
+        bitmapInfo = kCGBitmapByteOrderDefault | kCGImageAlphaPremultipliedFirst;
+        CGContextRef bmContext = CGBitmapContextCreate(bitmapData, width, height, 8, bytesPerRow, colorSpace, bitmapInfo);
+        if (!bmContext) {
+            CGColorSpaceRelease(colorSpace);
+            [pool enqueueBuffer:buffer];
+            return NULL;
+        }
+        CGContextDrawImage(bmContext, (CGRect){.origin.x = 0.0f, .origin.y = 0.0f, .size.width = width, .size.height = partialHeight}, partialImageRef);
+        CGContextRelease(bmContext);
+    }
+
+    // 直接用借出的内存创建图片，不像 CGBitmapContextCreateImage 那样可能再拷贝一次
+    CGImageRef imageRef = NULL;
+    CGDataProviderRef provider = [pool createDataProviderWithBuffer:buffer length:length];
+    if (provider) {
+        imageRef = CGImageCreate(width, height, 8, 32, bytesPerRow, colorSpace, bitmapInfo, provider, NULL, false, kCGRenderingIntentDefault);
+        CGDataProviderRelease(provider);
+    }
+    else {
+        [pool enqueueBuffer:buffer];
+    }
+    CGColorSpaceRelease(colorSpace);
+    return imageRef;
+}
+
+/**
+ *  把 imageRef 按 EXIF 方向旋转到一块新的内存中，先转换成预乘的 BGRA 放在从 SDWebImageBitmapPool 借出的临时内存中，
+ *  再用分块的 kernel 写到最终的位图，最终的位图会长期留在缓存中，不从 pool 中借
+ *
+ *  @return 像素格式不支持时返回 NULL
+ */
+static CGImageRef SDCreateOrientationBakedImage(CGImageRef imageRef, NSInteger exifOrientation) {
+    const size_t width = CGImageGetWidth(imageRef);
+    const size_t height = CGImageGetHeight(imageRef);
+    if (width == 0 || height == 0) {
+        return NULL;
+    }
+    const size_t srcBytesPerRow = width * 4;
+    const size_t length = srcBytesPerRow * height;
+    SDWebImageBitmapPool *pool = [SDWebImageBitmapPool sharedPool];
+    NSMutableData *srcBuffer = [pool dequeueBufferWithLength:length];
+    if (!SDPixelConvertImageToPremultipliedBGRA(imageRef, srcBuffer.mutableBytes, srcBytesPerRow)) {
+        [pool enqueueBuffer:srcBuffer];
+        return NULL;
+    }
+
+    // 5...8 会交换宽高，其他超出范围的值 kernel 按 1 处理，宽高也不能交换
+    const BOOL swapsAxes = exifOrientation >= 5 && exifOrientation <= 8;
+    const size_t bakedWidth = swapsAxes ? height : width;
+    const size_t bakedHeight = swapsAxes ? width : height;
+    const size_t bakedBytesPerRow = bakedWidth * 4;
+    NSMutableData *bakedBuffer = [NSMutableData dataWithLength:bakedBytesPerRow * bakedHeight];
+    if (!bakedBuffer) {
+        [pool enqueueBuffer:srcBuffer];
+        return NULL;
+    }
+    SDPixelApplyEXIFOrientation(srcBuffer.bytes, srcBytesPerRow, width, height, bakedBuffer.mutableBytes, bakedBytesPerRow, exifOrientation);
+    [pool enqueueBuffer:srcBuffer];
+
+    CGDataProviderRef provider = CGDataProviderCreateWithCFData((__bridge CFDataRef)bakedBuffer);
+    if (!provider) {
+        return NULL;
+    }
+    CGImageRef bakedImageRef = CGImageCreate(bakedWidth, bakedHeight, 8, 32, bakedBytesPerRow, CGImageGetColorSpace(imageRef),
+                                             kCGBitmapByteOrder32Little | kCGImageAlphaPremultipliedFirst, provider, NULL, false, kCGRenderingIntentDefault);
+    CGDataProviderRelease(provider);
+    return bakedImageRef;
+}
+
+@implementation SDWebImageIncrementalDecoder {
+    CGImageSourceRef _imageSource;
+}
+
+- (id)init {
+    if ((self = [super init])) {
+        // 增量的 image source，之后通过 CGImageSourceUpdateData 不断添加数据
+        _imageSource = CGImageSourceCreateIncremental(NULL);
+        _orientation = UIImageOrientationUp;
+    }
+    return self;
+}
+
+- (void)dealloc {
+    if (_imageSource) {
+        CFRelease(_imageSource);
+        _imageSource = NULL;
+    }
+}
+
+- (void)updateData:(NSData *)data finished:(BOOL)finished {
+    if (!_imageSource || !data) {
+        return;
+    }
+    _finished = finished;
+    _updateCount++;
+
+    // The following code is from http://www.cocoaintheshell.com/2011/05/progressive-images-download-imageio/
+    // Thanks to the author @Nyx0uf
+    // Update the data source, we must pass ALL the data, not just the new bytes
+    CGImageSourceUpdateData(_imageSource, (__bridge CFDataRef)data, finished);
+
+    if (_pixelWidth + _pixelHeight == 0) {
+        CFDictionaryRef properties = CGImageSourceCopyPropertiesAtIndex(_imageSource, 0, NULL);
+        if (properties) {
+            NSInteger orientationValue = -1;
+            long width = 0, height = 0;
+            CFTypeRef val = CFDictionaryGetValue(properties, kCGImagePropertyPixelHeight);
+            if (val) CFNumberGetValue(val, kCFNumberLongType, &height);
+            val = CFDictionaryGetValue(properties, kCGImagePropertyPixelWidth);
+            if (val) CFNumberGetValue(val, kCFNumberLongType, &width);
+            val = CFDictionaryGetValue(properties, kCGImagePropertyOrientation);
+            if (val) CFNumberGetValue(val, kCFNumberNSIntegerType, &orientationValue);
+            CFRelease(properties);
+
+            _pixelWidth = width;
+            _pixelHeight = height;
+
+            // When we draw to Core Graphics, we lose orientation information,
+            // which means the image below born of initWithCGIImage will be
+            // oriented incorrectly sometimes. (Unlike the image born of initWithData
+            // in connectionDidFinishLoading.) So save it here and pass it on later.
+            _orientation = [[self class] orientationFromPropertyValue:(orientationValue == -1 ? 1 : orientationValue)];
+        }
+    }
+}
+
+- (UIImage *)partialImage {
+    if (_pixelWidth + _pixelHeight == 0) {
+        return nil;
+    }
+
+    // Create the image
+    // 部分图片只用来重绘，不让它缓存解码的结果：转换像素时 CGDataProviderCopyData 解码一次直接得到数据，
+    // 而不是先解码到图片的缓存中再整个拷贝出来
+    NSDictionary *options = @{(__bridge NSString *)kCGImageSourceShouldCache : @NO};
+    CGImageRef partialImageRef = CGImageSourceCreateImageAtIndex(_imageSource, 0, (__bridge CFDictionaryRef)options);
+
+#ifdef TARGET_OS_IPHONE
+    // Workaround for iOS anamorphic image
+    if (partialImageRef) {
+        CGImageRef redrawnImageRef = SDCreateRedrawnPartialImage(partialImageRef, _pixelWidth, _pixelHeight);
+        CGImageRelease(partialImageRef);
+        partialImageRef = redrawnImageRef;
+    }
+#endif
+
+    if (!partialImageRef) {
+        return nil;
+    }
+
+    UIImage *image = [UIImage imageWithCGImage:partialImageRef scale:1 orientation:_orientation];
+    CGImageRelease(partialImageRef);
+    _partialImageCount++;
+    return image;
+}
+
+- (UIImage *)decodedImage {
+    return [self decodedImageWithTargetPixelSize:CGSizeZero];
+}
+
+- (UIImage *)decodedImageWithTargetPixelSize:(CGSize)targetPixelSize {
+    if (!_imageSource || !_finished) {
+        return nil;
+    }
+    if (CGImageSourceGetStatus(_imageSource) != kCGImageStatusComplete) {
+        return nil;
+    }
+    // 动图的帧交给 sd_imageWithData: 处理
+    if (CGImageSourceGetCount(_imageSource) != 1) {
+        return nil;
+    }
+
+    UIImageOrientation orientation = _orientation;
+    CGImageRef imageRef = SDCreateDecodedImageFromSource(_imageSource, targetPixelSize, &orientation);
+    if (!imageRef) {
+        return nil;
+    }
+
+    UIImage *image = [UIImage imageWithCGImage:imageRef scale:1 orientation:orientation];
+    CGImageRelease(imageRef);
+    return image;
+}
+
++ (UIImage *)decodedImageWithData:(NSData *)data targetPixelSize:(CGSize)targetPixelSize {
+    if (!data) {
+        return nil;
+    }
+    SDWebImageIncrementalDecoder *decoder = [self new];
+    [decoder updateData:data finished:YES];
+    return [decoder decodedImageWithTargetPixelSize:targetPixelSize];
+}
+
++ (UIImage *)orientationBakedImageWithImage:(UIImage *)image {
+    if (!image.CGImage || image.images || image.imageOrientation == UIImageOrientationUp) {
+        return image;
+    }
+
+    NSInteger exifOrientation = [self propertyValueFromOrientation:image.imageOrientation];
+    CGImageRef bakedImageRef = SDCreateOrientationBakedImage(image.CGImage, exifOrientation);
+    if (bakedImageRef) {
+        UIImage *bakedImage = [UIImage imageWithCGImage:bakedImageRef scale:image.scale orientation:UIImageOrientationUp];
+        CGImageRelease(bakedImageRef);
+        return bakedImage;
+    }
+
+    // 不支持的像素格式交给 UIKit，drawInRect: 会按方向绘制
+    UIGraphicsBeginImageContextWithOptions(image.size, NO, image.scale);
+    [image drawInRect:(CGRect){CGPointZero, image.size}];
+    UIImage *bakedImage = UIGraphicsGetImageFromCurrentImageContext();
+    UIGraphicsEndImageContext();
+    return bakedImage ?: image;
+}
+
++ (UIImageOrientation)orientationFromPropertyValue:(NSInteger)value {
+    switch (value) {
+        case 1:
+            return UIImageOrientationUp;
+        case 3:
+            return UIImageOrientationDown;
+        case 8:
+            return UIImageOrientationLeft;
+        case 6:
+            return UIImageOrientationRight;
+        case 2:
+            return UIImageOrientationUpMirrored;
+        case 4:
+            return UIImageOrientationDownMirrored;
+        case 5:
+            return UIImageOrientationLeftMirrored;
+        case 7:
+            return UIImageOrientationRightMirrored;
+        default:
+            return UIImageOrientationUp;
+    }
+}
+
++ (NSInteger)propertyValueFromOrientation:(UIImageOrientation)orientation {
+    switch (orientation) {
+        case UIImageOrientationDown:
+            return 3;
+        case UIImageOrientationLeft:
+            return 8;
+        case UIImageOrientationRight:
+            return 6;
+        case UIImageOrientationUpMirrored:
+            return 2;
+        case UIImageOrientationDownMirrored:
+            return 4;
+        case UIImageOrientationLeftMirrored:
+            return 5;
+        case UIImageOrientationRightMirrored:
+            return 7;
+        default:
+            return 1;
+    }
+}
+
+@end
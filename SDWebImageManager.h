@@ -10,11 +10,15 @@
 #import "SDWebImageCompat.h"
 #import "SDWebImageOperation.h"
 #import "SDWebImageDownloader.h"
+#import "SDWebImageTransformer.h"
+#import "SDWebImageCacheKey.h"
 #import "SDImageCache.h"
+#import "SDWebImageFailedURLCache.h"
+#import "SDWebImageCompletionQueue.h"
 
 typedef NS_OPTIONS(NSUInteger, SDWebImageOptions) {
     /**
-     *  一个 URL 下载失败就会被加入黑名单，不再会重新下载，这个 flag 会让 SDWebImage 尝试重新下载
+     *  一个 URL 下载失败就会被加入黑名单，在退避时间内不再会重新下载 (见 SDWebImageFailedURLCache)，这个 flag 会让 SDWebImage 尝试重新下载
      */
     SDWebImageRetryFailed = 1 << 0,
     
@@ -42,6 +46,8 @@ typedef NS_OPTIONS(NSUInteger, SDWebImageOptions) {
      *  当缓存的图片刷新之后，completion block 也会被调用一次，并且传入最终的图片
      *  这个 flag 只有在 URLs 跟缓存的图片不是一定的确认下来才会使用（图片缓存之后，这个 URL 对应的图片可能会改变）
      *  栗子：用户的头像图片
+     *  disk 缓存保存了响应的 ETag/Last-Modified 时发送条件请求，服务器返回 304 时只更新缓存的过期时间，
+     *  不会重新下载和解码，completion block 也不会再被调用；不使用 NSURLCache
      */
     SDWebImageRefreshCached = 1 << 4,
     
@@ -80,7 +86,24 @@ typedef NS_OPTIONS(NSUInteger, SDWebImageOptions) {
     /**
      *  控制是否自动设置图片
      */
-    SDWebImageAvoidAutoSetImage = 1 << 11
+    SDWebImageAvoidAutoSetImage = 1 << 11,
+    
+    /**
+     *  边下载边解码，图片数据一边接收一边解析，下载完成后几乎马上就能得到解码好的图片
+     *  不会像 SDWebImageProgressiveDownload 那样回调部分图片
+     *  响应没有给出长度时 (chunked 编码) 下载数据放在一段按需扩容的内存中，接收数据时可能有额外的拷贝
+     */
+    SDWebImageStreamingDecode = 1 << 12,
+
+    /**
+     *  stale-while-revalidate：缓存中有图片时总是马上返回缓存的图片，completion block 只调用一次
+     *  按 disk 缓存中保存的 Cache-Control/Expires 判断，没有过期的图片不访问网络；
+     *  过期的图片在后台发送一次条件请求，下载到新的图片时更新缓存并发出 SDWebImageManagerDidRevalidateImageNotification
+     *  响应既没有 ETag/Last-Modified 也没有过期时间的图片不在后台重新下载
+     *  同一个 key 同时只有一个后台请求，所有请求共用；同一个 key 两次检查之间至少间隔 staleRevalidationInterval
+     *  和 SDWebImageRefreshCached 一起使用时按 SDWebImageRefreshCached 处理
+     */
+    SDWebImageStaleWhileRevalidate = 1 << 13
 };
 
 /**
@@ -100,10 +123,67 @@ typedef void(^SDWebImageCompletionWithFinishedBlock)(UIImage *image, NSError *er
 
 typedef NSString *(^SDWebImageCacheKeyFilterBlock)(NSURL *url);
 
+/**
+ *  批量请求中每一张图片的回调 block，参数与 SDWebImageCompletionWithFinishedBlock 相同
+ *
+ *  @param index 图片在请求数组中的下标
+ */
+typedef void(^SDWebImageBatchItemCompletionBlock)(NSUInteger index, UIImage *image, NSError *error, SDImageCacheType cacheType, BOOL finished, NSURL *imageURL);
+
+/**
+ *  批量请求中所有图片都完成之后的回调 block
+ *
+ *  @param images 和请求数组一一对应的图片，没有拿到图片的位置是 NSNull
+ *  @param errors 和请求数组一一对应的错误，没有出错的位置是 NSNull
+ */
+typedef void(^SDWebImageBatchCompletionBlock)(NSArray *images, NSArray *errors);
+
+/**
+ *  请求图片时附带的上下文 (context) 中可以使用的键
+ */
+// NSValue (CGSize)，图片直接缩小解码到这个像素大小 (例如 80pt 的缩略图在 @2x 屏幕上是 160x160)
+// 不会解码出原图大小的位图，memory 缓存中按大小分别缓存，disk 缓存中仍然是原图
+extern NSString *const SDWebImageManagerContextTargetPixelSizeKey;
+// id<SDWebImageTransformer>，下载的图片解码之后马上在解码线程中 transform (缩放、裁剪、圆角、着色等)
+// transform 之后的图片用 SDTransformedKeyForKey 生成的 key 缓存，命中时直接拿到 transform 之后的图片；原始数据仍然缓存在原图的 key 下
+extern NSString *const SDWebImageManagerContextTransformerKey;
+// id<NSCopying>，请求所属的分组 (例如一个页面或者一个 cell 的标识)，可以用 cancelOperationsInGroup: 一次取消同一组的所有请求
+extern NSString *const SDWebImageManagerContextOperationGroupKey;
+// NSNumber (BOOL)，预加载的请求 (见 SDWebImagePrefetcher)，不计入 foregroundDownloadCount
+extern NSString *const SDWebImageManagerContextPrefetchKey;
+
+/**
+ *  foregroundDownloadCount 从 0 变成非 0 或者从非 0 变成 0 时，在主线程中发出的通知，object 是 SDWebImageManager
+ */
+extern NSString *const SDWebImageManagerForegroundDownloadsDidChangeNotification;
+
+/**
+ *  SDWebImageStaleWhileRevalidate 的后台请求下载到新的图片并存入缓存之后发出的通知，object 是 SDWebImageManager
+ *  和 completion block 在同一个线程中发出：默认是主线程，设置了 completionQueue 时在 completionQueue 中
+ *  userInfo 中 SDWebImageManagerRevalidatedImageURLKey 对应图片的 URL，可以用来重新加载正在显示的图片
+ */
+extern NSString *const SDWebImageManagerDidRevalidateImageNotification;
+extern NSString *const SDWebImageManagerRevalidatedImageURLKey;
+
 
 
 @class SDWebImageManager;
 
+/**
+ *  批量请求中的一个图片请求
+ */
+@interface SDWebImageBatchRequest : NSObject
+
+@property (strong, nonatomic, readonly) NSURL *url;
+@property (assign, nonatomic, readonly) SDWebImageOptions options;
+@property (copy, nonatomic, readonly) NSDictionary *context;
+
++ (SDWebImageBatchRequest *)requestWithURL:(NSURL *)url options:(SDWebImageOptions)options context:(NSDictionary *)context;
+
+@end
+
+
+
 @protocol SDWebImageManagerDelegate <NSObject>
 @optional
 /**
@@ -142,6 +222,37 @@ typedef NSString *(^SDWebImageCacheKeyFilterBlock)(NSURL *url);
 @property (strong, nonatomic, readonly) SDImageCache *imageCache;
 @property (strong, nonatomic, readonly) SDWebImageDownloader *imageDownloader;
 
+/**
+ *  下载失败的 URL 的记录，可以调整退避时间和熔断的参数
+ */
+@property (strong, nonatomic, readonly) SDWebImageFailedURLCache *failedURLCache;
+
+/**
+ *  completedBlock 的执行方式
+ *  默认是 nil：在主线程中同步执行 (dispatch_main_sync_safe)，调用的后台线程会一直等到主线程执行完回调
+ *  设置之后回调异步地提交到这个队列中，后台线程不再等待主线程，同一时间到达的回调合并成一批执行，
+ *  例如 [SDWebImageCompletionQueue mainCompletionQueue]
+ *  注意：SDWebImageProgressiveDownload 的部分图片仍然由 downloader 在主线程同步回调，
+ *  这样部分图片一定在最终图片之前提交到这个队列，不会在最终图片之后覆盖它
+ */
+@property (strong, nonatomic) SDWebImageCompletionQueue *completionQueue;
+
+/**
+ *  正在从网络下载的非预加载请求的个数 (命中缓存的请求不计入)
+ */
+@property (assign, nonatomic, readonly) NSUInteger foregroundDownloadCount;
+
+/**
+ *  命中 memory 缓存、没有创建 operation 就直接回调的请求个数 (包括批量请求中的图片)
+ */
+@property (assign, nonatomic, readonly) NSUInteger memoryCacheHitCount;
+
+/**
+ *  SDWebImageStaleWhileRevalidate 的图片同一个 key 两次检查之间的最短间隔 (秒)，默认是 60
+ *  没有过期的图片要到过期之后才会再检查
+ */
+@property (assign, nonatomic) NSTimeInterval staleRevalidationInterval;
+
 /**
  *  在每次将 URL 转换成 cache key，会调用这个 filter 对图片的 URL 进行操作
  */
@@ -164,6 +275,46 @@ typedef NSString *(^SDWebImageCacheKeyFilterBlock)(NSURL *url);
                                         progress:(SDWebImageDownloaderProgressBlock)progressBlock
                                        completed:(SDWebImageCompletionWithFinishedBlock)completedBlock;
 
+/**
+ *  与上面的方法相同，多了一个请求的上下文
+ *  命中 memory 缓存时不会创建 operation，在主线程中调用并且没有设置 completionQueue 时，completedBlock 在返回之前同步执行
+ *  设置了 completionQueue 时回调是异步的，返回的 operation 在回调之前取消就不会再回调
+ *
+ *  @param context 请求的上下文，可用的键见 SDWebImageManagerContext...Key
+ */
+- (id <SDWebImageOperation>)downloadImageWithURL:(NSURL *)url
+                                         options:(SDWebImageOptions)options
+                                         context:(NSDictionary *)context
+                                        progress:(SDWebImageDownloaderProgressBlock)progressBlock
+                                       completed:(SDWebImageCompletionWithFinishedBlock)completedBlock;
+
+/**
+ *  同步查询 memory 缓存中 URL 对应的图片，不创建任何 operation，不查询 disk
+ *  context 中的 SDWebImageManagerContextTargetPixelSizeKey 和 SDWebImageManagerContextTransformerKey
+ *  和 downloadImageWithURL: 一样参与计算 key，拿到的是同一张图片
+ *
+ *  @return memory 缓存中没有时返回 nil
+ */
+- (UIImage *)imageFromMemoryCacheForURL:(NSURL *)url context:(NSDictionary *)context;
+
+/**
+ *  一次请求多张图片
+ *  memory 缓存一次查完，命中的图片在同一次回调中返回；没有命中的图片在 ioQueue 中一次读取；
+ *  disk 中也没有的图片在主线程的同一个 run loop 中一起提交下载
+ *  整批只占用一个 running operation；每个 URL 仍然检查一次失败 URL 的记录，
+ *  但没有失败过的 URL 只读 SDWebImageFailedURLCache 的计数过滤器，不加锁
+ *
+ *  @param requests           SDWebImageBatchRequest 的数组，也可以直接放 NSURL (options 为 0)
+ *  @param itemCompletedBlock 每张图片拿到结果时调用，可以为 nil
+ *  @param completedBlock     所有图片都完成之后调用一次，可以为 nil；取消之后不会调用
+ *                            SDWebImageRefreshCached 的图片以第一次 finished 的结果 (缓存中的图片) 计入
+ *
+ *  @return 整批请求的 operation，取消它会取消所有还没有完成的图片
+ */
+- (id <SDWebImageOperation>)downloadImagesWithRequests:(NSArray *)requests
+                                         itemCompleted:(SDWebImageBatchItemCompletionBlock)itemCompletedBlock
+                                             completed:(SDWebImageBatchCompletionBlock)completedBlock;
+
 /**
  *  为给定的 URL 存储图片到缓存中
  *
@@ -177,11 +328,27 @@ typedef NSString *(^SDWebImageCacheKeyFilterBlock)(NSURL *url);
  */
 - (void)cancelAll;
 
+/**
+ *  取消 context 中 SDWebImageManagerContextOperationGroupKey 为 group 的所有 operation
+ *  只会遍历这一组的 operation，和其他正在执行的 operation 的数量无关
+ */
+- (void)cancelOperationsInGroup:(id<NSCopying>)group;
+
 /**
  *  检查是否有 operation 在执行，即是否有图片在下载
  */
 - (BOOL)isRunning;
 
+/**
+ *  正在执行的 operation 的个数，一个批量请求只算一个
+ */
+- (NSUInteger)runningOperationCount;
+
+/**
+ *  group 中正在执行的 operation 的个数，cancelOperationsInGroup: 之后为 0
+ */
+- (NSUInteger)runningOperationCountInGroup:(id<NSCopying>)group;
+
 /**
  *  检查图片是否已经被缓存
  *
@@ -218,6 +385,7 @@ typedef NSString *(^SDWebImageCacheKeyFilterBlock)(NSURL *url);
 
 /**
  *  用图片的 URL 获得图片的 cache key
+ *  返回的是 SDWebImageCacheKey，一个请求只计算一次，之后传给 downloader 和 SDImageCache 时不会再重复计算 hash 和文件名
  *
  *  @param url 图片的 URL
  *
@@ -7,13 +7,112 @@
  */
 
 #import "SDWebImageManager.h"
+#import "SDWebImageDecodeScheduler.h"
+#import "SDWebImageAnimatedImage.h"
+#import "SDWebImageTracer.h"
 #import <objc/message.h>
+#import <stdatomic.h>
+
+NSString *const SDWebImageManagerContextTargetPixelSizeKey = @"SDWebImageManagerContextTargetPixelSizeKey";
+NSString *const SDWebImageManagerContextTransformerKey = @"SDWebImageManagerContextTransformerKey";
+NSString *const SDWebImageManagerContextOperationGroupKey = @"SDWebImageManagerContextOperationGroupKey";
+NSString *const SDWebImageManagerContextPrefetchKey = @"SDWebImageManagerContextPrefetchKey";
+NSString *const SDWebImageManagerForegroundDownloadsDidChangeNotification = @"SDWebImageManagerForegroundDownloadsDidChangeNotification";
+NSString *const SDWebImageManagerDidRevalidateImageNotification = @"SDWebImageManagerDidRevalidateImageNotification";
+NSString *const SDWebImageManagerRevalidatedImageURLKey = @"SDWebImageManagerRevalidatedImageURLKey";
+
+// 内部使用的 context 键，NSNumber (BOOL)：SDWebImageStaleWhileRevalidate 在后台发起的重新验证请求，不计入 foregroundDownloadCount
+// 不复用 SDWebImageManagerContextPrefetchKey，预加载和后台重新验证是两种不同的请求
+static NSString *const SDWebImageManagerContextBackgroundRevalidationKey = @"SDWebImageManagerContextBackgroundRevalidationKey";
+
+// 内部使用的 context 键，SDImageCacheValidators 或者 NSNull (没有保存校验值)：已经在主线程之外读取好的校验值，刷新缓存时不再读取
+static NSString *const SDWebImageManagerContextCachedValidatorsKey = @"SDWebImageManagerContextCachedValidatorsKey";
+
+// 下载失败的原因
+typedef NS_ENUM(NSInteger, SDWebImageFailureKind) {
+    // 本机的网络问题或者取消，不记录
+    SDWebImageFailureKindNone,
+    // host 不可用，计入 host 的熔断
+    SDWebImageFailureKindHost,
+    // 只和这个 URL 有关
+    SDWebImageFailureKindURL
+};
+
+// 下载 operation 把 HTTP 状态码作为 NSURLErrorDomain 中的 code (都是正数，NSURLError 都是负数)
+static SDWebImageFailureKind SDFailureKindForError(NSError *error) {
+    if (![error.domain isEqualToString:NSURLErrorDomain]) {
+        return SDWebImageFailureKindURL;
+    }
+    switch (error.code) {
+        case NSURLErrorNotConnectedToInternet:
+        case NSURLErrorCancelled:
+        case NSURLErrorInternationalRoamingOff:
+        case NSURLErrorDataNotAllowed:
+        case NSURLErrorCallIsActive:
+            return SDWebImageFailureKindNone;
+        case NSURLErrorTimedOut:
+        case NSURLErrorCannotFindHost:
+        case NSURLErrorCannotConnectToHost:
+        case NSURLErrorDNSLookupFailed:
+        case NSURLErrorNetworkConnectionLost:
+        case NSURLErrorSecureConnectionFailed:
+            return SDWebImageFailureKindHost;
+        default:
+            return (error.code >= 500 && error.code < 600) ? SDWebImageFailureKindHost : SDWebImageFailureKindURL;
+    }
+}
+
+// 一次解码出所有帧的动图和按需解码的动图
+FOUNDATION_STATIC_INLINE BOOL SDIsAnimatedImage(UIImage *image) {
+    return image.images != nil || [image isKindOfClass:[SDWebImageAnimatedImage class]];
+}
 
 @interface SDWebImageCombinedOperation : NSObject <SDWebImageOperation>
 
 @property (assign, nonatomic, getter = isCancelled) BOOL cancelled;
 @property (copy, nonatomic) SDWebImageNoParamsBlock cancelBlock;
 @property (strong, nonatomic) NSOperation *cacheOperation;
+// 所属的分组，用于按组取消
+@property (copy, nonatomic) id<NSCopying> group;
+// SDWebImageTracer 中这个请求的标识，没有开启记录时是 0
+@property (assign, nonatomic) SDWebImageTraceID traceID;
+
+@end
+
+// 批量请求中一张需要查询 disk 或者下载的图片，自己就是这张图片的 operation
+@interface SDWebImageBatchItem : SDWebImageCombinedOperation
+
+@property (assign, nonatomic) NSUInteger index;
+@property (strong, nonatomic) NSURL *url;
+@property (assign, nonatomic) SDWebImageOptions options;
+@property (copy, nonatomic) NSDictionary *context;
+@property (copy, nonatomic) NSString *key;
+@property (copy, nonatomic) NSString *cacheKey;
+
+@end
+
+// 批量请求的 operation，整批在 runningOperations 中只占一个位置
+@interface SDWebImageBatchOperation : SDWebImageCombinedOperation
+
+// 需要查询 disk 或者下载的图片 (SDWebImageBatchItem)，取消整批时一起取消
+@property (strong, nonatomic) NSArray *items;
+// disk 中没有、等待提交下载的图片，同一个 run loop 中的一起提交，用 self 作为锁
+@property (strong, nonatomic) NSMutableArray *pendingDownloadItems;
+
+- (id)initWithCount:(NSUInteger)count;
+
+// 记录一张图片的结果，同一张图片只记录第一次，所有图片都有结果时返回 YES
+- (BOOL)finishItemAtIndex:(NSUInteger)index image:(UIImage *)image error:(NSError *)error;
+
+- (NSArray *)images;
+- (NSArray *)errors;
+
+@end
+
+// 已经完成的请求 (命中 memory 缓存、URL 无效) 返回的 operation，没有可以取消的东西，所有请求共用一个实例
+@interface SDWebImageFinishedOperation : NSObject <SDWebImageOperation>
+
++ (SDWebImageFinishedOperation *)sharedOperation;
 
 @end
 
@@ -21,14 +120,25 @@
 
 @property (strong, nonatomic, readwrite) SDImageCache *imageCache;
 @property (strong, nonatomic, readwrite) SDWebImageDownloader *imageDownloader;
-// set 的访问速度比 array 快
-// NSSet 类有 hash 特性，访问的速度比 NSArray 快的多
-@property (strong, nonatomic) NSMutableSet *failedURLs;
-@property (strong, nonatomic) NSMutableArray *runningOperations;
+@property (strong, nonatomic, readwrite) SDWebImageFailedURLCache *failedURLCache;
+// 正在执行的 operation，NSObject 的 hash 就是指针，添加和移除都是 O(1)，不会像数组的 removeObject: 那样线性查找
+// runningOperations 和 groupedOperations 都用 runningOperations 作为锁
+@property (strong, nonatomic) NSMutableSet *runningOperations;
+// group -> 这一组中正在执行的 operation (NSMutableSet)
+@property (strong, nonatomic) NSMutableDictionary *groupedOperations;
+// SDWebImageStaleWhileRevalidate：正在后台重新验证的 cache key，同时也作为 revalidationDates 的锁
+@property (strong, nonatomic) NSMutableSet *revalidatingKeys;
+// cache key -> 下一次可以检查的时间，被清除只会多检查一次
+@property (strong, nonatomic) NSCache *revalidationDates;
 
 @end
 
-@implementation SDWebImageManager
+@implementation SDWebImageManager {
+    // 正在下载的非预加载请求的个数，每个请求的开始和结束都会修改，不加锁
+    atomic_ulong _foregroundDownloadCount;
+    // 命中 memory 缓存直接回调的请求个数，只增加，不加锁
+    atomic_ulong _memoryCacheHitCount;
+}
 
 /**
  *  一个 SDWebImageManager 管理所有图片的下载
@@ -44,15 +154,19 @@
 
 /**
  *  初始化方法，对属性进行初始化
- *  生成 SDImageCache 单例，获得 SDWebImageDownloader 单例，初始化一个 NSMutableSet 用来存储下载失败图片的 URL
- *  创建可变数组存储下载 operation
+ *  生成 SDImageCache 单例，获得 SDWebImageDownloader 单例，初始化一个 SDWebImageFailedURLCache 用来记录下载失败图片的 URL
+ *  创建可变集合存储下载 operation
  */
 - (id)init {
     if ((self = [super init])) {
         _imageCache = [self createCache];
         _imageDownloader = [SDWebImageDownloader sharedDownloader];
-        _failedURLs = [NSMutableSet new];
-        _runningOperations = [NSMutableArray new];
+        _failedURLCache = [SDWebImageFailedURLCache new];
+        _runningOperations = [NSMutableSet new];
+        _groupedOperations = [NSMutableDictionary new];
+        _revalidatingKeys = [NSMutableSet new];
+        _revalidationDates = [NSCache new];
+        _staleRevalidationInterval = 60;
     }
     return self;
 }
@@ -72,10 +186,10 @@
  */
 - (NSString *)cacheKeyForURL:(NSURL *)url {
     if (self.cacheKeyFilter) {
-        return self.cacheKeyFilter(url);
+        return [SDWebImageCacheKey cacheKeyWithString:self.cacheKeyFilter(url)];
     }
     else {
-        return [url absoluteString];
+        return [SDWebImageCacheKey cacheKeyWithString:[url absoluteString]];
     }
 }
 
@@ -154,12 +268,20 @@
 }
 
 
+- (id <SDWebImageOperation>)downloadImageWithURL:(NSURL *)url
+                                         options:(SDWebImageOptions)options
+                                        progress:(SDWebImageDownloaderProgressBlock)progressBlock
+                                       completed:(SDWebImageCompletionWithFinishedBlock)completedBlock {
+    return [self downloadImageWithURL:url options:options context:nil progress:progressBlock completed:completedBlock];
+}
+
 /**
  *  Most Important
  *  利用图片的 URL 生成给一个 operation 来下载图片
  *
  *  @param url            图片的 URL
  *  @param options        传入一个 flag 来控制图片的操作
+ *  @param context        请求的上下文
  *  @param progressBlock  在图片下载的时候会调用的 block
  *  @param completedBlock 在图片下载完成后会调用的 block
  *
@@ -167,6 +289,7 @@
  */
 - (id <SDWebImageOperation>)downloadImageWithURL:(NSURL *)url
                                          options:(SDWebImageOptions)options
+                                         context:(NSDictionary *)context
                                         progress:(SDWebImageDownloaderProgressBlock)progressBlock
                                        completed:(SDWebImageCompletionWithFinishedBlock)completedBlock {
     // Invoking this method without a completedBlock is pointless
@@ -186,192 +309,659 @@
         url = nil;
     }
 
-    //
-    __block SDWebImageCombinedOperation *operation = [SDWebImageCombinedOperation new];
-    __weak SDWebImageCombinedOperation *weakOperation = operation;
-
-    BOOL isFailedUrl = NO;
-    // 创建互斥锁防止其他线程修改 failedURLs 数组
-    // 判断这个 URL 是否下载失败过
-    @synchronized (self.failedURLs) {
-        isFailedUrl = [self.failedURLs containsObject:url];
-    }
+    // 判断这个 URL 是否下载失败过并且还在退避时间内，没有失败过的 URL 不需要加锁
+    BOOL isFailedUrl = !(options & SDWebImageRetryFailed) && [self.failedURLCache isBlockedURL:url];
 
     // URL 的 string 长度为零，如果 options 中没有 SDWebImageRetryFailed 选项，或者是下载失败了的 URL，抛出 error
     // 当 options contain SDWebImageRetryFailed 条件判断就为 NO
-    if (url.absoluteString.length == 0 || (!(options & SDWebImageRetryFailed) && isFailedUrl)) {
-        dispatch_main_sync_safe(^{
+    if (url.absoluteString.length == 0 || isFailedUrl) {
+        return [self deliverImmediateCompletion:^{
             NSError *error = [NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorFileDoesNotExist userInfo:nil];
             completedBlock(nil, error, SDImageCacheTypeNone, YES, url);
-        });
-        return operation;
+        } traceID:0];
     }
 
-    // 创建互斥锁避免其他的线程修改 runningOperations
-    @synchronized (self.runningOperations) {
-        // 将图片的下载线程添加到执行中的 runningOperations 数组中
-        [self.runningOperations addObject:operation];
-    }
+    SDWebImageTraceID traceID = SDWebImageTraceBegin();
     NSString *key = [self cacheKeyForURL:url];
+    // 需要缩小解码时的目标像素大小，没有设置时是 CGSizeZero
+    NSValue *targetPixelSizeValue = context[SDWebImageManagerContextTargetPixelSizeKey];
+    CGSize targetPixelSize = [targetPixelSizeValue CGSizeValue];
+    // transform 之后的图片有自己的 key，命中缓存时不需要再解码原图和 transform
+    id<SDWebImageTransformer> transformer = context[SDWebImageManagerContextTransformerKey];
+    NSString *cacheKey = transformer ? [SDWebImageCacheKey cacheKeyWithString:SDTransformedKeyForKey(key, transformer.transformerKey)] : key;
+
+    // 命中 memory 缓存时直接回调：不创建 operation，不修改 runningOperations，也不经过 disk 查询
+    // 在主线程中调用并且没有设置 completionQueue 时，回调在这个方法返回之前同步执行
+    if (!(options & SDWebImageRefreshCached)) {
+        uint64_t lookupStart = SDWebImageTraceTimestamp(traceID);
+        UIImage *image = [self.imageCache imageFromMemoryCacheForKey:cacheKey targetPixelSize:targetPixelSize];
+        SDWebImageTraceEnd(traceID, SDWebImageTraceSpanMemoryLookup, lookupStart);
+        if (image) {
+            atomic_fetch_add_explicit(&_memoryCacheHitCount, 1, memory_order_relaxed);
+            id <SDWebImageOperation> finishedOperation = [self deliverImmediateCompletion:^{
+                completedBlock(image, nil, SDImageCacheTypeMemory, YES, url);
+            } traceID:traceID];
+            [self revalidateCachedImage:image forURL:url options:options context:context key:key cacheKey:cacheKey];
+            return finishedOperation;
+        }
+    }
+
+    // 没有命中 memory 缓存才创建 operation，并添加到执行中的 runningOperations 中
+    __block SDWebImageCombinedOperation *operation = [SDWebImageCombinedOperation new];
+    __weak SDWebImageCombinedOperation *weakOperation = operation;
+    operation.group = context[SDWebImageManagerContextOperationGroupKey];
+    operation.traceID = traceID;
+    [self addRunningOperation:operation];
 
     // 从缓存中查找图片
-    // cacheOperation 是用来在 disk 中异步查找图片的 operation ?
-    // TODO: cacheOperation 是用来下载图片并且缓存的 operation ?
-    operation.cacheOperation = [self.imageCache queryDiskCacheForKey:key done:^(UIImage *image, SDImageCacheType cacheType) {
-        // 判断 operation 是否被取消，如果被取消，就从 runningOperations 数组中删除，并且 return
+    // cacheOperation 是用来在 disk 中异步查找图片的 operation
+    SDWebImageTraceID previousTraceID = SDWebImageTraceSetCurrentID(traceID);
+    operation.cacheOperation = [self.imageCache queryDiskCacheForKey:cacheKey targetPixelSize:targetPixelSize done:^(UIImage *image, SDImageCacheType cacheType) {
+        // 判断 operation 是否被取消，如果被取消，就从 runningOperations 中删除，并且 return
         if (operation.isCancelled) {
-            @synchronized (self.runningOperations) {
-                [self.runningOperations removeObject:operation];
-            }
+            [self removeRunningOperation:operation];
 
             return;
         }
 
-        if ((!image || options & SDWebImageRefreshCached) && (![self.delegate respondsToSelector:@selector(imageManager:shouldDownloadImageForURL:)] || [self.delegate imageManager:self shouldDownloadImageForURL:url])) {
-            if (image && options & SDWebImageRefreshCached) {
-                dispatch_main_sync_safe(^{
-                    // If image was found in the cache but SDWebImageRefreshCached is provided, notify about the cached image
-                    // AND try to re-download it in order to let a chance to NSURLCache to refresh it from server.
-                    completedBlock(image, nil, cacheType, YES, url);
-                });
-            }
+        [self handleCachedImage:image cacheType:cacheType forURL:url options:options context:context key:key cacheKey:cacheKey operation:operation progress:progressBlock completed:completedBlock finished:^{
+            [self removeRunningOperation:weakOperation];
+        }];
+    }]; // self.imageCache queryDiskCacheForKey:...
+    SDWebImageTraceSetCurrentID(previousTraceID);
 
-            // download if no image or requested to refresh anyway, and download allowed by delegate
-            SDWebImageDownloaderOptions downloaderOptions = 0;
-            if (options & SDWebImageLowPriority) downloaderOptions |= SDWebImageDownloaderLowPriority;
-            if (options & SDWebImageProgressiveDownload) downloaderOptions |= SDWebImageDownloaderProgressiveDownload;
-            if (options & SDWebImageRefreshCached) downloaderOptions |= SDWebImageDownloaderUseNSURLCache;
-            if (options & SDWebImageContinueInBackground) downloaderOptions |= SDWebImageDownloaderContinueInBackground;
-            if (options & SDWebImageHandleCookies) downloaderOptions |= SDWebImageDownloaderHandleCookies;
-            if (options & SDWebImageAllowInvalidSSLCertificates) downloaderOptions |= SDWebImageDownloaderAllowInvalidSSLCertificates;
-            if (options & SDWebImageHighPriority) downloaderOptions |= SDWebImageDownloaderHighPriority;
-            if (image && options & SDWebImageRefreshCached) {
-                // force progressive off if image already cached but forced refreshing
-                downloaderOptions &= ~SDWebImageDownloaderProgressiveDownload;
-                // ignore image read from NSURLCache if image if cached but force refreshing
-                downloaderOptions |= SDWebImageDownloaderIgnoreCachedResponse;
+    return operation;
+}
+
+- (UIImage *)imageFromMemoryCacheForURL:(NSURL *)url context:(NSDictionary *)context {
+    if ([url isKindOfClass:NSString.class]) {
+        url = [NSURL URLWithString:(NSString *)url];
+    }
+    if (![url isKindOfClass:NSURL.class]) {
+        return nil;
+    }
+
+    NSString *key = [self cacheKeyForURL:url];
+    if (!key) {
+        return nil;
+    }
+    CGSize targetPixelSize = [context[SDWebImageManagerContextTargetPixelSizeKey] CGSizeValue];
+    id<SDWebImageTransformer> transformer = context[SDWebImageManagerContextTransformerKey];
+    NSString *cacheKey = transformer ? [SDWebImageCacheKey cacheKeyWithString:SDTransformedKeyForKey(key, transformer.transformerKey)] : key;
+    return [self.imageCache imageFromMemoryCacheForKey:cacheKey targetPixelSize:targetPixelSize];
+}
+
+/**
+ *  缓存查询完成之后的处理：缓存中没有 (或者要求刷新) 时下载图片，否则直接回调缓存中的图片
+ *  单个请求和批量请求共用
+ *
+ *  @param image         缓存中查到的图片
+ *  @param key           原图的 cache key
+ *  @param cacheKey      查询缓存用的 key (有 transformer 时是 transform 之后的 key)
+ *  @param operation     这个请求的 operation，下载时会设置它的 cancelBlock
+ *  @param finishedBlock 请求结束 (命中缓存、不允许下载、下载完成、取消) 时调用
+ */
+- (void)handleCachedImage:(UIImage *)image
+                cacheType:(SDImageCacheType)cacheType
+                   forURL:(NSURL *)url
+                  options:(SDWebImageOptions)options
+                  context:(NSDictionary *)context
+                      key:(NSString *)key
+                 cacheKey:(NSString *)cacheKey
+                operation:(SDWebImageCombinedOperation *)operation
+                 progress:(SDWebImageDownloaderProgressBlock)progressBlock
+                completed:(SDWebImageCompletionWithFinishedBlock)completedBlock
+                 finished:(SDWebImageNoParamsBlock)finishedBlock {
+    __weak SDWebImageCombinedOperation *weakOperation = operation;
+    SDWebImageTraceID traceID = operation.traceID;
+
+    if ((!image || options & SDWebImageRefreshCached) && (![self.delegate respondsToSelector:@selector(imageManager:shouldDownloadImageForURL:)] || [self.delegate imageManager:self shouldDownloadImageForURL:url])) {
+        if (image && options & SDWebImageRefreshCached) {
+            [self deliverCompletion:^{
+                // If image was found in the cache but SDWebImageRefreshCached is provided, notify about the cached image
+                // 先返回缓存的图片，再向服务器确认图片有没有变化
+                completedBlock(image, nil, cacheType, YES, url);
+            } traceID:traceID];
+
+            // 条件请求要用到缓存的校验值，读取扩展属性是一次系统调用，在 ioQueue 中读取之后再回到主线程发起下载
+            // 后台重新验证已经在后台线程中读取过，通过 context 传进来
+            id contextValidators = context[SDWebImageManagerContextCachedValidatorsKey];
+            if (contextValidators) {
+                SDImageCacheValidators *validators = [contextValidators isKindOfClass:[SDImageCacheValidators class]] ? contextValidators : nil;
+                [self downloadImageForURL:url cachedImage:image validators:validators options:options context:context key:key cacheKey:cacheKey operation:operation progress:progressBlock completed:completedBlock finished:finishedBlock];
             }
-            
-            // 调用 SDWebImageDownloader 从网络中加载图片，并将下载 operation 返回
-            id <SDWebImageOperation> subOperation = [self.imageDownloader downloadImageWithURL:url options:downloaderOptions progress:progressBlock completed:^(UIImage *downloadedImage, NSData *data, NSError *error, BOOL finished) {
-                if (weakOperation.isCancelled) {
-                    // TODO: Go github and see
-                    // Do nothing if the operation was cancelled
-                    // See #699 for more details
-                    // if we would call the completedBlock, there could be a race condition between this block and another completedBlock for the same object, so if this one is called second, we will overwrite the new data
-                }
-                else if (error) { // 下载失败
-                    dispatch_main_sync_safe(^{
-                        if (!weakOperation.isCancelled) {
-                            completedBlock(nil, error, SDImageCacheTypeNone, finished, url);
-                        }
-                    });
-                    
-                    // 判断错误的原因，如果错误的原因不是网络的问题，就将这个 URL 添加到 failedURLs 数组中
-                    if (   error.code != NSURLErrorNotConnectedToInternet
-                        && error.code != NSURLErrorCancelled
-                        && error.code != NSURLErrorTimedOut
-                        && error.code != NSURLErrorInternationalRoamingOff
-                        && error.code != NSURLErrorDataNotAllowed
-                        && error.code != NSURLErrorCannotFindHost
-                        && error.code != NSURLErrorCannotConnectToHost) {
-                        @synchronized (self.failedURLs) {
-                            [self.failedURLs addObject:url];
-                        }
-                    }
-                } // error
-                else {
-                    // 如果 options 中有 retry 这个 flag，就将 URL 从 failedURLs 移除
-                    if ((options & SDWebImageRetryFailed)) {
-                        @synchronized (self.failedURLs) {
-                            [self.failedURLs removeObject:url];
-                        }
+            else {
+                [self.imageCache queryValidatorsForKey:key completion:^(SDImageCacheValidators *validators) {
+                    if (operation.isCancelled) {
+                        if (finishedBlock) finishedBlock();
+                        return;
                     }
+                    [self downloadImageForURL:url cachedImage:image validators:validators options:options context:context key:key cacheKey:cacheKey operation:operation progress:progressBlock completed:completedBlock finished:finishedBlock];
+                }];
+            }
+        }
+        else {
+            // download if no image, and download allowed by delegate
+            [self downloadImageForURL:url cachedImage:nil validators:nil options:options context:context key:key cacheKey:cacheKey operation:operation progress:progressBlock completed:completedBlock finished:finishedBlock];
+        }
+    } // if ((!image || options & SDWebImageRefreshCached) && (![self.delegate respondsToSelector:@selector(imageManager:shouldDownloadImageForURL:)] || [self.delegate imageManager:self shouldDownloadImageForURL:url]))
+    else if (image) { // 从 disk 中查询到 image
+        [self deliverCompletion:^{
+            if (!weakOperation.isCancelled) {
+                completedBlock(image, nil, cacheType, YES, url);
+            }
+        } traceID:traceID];
+        if (finishedBlock) finishedBlock();
+        [self revalidateCachedImage:image forURL:url options:options context:context key:key cacheKey:cacheKey];
+    }
+    else {
+        // Image not in cache and download disallowed by delegate
+        // image 即不存在于 cache 中，delegate 又不允许下载
+        [self deliverCompletion:^{
+            if (!weakOperation.isCancelled) {
+                completedBlock(nil, nil, SDImageCacheTypeNone, YES, url);
+            }
+        } traceID:traceID];
+        if (finishedBlock) finishedBlock();
+    }
+}
+
+/**
+ *  缓存中没有图片或者要求刷新时，调用 SDWebImageDownloader 下载图片，并设置 operation 的 cancelBlock
+ *
+ *  @param image      缓存中的图片，没有时为 nil
+ *  @param validators 缓存的图片保存的校验值，已经在主线程之外读取好
+ */
+- (void)downloadImageForURL:(NSURL *)url
+                cachedImage:(UIImage *)image
+                 validators:(SDImageCacheValidators *)validators
+                    options:(SDWebImageOptions)options
+                    context:(NSDictionary *)context
+                        key:(NSString *)key
+                   cacheKey:(NSString *)cacheKey
+                  operation:(SDWebImageCombinedOperation *)operation
+                   progress:(SDWebImageDownloaderProgressBlock)progressBlock
+                  completed:(SDWebImageCompletionWithFinishedBlock)completedBlock
+                   finished:(SDWebImageNoParamsBlock)finishedBlock {
+    __weak SDWebImageCombinedOperation *weakOperation = operation;
+    SDWebImageTraceID traceID = operation.traceID;
+    NSValue *targetPixelSizeValue = context[SDWebImageManagerContextTargetPixelSizeKey];
+    CGSize targetPixelSize = [targetPixelSizeValue CGSizeValue];
+    id<SDWebImageTransformer> transformer = context[SDWebImageManagerContextTransformerKey];
+    BOOL isForeground = ![context[SDWebImageManagerContextPrefetchKey] boolValue] && ![context[SDWebImageManagerContextBackgroundRevalidationKey] boolValue];
 
-                    // 确认是否要缓存到 disk 中
-                    BOOL cacheOnDisk = !(options & SDWebImageCacheMemoryOnly);
+    // download if no image or requested to refresh anyway, and download allowed by delegate
+    SDWebImageDownloaderOptions downloaderOptions = 0;
+    if (options & SDWebImageLowPriority) downloaderOptions |= SDWebImageDownloaderLowPriority;
+    if (options & SDWebImageProgressiveDownload) downloaderOptions |= SDWebImageDownloaderProgressiveDownload;
+    if (options & SDWebImageContinueInBackground) downloaderOptions |= SDWebImageDownloaderContinueInBackground;
+    if (options & SDWebImageHandleCookies) downloaderOptions |= SDWebImageDownloaderHandleCookies;
+    if (options & SDWebImageAllowInvalidSSLCertificates) downloaderOptions |= SDWebImageDownloaderAllowInvalidSSLCertificates;
+    if (options & SDWebImageHighPriority) downloaderOptions |= SDWebImageDownloaderHighPriority;
+    if (options & SDWebImageStreamingDecode) downloaderOptions |= SDWebImageDownloaderStreamingDecode;
+    // 校验值和 disk 缓存保存在一起，不再使用 NSURLCache，避免同一张图片在两个缓存中各存一份
+    // 有保存的校验值时发送条件请求，图片没有变化时服务器返回 304，缓存的图片不需要重新下载和解码
+    SDImageCacheValidators *cachedValidators = (image && validators.canRevalidate) ? validators : nil;
+    if (image && options & SDWebImageRefreshCached) {
+        // force progressive off if image already cached but forced refreshing
+        downloaderOptions &= ~SDWebImageDownloaderProgressiveDownload;
+    }
+    
+    // 确认是否要缓存到 disk 中
+    BOOL cacheOnDisk = !(options & SDWebImageCacheMemoryOnly);
 
-                    if (options & SDWebImageRefreshCached && image && !downloadedImage) {
-                        // Image refresh hit the NSURLCache cache, do not call the completion block
-                    }
-                    // 下载好的 image 要 transform
-                    else if (downloadedImage && (!downloadedImage.images || (options & SDWebImageTransformAnimatedImage)) && [self.delegate respondsToSelector:@selector(imageManager:transformDownloadedImage:withURL:)]) {
-                        dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^{
-                            // 异步线程执行图片的 transform
-                            UIImage *transformedImage = [self.delegate imageManager:self transformDownloadedImage:downloadedImage withURL:url];
-
-                            if (transformedImage && finished) {
-                                // UIImage 有 isEqual: 方法判断两张图片是否相等
-                                BOOL imageWasTransformed = ![transformedImage isEqual:downloadedImage];
-                                // 将图片缓存
-                                [self.imageCache storeImage:transformedImage recalculateFromImage:imageWasTransformed imageData:(imageWasTransformed ? nil : data) forKey:key toDisk:cacheOnDisk];
-                            }
-
-                            dispatch_main_sync_safe(^{
-                                if (!weakOperation.isCancelled) {
-                                    completedBlock(transformedImage, nil, SDImageCacheTypeNone, finished, url);
-                                }
-                            });
-                        });
-                    }
-                    else {
-                        if (downloadedImage && finished) {
-                            [self.imageCache storeImage:downloadedImage recalculateFromImage:NO imageData:data forKey:key toDisk:cacheOnDisk];
+    // 不需要 transform 时，下载的数据原样存入 disk 缓存，可以边下载边写入，下载完成时缓存文件就已经存在
+    // delegate 的 transform 会把重新编码的数据存在原图的 key 下，只能走原来的流程
+    // context 中的 transformer 使用单独的 key，原始数据仍然边下载边写入原图的 key
+    // writer 由 downloader 在真正发起下载、收到有效的响应时才创建，命中缓存或者合并到已有下载中的请求不会创建
+    SDWebImageDownloaderCacheFileWriterBlock cacheFileWriterBlock = nil;
+    if (cacheOnDisk && ![self.delegate respondsToSelector:@selector(imageManager:transformDownloadedImage:withURL:)]) {
+        cacheFileWriterBlock = ^SDImageCacheFileWriter *{
+            return [self.imageCache fileWriterForKey:key];
+        };
+    }
+    // 下载完成和取消都可能调用，只有第一次会减少 foregroundDownloadCount
+    __block atomic_flag downloadFinished = ATOMIC_FLAG_INIT;
+    SDWebImageNoParamsBlock downloadFinishedBlock = ^{
+        if (isForeground && !atomic_flag_test_and_set(&downloadFinished)) {
+            [self foregroundDownloadDidFinish];
+        }
+        if (finishedBlock) finishedBlock();
+    };
+    if (isForeground) {
+        [self foregroundDownloadDidStart];
+    }
+
+    NSMutableDictionary *downloaderContext = [NSMutableDictionary new];
+    if (cacheFileWriterBlock) downloaderContext[SDWebImageDownloaderContextCacheFileWriterBlockKey] = cacheFileWriterBlock;
+    if (targetPixelSizeValue) downloaderContext[SDWebImageDownloaderContextTargetPixelSizeKey] = targetPixelSizeValue;
+    if (transformer) downloaderContext[SDWebImageDownloaderContextTransformerKey] = transformer;
+    if (key) downloaderContext[SDWebImageDownloaderContextCacheKeyKey] = key;
+    if (cachedValidators) downloaderContext[SDWebImageDownloaderContextValidatorsKey] = cachedValidators;
+    // 304 时更新缓存的过期时间；其他响应的校验值在图片存入缓存之后保存 (边下载边写入时由 writer 一起提交)
+    __block SDImageCacheValidators *responseValidators = nil;
+    // 这个下载实际使用的 writer，合并到其他请求的下载中时是那个请求创建的
+    __block SDImageCacheFileWriter *downloadFileWriter = nil;
+    downloaderContext[SDWebImageDownloaderContextResponseBlockKey] = ^(NSURLResponse *response, SDImageCacheFileWriter *cacheFileWriter) {
+        downloadFileWriter = cacheFileWriter;
+        if ([response respondsToSelector:@selector(statusCode)] && [(NSHTTPURLResponse *)response statusCode] == 304) {
+            [self.imageCache storeValidators:[cachedValidators validatorsByUpdatingWithResponse:response] forKey:key];
+        }
+        else {
+            responseValidators = [SDImageCacheValidators validatorsWithResponse:response];
+        }
+    };
+
+    // 调用 SDWebImageDownloader 从网络中加载图片，并将下载 operation 返回
+    SDWebImageTraceID previousTraceID = SDWebImageTraceSetCurrentID(traceID);
+    id <SDWebImageOperation> subOperation = [self.imageDownloader downloadImageWithURL:url options:downloaderOptions context:downloaderContext progress:progressBlock completed:^(UIImage *downloadedImage, NSData *data, NSError *error, BOOL finished) {
+        if (weakOperation.isCancelled) {
+            // TODO: Go github and see
+            // Do nothing if the operation was cancelled
+            // See #699 for more details
+            // if we would call the completedBlock, there could be a race condition between this block and another completedBlock for the same object, so if this one is called second, we will overwrite the new data
+        }
+        else if (error) { // 下载失败
+            [self deliverCompletion:^{
+                if (!weakOperation.isCancelled) {
+                    completedBlock(nil, error, SDImageCacheTypeNone, finished, url);
+                }
+            } traceID:traceID];
+            
+            // 判断错误的原因：本机没有网络不记录；host 连不上、超时、5xx 说明 host 不可用，计入 host 的熔断；
+            // 其他的 (4xx、数据不是有效的图片等) 只和这个 URL 有关，只记录这个 URL
+            SDWebImageFailureKind failureKind = SDFailureKindForError(error);
+            if (failureKind == SDWebImageFailureKindHost) {
+                [self.failedURLCache recordHostFailureForURL:url];
+            }
+            else if (failureKind == SDWebImageFailureKindURL) {
+                [self.failedURLCache recordFailureForURL:url];
+            }
+        } // error
+        else {
+            // 下载成功，清除这个 URL 的失败记录
+            [self.failedURLCache recordSuccessForURL:url];
+
+            if (options & SDWebImageRefreshCached && image && !downloadedImage) {
+                // 服务器返回 304，缓存的图片已经返回过，不再调用 completion block
+            }
+            // 下载好的 image 要 transform
+            else if (downloadedImage && (!SDIsAnimatedImage(downloadedImage) || (options & SDWebImageTransformAnimatedImage)) && [self.delegate respondsToSelector:@selector(imageManager:transformDownloadedImage:withURL:)]) {
+                // transform 放到解码调度器中执行，和解码共用同一组有上限的线程
+                [[SDWebImageDecodeScheduler sharedScheduler] decodeWithPriority:NSOperationQueuePriorityHigh block:^UIImage *{
+                    uint64_t transformStart = SDWebImageTraceTimestamp(traceID);
+                    UIImage *transformedImage = [self.delegate imageManager:self transformDownloadedImage:downloadedImage withURL:url];
+                    SDWebImageTraceEnd(traceID, SDWebImageTraceSpanTransform, transformStart);
+                    return transformedImage;
+                } completion:^(UIImage *transformedImage) {
+                    if (transformedImage && finished) {
+                        // UIImage 有 isEqual: 方法判断两张图片是否相等
+                        BOOL imageWasTransformed = ![transformedImage isEqual:downloadedImage];
+                        // 将图片缓存
+                        SDWebImageTraceID storeTraceID = SDWebImageTraceSetCurrentID(traceID);
+                        [self.imageCache storeImage:transformedImage recalculateFromImage:imageWasTransformed imageData:(imageWasTransformed ? nil : data) forKey:cacheKey targetPixelSize:targetPixelSize toDisk:cacheOnDisk];
+                        SDWebImageTraceSetCurrentID(storeTraceID);
+                        if (cacheOnDisk) {
+                            [self.imageCache storeValidators:responseValidators forKey:cacheKey];
                         }
+                    }
 
-                        dispatch_main_sync_safe(^{
-                            if (!weakOperation.isCancelled) {
-                                completedBlock(downloadedImage, nil, SDImageCacheTypeNone, finished, url);
-                            }
-                        });
+                    [self deliverCompletion:^{
+                        if (!weakOperation.isCancelled) {
+                            completedBlock(transformedImage, nil, SDImageCacheTypeNone, finished, url);
+                        }
+                    } traceID:traceID];
+                }];
+            }
+            else {
+                SDWebImageTraceID storeTraceID = SDWebImageTraceSetCurrentID(traceID);
+                if (downloadedImage && finished && transformer) {
+                    // transform 之后的图片重新编码一次，存在 transform 的 key 下 (原始数据已经边下载边写入原图的 key)
+                    // 动图不做 transform，原样存储
+                    BOOL imageWasTransformed = !SDIsAnimatedImage(downloadedImage);
+                    [self.imageCache storeImage:downloadedImage recalculateFromImage:imageWasTransformed imageData:(imageWasTransformed ? nil : data) forKey:cacheKey targetPixelSize:targetPixelSize toDisk:cacheOnDisk];
+                }
+                else if (downloadedImage && finished) {
+                    // 数据已经边下载边写入 disk 缓存时 (包括合并到其他请求的下载中)，只需要缓存到内存中
+                    BOOL storedToDisk = downloadFileWriter.isCommitted && [downloadFileWriter.key isEqualToString:key];
+                    [self.imageCache storeImage:downloadedImage recalculateFromImage:NO imageData:data forKey:key targetPixelSize:targetPixelSize toDisk:(cacheOnDisk && !storedToDisk)];
+                    if (cacheOnDisk && !storedToDisk) {
+                        [self.imageCache storeValidators:responseValidators forKey:key];
                     }
                 }
+                SDWebImageTraceSetCurrentID(storeTraceID);
 
-                if (finished) {
-                    // 完成之后，从 runningOperations 移除这个下载 operation
-                    @synchronized (self.runningOperations) {
-                        [self.runningOperations removeObject:operation];
+                [self deliverCompletion:^{
+                    if (!weakOperation.isCancelled) {
+                        completedBlock(downloadedImage, nil, SDImageCacheTypeNone, finished, url);
                     }
-                }
-            }]; // self.imageDownloader downloaderImageWithURL:...
-            
-            // 设置 SDWebImageCombinedOperation 的 cancelBlock，这个类的设计就是为了代码的简洁
-            // 当 [SDWebImageCombinedOperation cancel] 后，会调用 cancelBlock
-            operation.cancelBlock = ^{
-                [subOperation cancel];
+                } traceID:traceID];
+            }
+        }
 
-                @synchronized (self.runningOperations) {
-                    [self.runningOperations removeObject:weakOperation];
-                }
-            };
-        } // if ((!image || options & SDWebImageRefreshCached) && (![self.delegate respondsToSelector:@selector(imageManager:shouldDownloadImageForURL:)] || [self.delegate imageManager:self shouldDownloadImageForURL:url]))
-        else if (image) { // 从 disk 中查询到 image
-            dispatch_main_sync_safe(^{
-                if (!weakOperation.isCancelled) {
-                    completedBlock(image, nil, cacheType, YES, url);
+        if (finished) {
+            // 完成之后，从 runningOperations 移除这个下载 operation
+            downloadFinishedBlock();
+        }
+    }]; // self.imageDownloader downloaderImageWithURL:...
+    SDWebImageTraceSetCurrentID(previousTraceID);
+    
+    // 设置 SDWebImageCombinedOperation 的 cancelBlock，这个类的设计就是为了代码的简洁
+    // 当 [SDWebImageCombinedOperation cancel] 后，会调用 cancelBlock
+    operation.cancelBlock = ^{
+        [subOperation cancel];
+
+        downloadFinishedBlock();
+    };
+}
+
+/**
+ *  SDWebImageStaleWhileRevalidate 的图片已经返回给调用方之后调用，过期时在后台发送一次条件请求
+ *  同一个 cache key 同时只有一个后台请求；请求结束之后至少间隔 staleRevalidationInterval 才会再检查
+ */
+- (void)revalidateCachedImage:(UIImage *)image forURL:(NSURL *)url options:(SDWebImageOptions)options context:(NSDictionary *)context key:(NSString *)key cacheKey:(NSString *)cacheKey {
+    if (!(options & SDWebImageStaleWhileRevalidate) || (options & SDWebImageRefreshCached) || !key) {
+        return;
+    }
+    @synchronized (self.revalidatingKeys) {
+        NSDate *nextDate = [self.revalidationDates objectForKey:cacheKey];
+        if ([self.revalidatingKeys containsObject:cacheKey] || (nextDate && [nextDate timeIntervalSinceNow] > 0)) {
+            return;
+        }
+        [self.revalidatingKeys addObject:cacheKey];
+    }
+
+    // 后台请求按 SDWebImageRefreshCached 执行，低优先级，不计入 foregroundDownloadCount，也不属于调用方的分组
+    SDWebImageOptions revalidateOptions = (options & ~(SDWebImageStaleWhileRevalidate | SDWebImageProgressiveDownload | SDWebImageHighPriority)) | SDWebImageRefreshCached | SDWebImageLowPriority;
+    NSMutableDictionary *revalidateContext = [NSMutableDictionary dictionaryWithDictionary:context ?: @{}];
+    revalidateContext[SDWebImageManagerContextBackgroundRevalidationKey] = @YES;
+    [revalidateContext removeObjectForKey:SDWebImageManagerContextOperationGroupKey];
+
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^{
+        // 读取扩展属性是一次系统调用，不放在主线程中
+        SDImageCacheValidators *validators = [self.imageCache validatorsForKey:key];
+        if (validators.isFresh) {
+            [self finishRevalidationForKey:cacheKey nextDate:validators.expirationDate];
+            return;
+        }
+        if (!validators.canRevalidate && !validators.expirationDate) {
+            // 响应既没有 ETag / Last-Modified 也没有给出过期时间，只能无条件重新下载整张图片，不在后台每隔 staleRevalidationInterval 下载一次
+            // 只记录下次检查的时间，图片重新下载并保存了校验值之后，下次检查时才会重新验证
+            [self finishRevalidationForKey:cacheKey nextDate:nil];
+            return;
+        }
+        revalidateContext[SDWebImageManagerContextCachedValidatorsKey] = validators ?: (id)[NSNull null];
+        dispatch_async(dispatch_get_main_queue(), ^{
+            SDWebImageCombinedOperation *operation = [SDWebImageCombinedOperation new];
+            __weak SDWebImageCombinedOperation *weakOperation = operation;
+            operation.traceID = SDWebImageTraceBegin();
+            [self addRunningOperation:operation];
+            [self handleCachedImage:image cacheType:SDImageCacheTypeDisk forURL:url options:revalidateOptions context:revalidateContext key:key cacheKey:cacheKey operation:operation progress:nil completed:^(UIImage *revalidatedImage, NSError *error, SDImageCacheType cacheType, BOOL finished, NSURL *imageURL) {
+                // 第一次回调的是缓存的图片，只有下载到新的图片时才通知
+                // 回调已经在主线程 (或者 completionQueue) 中执行，直接发出通知
+                if (revalidatedImage && cacheType == SDImageCacheTypeNone && finished) {
+                    [[NSNotificationCenter defaultCenter] postNotificationName:SDWebImageManagerDidRevalidateImageNotification object:self userInfo:@{SDWebImageManagerRevalidatedImageURLKey: url}];
                 }
-            });
-            @synchronized (self.runningOperations) {
-                [self.runningOperations removeObject:operation];
+            } finished:^{
+                [self removeRunningOperation:weakOperation];
+                [self finishRevalidationForKey:cacheKey nextDate:nil];
+            }];
+        });
+    });
+}
+
+// 下载完成或者取消都可能调用，重复调用没有影响
+- (void)finishRevalidationForKey:(NSString *)cacheKey nextDate:(NSDate *)nextDate {
+    NSDate *intervalDate = [NSDate dateWithTimeIntervalSinceNow:self.staleRevalidationInterval];
+    @synchronized (self.revalidatingKeys) {
+        [self.revalidatingKeys removeObject:cacheKey];
+        [self.revalidationDates setObject:([nextDate compare:intervalDate] == NSOrderedDescending ? nextDate : intervalDate) forKey:cacheKey];
+    }
+}
+
+- (id <SDWebImageOperation>)downloadImagesWithRequests:(NSArray *)requests
+                                         itemCompleted:(SDWebImageBatchItemCompletionBlock)itemCompletedBlock
+                                             completed:(SDWebImageBatchCompletionBlock)completedBlock {
+    NSUInteger count = requests.count;
+    SDWebImageBatchOperation *batchOperation = [[SDWebImageBatchOperation alloc] initWithCount:count];
+    __weak SDWebImageBatchOperation *weakBatchOperation = batchOperation;
+    if (count == 0) {
+        if (completedBlock) {
+            [self deliverCompletion:^{
+                completedBlock(@[], @[]);
+            }];
+        }
+        return batchOperation;
+    }
+
+    // 每张图片的结果都经过这个 block，在回调的线程中执行
+    SDWebImageBatchItemCompletionBlock itemBlock = ^(NSUInteger index, UIImage *image, NSError *error, SDImageCacheType cacheType, BOOL finished, NSURL *imageURL) {
+        SDWebImageBatchOperation *strongBatchOperation = weakBatchOperation;
+        if (!strongBatchOperation || strongBatchOperation.isCancelled) {
+            return;
+        }
+        if (itemCompletedBlock) {
+            itemCompletedBlock(index, image, error, cacheType, finished, imageURL);
+        }
+        if (finished && [strongBatchOperation finishItemAtIndex:index image:image error:error]) {
+            if (completedBlock) {
+                completedBlock([strongBatchOperation images], [strongBatchOperation errors]);
             }
+            [self removeRunningOperation:strongBatchOperation];
+        }
+    };
+
+    // 第一遍：检查 URL、失败记录和 memory 缓存，不需要查询 disk 的结果放在同一次回调中
+    NSMutableArray *immediateBlocks = [NSMutableArray new];
+    NSMutableArray *items = [NSMutableArray new];
+    NSMutableArray *cacheKeys = [NSMutableArray new];
+    NSMutableArray *targetPixelSizes = [NSMutableArray new];
+    [requests enumerateObjectsUsingBlock:^(id request, NSUInteger idx, BOOL *stop) {
+        NSURL *url = request;
+        SDWebImageOptions options = 0;
+        NSDictionary *context = nil;
+        if ([request isKindOfClass:[SDWebImageBatchRequest class]]) {
+            url = [(SDWebImageBatchRequest *)request url];
+            options = [(SDWebImageBatchRequest *)request options];
+            context = [(SDWebImageBatchRequest *)request context];
+        }
+        if ([url isKindOfClass:NSString.class]) {
+            url = [NSURL URLWithString:(NSString *)url];
+        }
+        if (![url isKindOfClass:NSURL.class]) {
+            url = nil;
+        }
+
+        BOOL isFailedUrl = !(options & SDWebImageRetryFailed) && [self.failedURLCache isBlockedURL:url];
+        if (url.absoluteString.length == 0 || isFailedUrl) {
+            [immediateBlocks addObject:^{
+                NSError *error = [NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorFileDoesNotExist userInfo:nil];
+                itemBlock(idx, nil, error, SDImageCacheTypeNone, YES, url);
+            }];
+            return;
+        }
+
+        NSString *key = [self cacheKeyForURL:url];
+        NSValue *targetPixelSizeValue = context[SDWebImageManagerContextTargetPixelSizeKey];
+        id<SDWebImageTransformer> transformer = context[SDWebImageManagerContextTransformerKey];
+        NSString *cacheKey = transformer ? [SDWebImageCacheKey cacheKeyWithString:SDTransformedKeyForKey(key, transformer.transformerKey)] : key;
+
+        // SDWebImageRefreshCached 的图片命中 memory 之后还要下载，交给后面的流程
+        if (!(options & SDWebImageRefreshCached)) {
+            UIImage *image = [self.imageCache imageFromMemoryCacheForKey:cacheKey targetPixelSize:[targetPixelSizeValue CGSizeValue]];
+            if (image) {
+                atomic_fetch_add_explicit(&_memoryCacheHitCount, 1, memory_order_relaxed);
+                [immediateBlocks addObject:^{
+                    itemBlock(idx, image, nil, SDImageCacheTypeMemory, YES, url);
+                }];
+                [self revalidateCachedImage:image forURL:url options:options context:context key:key cacheKey:cacheKey];
+                return;
+            }
+        }
+
+        SDWebImageBatchItem *item = [SDWebImageBatchItem new];
+        item.index = idx;
+        item.url = url;
+        item.options = options;
+        item.context = context;
+        item.key = key;
+        item.cacheKey = cacheKey;
+        item.traceID = SDWebImageTraceBegin();
+        [items addObject:item];
+        [cacheKeys addObject:cacheKey];
+        [targetPixelSizes addObject:targetPixelSizeValue ?: [NSNull null]];
+    }];
+
+    batchOperation.items = items;
+    batchOperation.cancelBlock = ^{
+        [self removeRunningOperation:weakBatchOperation];
+    };
+    // 先加入 runningOperations，同步回调时整批可能马上完成并移除
+    [self addRunningOperation:batchOperation];
+
+    if (immediateBlocks.count > 0) {
+        [self deliverCompletion:^{
+            for (dispatch_block_t block in immediateBlocks) {
+                block();
+            }
+        }];
+    }
+
+    if (items.count == 0) {
+        return batchOperation;
+    }
+
+    // 第二遍：没有命中 memory 的图片在 ioQueue 中一次查完
+    batchOperation.cacheOperation = [self.imageCache queryDiskCacheForKeys:cacheKeys targetPixelSizes:targetPixelSizes done:^(NSUInteger idx, UIImage *image, SDImageCacheType cacheType) {
+        SDWebImageBatchItem *item = items[idx];
+        if (item.isCancelled) {
+            return;
+        }
+        if (image) {
+            [self handleCachedImage:image cacheType:cacheType forBatchItem:item completed:itemBlock];
         }
         else {
-            // Image not in cache and download disallowed by delegate
-            // image 即不存在于 cache 中，delegate 又不允许下载
-            dispatch_main_sync_safe(^{
-                if (!weakOperation.isCancelled) {
-                    completedBlock(nil, nil, SDImageCacheTypeNone, YES, url);
-                }
-            });
-            @synchronized (self.runningOperations) {
-                [self.runningOperations removeObject:operation];
+            [self enqueueDownloadForBatchItem:item batchOperation:weakBatchOperation completed:itemBlock];
+        }
+    }];
+
+    return batchOperation;
+}
+
+- (void)handleCachedImage:(UIImage *)image cacheType:(SDImageCacheType)cacheType forBatchItem:(SDWebImageBatchItem *)item completed:(SDWebImageBatchItemCompletionBlock)itemBlock {
+    NSUInteger index = item.index;
+    [self handleCachedImage:image cacheType:cacheType forURL:item.url options:item.options context:item.context key:item.key cacheKey:item.cacheKey operation:item progress:nil completed:^(UIImage *itemImage, NSError *error, SDImageCacheType itemCacheType, BOOL finished, NSURL *imageURL) {
+        itemBlock(index, itemImage, error, itemCacheType, finished, imageURL);
+    } finished:nil];
+}
+
+/**
+ *  第三遍：disk 中也没有的图片先攒起来，在主线程的下一个 run loop 中一起提交下载
+ *  disk 查询的结果在 ioQueue 中一次读完之后连续回调到主线程，通常会落在同一批中
+ */
+- (void)enqueueDownloadForBatchItem:(SDWebImageBatchItem *)item batchOperation:(SDWebImageBatchOperation *)batchOperation completed:(SDWebImageBatchItemCompletionBlock)itemBlock {
+    if (!batchOperation) {
+        return;
+    }
+
+    BOOL needsFlush = NO;
+    @synchronized (batchOperation) {
+        [batchOperation.pendingDownloadItems addObject:item];
+        needsFlush = (batchOperation.pendingDownloadItems.count == 1);
+    }
+    if (!needsFlush) {
+        return;
+    }
+
+    __weak SDWebImageBatchOperation *weakBatchOperation = batchOperation;
+    dispatch_async(dispatch_get_main_queue(), ^{
+        SDWebImageBatchOperation *strongBatchOperation = weakBatchOperation;
+        NSArray *pendingItems = nil;
+        @synchronized (strongBatchOperation) {
+            pendingItems = [strongBatchOperation.pendingDownloadItems copy];
+            [strongBatchOperation.pendingDownloadItems removeAllObjects];
+        }
+        for (SDWebImageBatchItem *pendingItem in pendingItems) {
+            if (!pendingItem.isCancelled) {
+                [self handleCachedImage:nil cacheType:SDImageCacheTypeNone forBatchItem:pendingItem completed:itemBlock];
             }
         }
-    }]; // self.imageCache queryDiskCacheForKey:...
+    });
+}
+
+- (NSUInteger)foregroundDownloadCount {
+    return atomic_load(&_foregroundDownloadCount);
+}
+
+- (NSUInteger)memoryCacheHitCount {
+    return atomic_load_explicit(&_memoryCacheHitCount, memory_order_relaxed);
+}
 
+- (void)foregroundDownloadDidStart {
+    if (atomic_fetch_add(&_foregroundDownloadCount, 1) == 0) {
+        [self postForegroundDownloadsDidChangeNotification];
+    }
+}
+
+- (void)foregroundDownloadDidFinish {
+    if (atomic_fetch_sub(&_foregroundDownloadCount, 1) == 1) {
+        [self postForegroundDownloadsDidChangeNotification];
+    }
+}
+
+// 只在 0 和非 0 之间变化时发出，观察者自己读取 foregroundDownloadCount 的当前值
+- (void)postForegroundDownloadsDidChangeNotification {
+    dispatch_async(dispatch_get_main_queue(), ^{
+        [[NSNotificationCenter defaultCenter] postNotificationName:SDWebImageManagerForegroundDownloadsDidChangeNotification object:self];
+    });
+}
+
+/**
+ *  不需要查询 disk 和下载的请求 (命中 memory 缓存、URL 无效) 的回调
+ *  同步回调时返回之前已经回调完，返回共享的 SDWebImageFinishedOperation；
+ *  设置了 completionQueue 时回调是异步的，返回一个不加入 runningOperations 的 operation，在回调之前取消就不再回调
+ */
+- (id <SDWebImageOperation>)deliverImmediateCompletion:(dispatch_block_t)block traceID:(SDWebImageTraceID)traceID {
+    if (!self.completionQueue) {
+        [self deliverCompletion:block traceID:traceID];
+        return [SDWebImageFinishedOperation sharedOperation];
+    }
+    SDWebImageCombinedOperation *operation = [SDWebImageCombinedOperation new];
+    [self deliverCompletion:^{
+        if (!operation.isCancelled) {
+            block();
+        }
+    } traceID:traceID];
     return operation;
 }
 
+/**
+ *  与 deliverCompletion: 相同，同时记录从提交到回调执行完的时间
+ */
+- (void)deliverCompletion:(dispatch_block_t)block traceID:(SDWebImageTraceID)traceID {
+    if (!traceID) {
+        [self deliverCompletion:block];
+        return;
+    }
+    uint64_t deliveryStart = SDWebImageTraceTimestamp(traceID);
+    [self deliverCompletion:^{
+        block();
+        SDWebImageTraceEnd(traceID, SDWebImageTraceSpanDelivery, deliveryStart);
+    }];
+}
+
+/**
+ *  按 completionQueue 执行回调，没有设置时保持原来的同步方式
+ */
+- (void)deliverCompletion:(dispatch_block_t)block {
+    SDWebImageCompletionQueue *completionQueue = self.completionQueue;
+    if (completionQueue) {
+        [completionQueue enqueueBlock:block];
+    }
+    else {
+        dispatch_main_sync_safe(block);
+    }
+}
 
 /**
  *  将 image 存储到 cache 中
@@ -386,23 +976,119 @@
     }
 }
 
+- (void)addRunningOperation:(SDWebImageCombinedOperation *)operation {
+    @synchronized (self.runningOperations) {
+        [self.runningOperations addObject:operation];
+        if (operation.group) {
+            NSMutableSet *operations = self.groupedOperations[operation.group];
+            if (!operations) {
+                operations = [NSMutableSet new];
+                self.groupedOperations[operation.group] = operations;
+            }
+            [operations addObject:operation];
+        }
+    }
+}
+
+// 完成、取消、命中缓存时都会调用，可能调用多次，已经移除的 operation 什么也不做
+- (void)removeRunningOperation:(SDWebImageCombinedOperation *)operation {
+    if (!operation) {
+        return;
+    }
+    @synchronized (self.runningOperations) {
+        [self.runningOperations removeObject:operation];
+        if (operation.group) {
+            NSMutableSet *operations = self.groupedOperations[operation.group];
+            [operations removeObject:operation];
+            if (operations.count == 0) {
+                [self.groupedOperations removeObjectForKey:operation.group];
+            }
+        }
+    }
+}
+
 /**
  *  取消所有正在下载的 operation
+ *  在锁内只取出并清空集合，cancel 在锁外调用，cancelBlock 中的 removeRunningOperation: 不会和其他线程抢锁
  */
 - (void)cancelAll {
+    NSSet *operations = nil;
+    @synchronized (self.runningOperations) {
+        operations = [self.runningOperations copy];
+        [self.runningOperations removeAllObjects];
+        [self.groupedOperations removeAllObjects];
+    }
+    [operations makeObjectsPerformSelector:@selector(cancel)];
+}
+
+- (void)cancelOperationsInGroup:(id<NSCopying>)group {
+    if (!group) {
+        return;
+    }
+    NSSet *operations = nil;
     @synchronized (self.runningOperations) {
-        NSArray *copiedOperations = [self.runningOperations copy];
-        // makeObjectsPerformSelector:
-        [copiedOperations makeObjectsPerformSelector:@selector(cancel)];
-        [self.runningOperations removeObjectsInArray:copiedOperations];
+        operations = self.groupedOperations[group];
+        [self.groupedOperations removeObjectForKey:group];
+        for (SDWebImageCombinedOperation *operation in operations) {
+            [self.runningOperations removeObject:operation];
+        }
     }
+    [operations makeObjectsPerformSelector:@selector(cancel)];
 }
 
 /**
  *  判断是否有图片正在下载
  */
 - (BOOL)isRunning {
-    return self.runningOperations.count > 0;
+    @synchronized (self.runningOperations) {
+        return self.runningOperations.count > 0;
+    }
+}
+
+- (NSUInteger)runningOperationCount {
+    @synchronized (self.runningOperations) {
+        return self.runningOperations.count;
+    }
+}
+
+- (NSUInteger)runningOperationCountInGroup:(id<NSCopying>)group {
+    if (!group) {
+        return 0;
+    }
+    @synchronized (self.runningOperations) {
+        return [self.groupedOperations[group] count];
+    }
+}
+
+@end
+
+
+@implementation SDWebImageFinishedOperation
+
++ (SDWebImageFinishedOperation *)sharedOperation {
+    static dispatch_once_t once;
+    static id instance;
+    dispatch_once(&once, ^{
+        instance = [self new];
+    });
+    return instance;
+}
+
+- (void)cancel {
+    // 请求已经完成，什么也不做
+}
+
+@end
+
+
+@implementation SDWebImageBatchRequest
+
++ (SDWebImageBatchRequest *)requestWithURL:(NSURL *)url options:(SDWebImageOptions)options context:(NSDictionary *)context {
+    SDWebImageBatchRequest *request = [self new];
+    request->_url = url;
+    request->_options = options;
+    request->_context = [context copy];
+    return request;
 }
 
 @end
@@ -440,3 +1126,60 @@
 }
 
 @end
+
+
+@implementation SDWebImageBatchItem
+@end
+
+
+@implementation SDWebImageBatchOperation {
+    NSMutableArray *_images;
+    NSMutableArray *_errors;
+    NSMutableIndexSet *_finishedIndexes;
+}
+
+- (id)initWithCount:(NSUInteger)count {
+    if ((self = [super init])) {
+        _images = [NSMutableArray arrayWithCapacity:count];
+        _errors = [NSMutableArray arrayWithCapacity:count];
+        for (NSUInteger i = 0; i < count; i++) {
+            [_images addObject:[NSNull null]];
+            [_errors addObject:[NSNull null]];
+        }
+        _finishedIndexes = [NSMutableIndexSet new];
+        _pendingDownloadItems = [NSMutableArray new];
+    }
+    return self;
+}
+
+- (BOOL)finishItemAtIndex:(NSUInteger)index image:(UIImage *)image error:(NSError *)error {
+    @synchronized (self) {
+        if (index >= _images.count || [_finishedIndexes containsIndex:index]) {
+            return NO;
+        }
+        [_finishedIndexes addIndex:index];
+        if (image) _images[index] = image;
+        if (error) _errors[index] = error;
+        return _finishedIndexes.count == _images.count;
+    }
+}
+
+- (NSArray *)images {
+    @synchronized (self) {
+        return [_images copy];
+    }
+}
+
+- (NSArray *)errors {
+    @synchronized (self) {
+        return [_errors copy];
+    }
+}
+
+- (void)cancel {
+    [super cancel];
+    // 每张图片的 operation 会取消自己的下载
+    [self.items makeObjectsPerformSelector:@selector(cancel)];
+}
+
+@end
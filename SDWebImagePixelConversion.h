@@ -0,0 +1,80 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import <Foundation/Foundation.h>
+#import <CoreGraphics/CoreGraphics.h>
+#import "SDWebImageCompat.h"
+
+/**
+ *  常见像素格式转换的 kernel，有 NEON (arm) 和 SSE2 (模拟器) 的向量化实现，其他平台使用标量实现
+ *  所有的 kernel 都是逐个像素独立计算的，src 和 dst 可以是同一块内存 (原地转换)
+ *  像素的通道顺序都是指内存中的字节顺序，每个像素 4 个字节，alpha 在最后一个字节
+ */
+
+/**
+ *  RGBA <-> BGRA，交换第 0 和第 2 个字节
+ *
+ *  @param pixelCount 像素个数
+ */
+extern void SDPixelSwizzleRGBAToBGRA(const uint8_t *src, uint8_t *dst, size_t pixelCount);
+
+/**
+ *  将颜色通道乘以 alpha (c * a / 255，四舍五入)
+ *
+ *  @param swizzle 同时交换 R 和 B (RGBA -> 预乘的 BGRA)
+ */
+extern void SDPixelPremultiply(const uint8_t *src, uint8_t *dst, size_t pixelCount, BOOL swizzle);
+
+/**
+ *  将 alpha 设为 0xFF，用于没有 alpha 的图片 (alpha 的位置是被跳过的字节，内容不确定)
+ *
+ *  @param swizzle 同时交换 R 和 B (RGBX -> BGRA)
+ */
+extern void SDPixelSetOpaque(const uint8_t *src, uint8_t *dst, size_t pixelCount, BOOL swizzle);
+
+/**
+ *  每个通道 16 位转成 8 位 (v / 257，四舍五入)，16 位的数据是主机字节序
+ *
+ *  @param componentCount 通道个数 (像素个数 * 4)
+ */
+extern void SDPixelConvert16To8(const uint16_t *src, uint8_t *dst, size_t componentCount);
+
+/**
+ *  按 EXIF 方向 (1...8) 旋转 / 翻转 32 位的像素，结果是按方向显示之后的图片
+ *  按 32x32 的块处理，旋转 90 度时读写都在缓存中，不会因为按列写入而不断地缓存失效
+ *  src 和 dst 不能是同一块内存
+ *
+ *  @param width          src 的宽 (像素)，方向是 5...8 时 dst 的高等于这个值
+ *  @param height         src 的高 (像素)，方向是 5...8 时 dst 的宽等于这个值
+ *  @param exifOrientation EXIF 方向，其他值按 1 处理
+ */
+extern void SDPixelApplyEXIFOrientation(const uint8_t *src, size_t srcBytesPerRow, size_t width, size_t height,
+                                        uint8_t *dst, size_t dstBytesPerRow, NSInteger exifOrientation);
+
+/**
+ *  将 imageRef 的像素直接转换成预乘的 BGRA (kCGBitmapByteOrder32Little | kCGImageAlphaPremultipliedFirst) 写入 dst，
+ *  不经过 CGContextDrawImage 的通用转换
+ *  只处理 RGB 颜色空间、每个像素 4 个通道 (包括 alpha 被跳过的不透明格式)、8 位或 16 位 (小端) 的常见格式，
+ *  其他格式返回 NO，由调用者用 CGContext 绘制
+ *
+ *  内存中的字节顺序和使用的 kernel：
+ *      R G B A (预乘)        -> SDPixelSwizzleRGBAToBGRA
+ *      R G B A (没有预乘)    -> SDPixelPremultiply (swizzle)
+ *      R G B X (跳过 alpha)  -> SDPixelSetOpaque (swizzle)
+ *      B G R A (预乘)        -> 直接拷贝
+ *      B G R A (没有预乘)    -> SDPixelPremultiply
+ *      B G R X (跳过 alpha)  -> SDPixelSetOpaque
+ *  16 位的格式先用 SDPixelConvert16To8 转成 8 位的 R G B A / R G B X，再按上面处理
+ *
+ *  @param imageRef    要转换的图片，转换后的像素仍然使用它的颜色空间
+ *  @param dst         目标内存，至少有 CGImageGetHeight(imageRef) * bytesPerRow 字节
+ *  @param bytesPerRow 目标内存每一行的字节数，至少为 width * 4
+ *
+ *  @return 是否转换成功
+ */
+extern BOOL SDPixelConvertImageToPremultipliedBGRA(CGImageRef imageRef, uint8_t *dst, size_t bytesPerRow);
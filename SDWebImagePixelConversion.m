@@ -0,0 +1,449 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import "SDWebImagePixelConversion.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#import <arm_neon.h>
+#define SD_PIXEL_NEON 1
+#elif defined(__SSE2__)
+#import <emmintrin.h>
+#define SD_PIXEL_SSE2 1
+#endif
+
+// c * a / 255 四舍五入，对所有的 0...255 * 0...255 都是精确的
+FOUNDATION_STATIC_INLINE uint8_t SDPixelMultiplyDiv255(uint32_t c, uint32_t a) {
+    uint32_t t = c * a + 128;
+    return (uint8_t)((t + (t >> 8)) >> 8);
+}
+
+// v / 257 四舍五入，t 饱和到 65535 和 16 位的向量实现保持一致
+FOUNDATION_STATIC_INLINE uint8_t SDPixelDiv257(uint32_t v) {
+    uint32_t t = MIN(v + 128, 65535u);
+    return (uint8_t)((t - (t >> 8)) >> 8);
+}
+
+#pragma mark - Scalar
+
+static void SDPixelSwizzleScalar(const uint8_t *src, uint8_t *dst, size_t pixelCount) {
+    for (size_t i = 0; i < pixelCount; i++, src += 4, dst += 4) {
+        uint8_t r = src[0], g = src[1], b = src[2], a = src[3];
+        dst[0] = b;
+        dst[1] = g;
+        dst[2] = r;
+        dst[3] = a;
+    }
+}
+
+static void SDPixelSetOpaqueScalar(const uint8_t *src, uint8_t *dst, size_t pixelCount, BOOL swizzle) {
+    for (size_t i = 0; i < pixelCount; i++, src += 4, dst += 4) {
+        uint8_t c0 = src[0], c1 = src[1], c2 = src[2];
+        dst[0] = swizzle ? c2 : c0;
+        dst[1] = c1;
+        dst[2] = swizzle ? c0 : c2;
+        dst[3] = 0xFF;
+    }
+}
+
+static void SDPixelPremultiplyScalar(const uint8_t *src, uint8_t *dst, size_t pixelCount, BOOL swizzle) {
+    for (size_t i = 0; i < pixelCount; i++, src += 4, dst += 4) {
+        uint8_t c0 = src[0], c1 = src[1], c2 = src[2], a = src[3];
+        c0 = SDPixelMultiplyDiv255(c0, a);
+        c1 = SDPixelMultiplyDiv255(c1, a);
+        c2 = SDPixelMultiplyDiv255(c2, a);
+        dst[0] = swizzle ? c2 : c0;
+        dst[1] = c1;
+        dst[2] = swizzle ? c0 : c2;
+        dst[3] = a;
+    }
+}
+
+static void SDPixelConvert16To8Scalar(const uint16_t *src, uint8_t *dst, size_t componentCount) {
+    for (size_t i = 0; i < componentCount; i++) {
+        dst[i] = SDPixelDiv257(src[i]);
+    }
+}
+
+#pragma mark - NEON
+
+#if SD_PIXEL_NEON
+
+// 一次处理 16 个像素，vld4/vst4 直接按通道拆开和交错，swizzle 只是交换存储的顺序
+static size_t SDPixelSwizzleNEON(const uint8_t *src, uint8_t *dst, size_t pixelCount) {
+    size_t i = 0;
+    for (; i + 16 <= pixelCount; i += 16, src += 64, dst += 64) {
+        uint8x16x4_t pixels = vld4q_u8(src);
+        uint8x16_t r = pixels.val[0];
+        pixels.val[0] = pixels.val[2];
+        pixels.val[2] = r;
+        vst4q_u8(dst, pixels);
+    }
+    return i;
+}
+
+static size_t SDPixelSetOpaqueNEON(const uint8_t *src, uint8_t *dst, size_t pixelCount, BOOL swizzle) {
+    size_t i = 0;
+    const uint8x16_t opaque = vdupq_n_u8(0xFF);
+    for (; i + 16 <= pixelCount; i += 16, src += 64, dst += 64) {
+        uint8x16x4_t pixels = vld4q_u8(src);
+        if (swizzle) {
+            uint8x16_t r = pixels.val[0];
+            pixels.val[0] = pixels.val[2];
+            pixels.val[2] = r;
+        }
+        pixels.val[3] = opaque;
+        vst4q_u8(dst, pixels);
+    }
+    return i;
+}
+
+// (p + ((p + 128) >> 8) + 128) >> 8，和标量实现的结果完全一致
+FOUNDATION_STATIC_INLINE uint8x16_t SDPixelMultiplyDiv255NEON(uint8x16_t c, uint8x16_t a) {
+    uint16x8_t lo = vmull_u8(vget_low_u8(c), vget_low_u8(a));
+    uint16x8_t hi = vmull_u8(vget_high_u8(c), vget_high_u8(a));
+    return vcombine_u8(vraddhn_u16(lo, vrshrq_n_u16(lo, 8)), vraddhn_u16(hi, vrshrq_n_u16(hi, 8)));
+}
+
+static size_t SDPixelPremultiplyNEON(const uint8_t *src, uint8_t *dst, size_t pixelCount, BOOL swizzle) {
+    size_t i = 0;
+    for (; i + 16 <= pixelCount; i += 16, src += 64, dst += 64) {
+        uint8x16x4_t pixels = vld4q_u8(src);
+        uint8x16_t a = pixels.val[3];
+        uint8x16_t c0 = SDPixelMultiplyDiv255NEON(pixels.val[0], a);
+        pixels.val[1] = SDPixelMultiplyDiv255NEON(pixels.val[1], a);
+        uint8x16_t c2 = SDPixelMultiplyDiv255NEON(pixels.val[2], a);
+        pixels.val[0] = swizzle ? c2 : c0;
+        pixels.val[2] = swizzle ? c0 : c2;
+        vst4q_u8(dst, pixels);
+    }
+    return i;
+}
+
+static size_t SDPixelConvert16To8NEON(const uint16_t *src, uint8_t *dst, size_t componentCount) {
+    size_t i = 0;
+    uint16x8_t half = vdupq_n_u16(128);
+    for (; i + 16 <= componentCount; i += 16, src += 16, dst += 16) {
+        uint16x8_t lo = vqaddq_u16(vld1q_u16(src), half);
+        uint16x8_t hi = vqaddq_u16(vld1q_u16(src + 8), half);
+        lo = vsubq_u16(lo, vshrq_n_u16(lo, 8));
+        hi = vsubq_u16(hi, vshrq_n_u16(hi, 8));
+        vst1q_u8(dst, vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8)));
+    }
+    return i;
+}
+
+#endif
+
+#pragma mark - SSE2
+
+#if SD_PIXEL_SSE2
+
+// 每个像素看成一个 32 位整数 (小端)，交换最低字节和第三个字节
+FOUNDATION_STATIC_INLINE __m128i SDPixelSwizzleSSE2Vector(__m128i pixels) {
+    const __m128i keepMask = _mm_set1_epi32((int)0xFF00FF00);
+    const __m128i lowMask = _mm_set1_epi32(0x000000FF);
+    __m128i kept = _mm_and_si128(pixels, keepMask);
+    __m128i r = _mm_slli_epi32(_mm_and_si128(pixels, lowMask), 16);
+    __m128i b = _mm_and_si128(_mm_srli_epi32(pixels, 16), lowMask);
+    return _mm_or_si128(kept, _mm_or_si128(r, b));
+}
+
+static size_t SDPixelSwizzleSSE2(const uint8_t *src, uint8_t *dst, size_t pixelCount) {
+    size_t i = 0;
+    for (; i + 4 <= pixelCount; i += 4, src += 16, dst += 16) {
+        __m128i pixels = _mm_loadu_si128((const __m128i *)src);
+        _mm_storeu_si128((__m128i *)dst, SDPixelSwizzleSSE2Vector(pixels));
+    }
+    return i;
+}
+
+static size_t SDPixelSetOpaqueSSE2(const uint8_t *src, uint8_t *dst, size_t pixelCount, BOOL swizzle) {
+    size_t i = 0;
+    const __m128i alphaMask = _mm_set1_epi32((int)0xFF000000);
+    for (; i + 4 <= pixelCount; i += 4, src += 16, dst += 16) {
+        __m128i pixels = _mm_loadu_si128((const __m128i *)src);
+        if (swizzle) {
+            pixels = SDPixelSwizzleSSE2Vector(pixels);
+        }
+        _mm_storeu_si128((__m128i *)dst, _mm_or_si128(pixels, alphaMask));
+    }
+    return i;
+}
+
+// 两个像素展开成 8 个 16 位的通道，alpha 通道乘以 255 保持不变
+FOUNDATION_STATIC_INLINE __m128i SDPixelPremultiplySSE2Half(__m128i channels) {
+    const __m128i colorMask = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+    const __m128i alphaOne = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+    __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(channels, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    alpha = _mm_or_si128(_mm_and_si128(alpha, colorMask), alphaOne);
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(channels, alpha), _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+static size_t SDPixelPremultiplySSE2(const uint8_t *src, uint8_t *dst, size_t pixelCount, BOOL swizzle) {
+    size_t i = 0;
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 4 <= pixelCount; i += 4, src += 16, dst += 16) {
+        __m128i pixels = _mm_loadu_si128((const __m128i *)src);
+        __m128i lo = SDPixelPremultiplySSE2Half(_mm_unpacklo_epi8(pixels, zero));
+        __m128i hi = SDPixelPremultiplySSE2Half(_mm_unpackhi_epi8(pixels, zero));
+        pixels = _mm_packus_epi16(lo, hi);
+        if (swizzle) {
+            pixels = SDPixelSwizzleSSE2Vector(pixels);
+        }
+        _mm_storeu_si128((__m128i *)dst, pixels);
+    }
+    return i;
+}
+
+static size_t SDPixelConvert16To8SSE2(const uint16_t *src, uint8_t *dst, size_t componentCount) {
+    size_t i = 0;
+    const __m128i half = _mm_set1_epi16(128);
+    for (; i + 16 <= componentCount; i += 16, src += 16, dst += 16) {
+        __m128i lo = _mm_adds_epu16(_mm_loadu_si128((const __m128i *)src), half);
+        __m128i hi = _mm_adds_epu16(_mm_loadu_si128((const __m128i *)(src + 8)), half);
+        lo = _mm_srli_epi16(_mm_sub_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+        hi = _mm_srli_epi16(_mm_sub_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+        _mm_storeu_si128((__m128i *)dst, _mm_packus_epi16(lo, hi));
+    }
+    return i;
+}
+
+#endif
+
+#pragma mark - Kernels
+
+// 向量实现处理整块的部分，剩下不足一块的像素用标量实现
+void SDPixelSwizzleRGBAToBGRA(const uint8_t *src, uint8_t *dst, size_t pixelCount) {
+    size_t done = 0;
+#if SD_PIXEL_NEON
+    done = SDPixelSwizzleNEON(src, dst, pixelCount);
+#elif SD_PIXEL_SSE2
+    done = SDPixelSwizzleSSE2(src, dst, pixelCount);
+#endif
+    SDPixelSwizzleScalar(src + done * 4, dst + done * 4, pixelCount - done);
+}
+
+void SDPixelSetOpaque(const uint8_t *src, uint8_t *dst, size_t pixelCount, BOOL swizzle) {
+    size_t done = 0;
+#if SD_PIXEL_NEON
+    done = SDPixelSetOpaqueNEON(src, dst, pixelCount, swizzle);
+#elif SD_PIXEL_SSE2
+    done = SDPixelSetOpaqueSSE2(src, dst, pixelCount, swizzle);
+#endif
+    SDPixelSetOpaqueScalar(src + done * 4, dst + done * 4, pixelCount - done, swizzle);
+}
+
+void SDPixelPremultiply(const uint8_t *src, uint8_t *dst, size_t pixelCount, BOOL swizzle) {
+    size_t done = 0;
+#if SD_PIXEL_NEON
+    done = SDPixelPremultiplyNEON(src, dst, pixelCount, swizzle);
+#elif SD_PIXEL_SSE2
+    done = SDPixelPremultiplySSE2(src, dst, pixelCount, swizzle);
+#endif
+    SDPixelPremultiplyScalar(src + done * 4, dst + done * 4, pixelCount - done, swizzle);
+}
+
+void SDPixelConvert16To8(const uint16_t *src, uint8_t *dst, size_t componentCount) {
+    size_t done = 0;
+#if SD_PIXEL_NEON
+    done = SDPixelConvert16To8NEON(src, dst, componentCount);
+#elif SD_PIXEL_SSE2
+    done = SDPixelConvert16To8SSE2(src, dst, componentCount);
+#endif
+    SDPixelConvert16To8Scalar(src + done, dst + done, componentCount - done);
+}
+
+#pragma mark - Orientation
+
+static const size_t kOrientationTileSize = 32;
+
+// 像素 (x, y) 在目标图片中的列和行都是 x、y 的线性函数：col = colX * x + colY * y + col0，row 同理
+typedef struct {
+    ptrdiff_t colX, colY, col0;
+    ptrdiff_t rowX, rowY, row0;
+} SDPixelOrientationMapping;
+
+static SDPixelOrientationMapping SDPixelOrientationMappingForEXIFOrientation(NSInteger exifOrientation, ptrdiff_t width, ptrdiff_t height) {
+    switch (exifOrientation) {
+        case 2: // 水平翻转
+            return (SDPixelOrientationMapping){-1, 0, width - 1, 0, 1, 0};
+        case 3: // 旋转 180 度
+            return (SDPixelOrientationMapping){-1, 0, width - 1, 0, -1, height - 1};
+        case 4: // 垂直翻转
+            return (SDPixelOrientationMapping){1, 0, 0, 0, -1, height - 1};
+        case 5: // 沿左上到右下的对角线翻转
+            return (SDPixelOrientationMapping){0, 1, 0, 1, 0, 0};
+        case 6: // 顺时针旋转 90 度
+            return (SDPixelOrientationMapping){0, -1, height - 1, 1, 0, 0};
+        case 7: // 沿右上到左下的对角线翻转
+            return (SDPixelOrientationMapping){0, -1, height - 1, -1, 0, width - 1};
+        case 8: // 逆时针旋转 90 度
+            return (SDPixelOrientationMapping){0, 1, 0, -1, 0, width - 1};
+        default:
+            return (SDPixelOrientationMapping){1, 0, 0, 0, 1, 0};
+    }
+}
+
+void SDPixelApplyEXIFOrientation(const uint8_t *src, size_t srcBytesPerRow, size_t width, size_t height,
+                                 uint8_t *dst, size_t dstBytesPerRow, NSInteger exifOrientation) {
+    if (!src || !dst || width == 0 || height == 0) {
+        return;
+    }
+    SDPixelOrientationMapping mapping = SDPixelOrientationMappingForEXIFOrientation(exifOrientation, width, height);
+    // src 中 x 加 1、y 加 1 时 dst 中移动的字节数
+    const ptrdiff_t dstStepX = mapping.colX * 4 + mapping.rowX * (ptrdiff_t)dstBytesPerRow;
+    const ptrdiff_t dstStepY = mapping.colY * 4 + mapping.rowY * (ptrdiff_t)dstBytesPerRow;
+    uint8_t *dstOrigin = dst + mapping.col0 * 4 + mapping.row0 * (ptrdiff_t)dstBytesPerRow;
+
+    for (size_t tileY = 0; tileY < height; tileY += kOrientationTileSize) {
+        size_t tileHeight = MIN(kOrientationTileSize, height - tileY);
+        for (size_t tileX = 0; tileX < width; tileX += kOrientationTileSize) {
+            size_t tileWidth = MIN(kOrientationTileSize, width - tileX);
+            for (size_t y = tileY; y < tileY + tileHeight; y++) {
+                const uint32_t *srcPixel = (const uint32_t *)(src + y * srcBytesPerRow) + tileX;
+                uint8_t *dstPixel = dstOrigin + (ptrdiff_t)tileX * dstStepX + (ptrdiff_t)y * dstStepY;
+                for (size_t x = 0; x < tileWidth; x++, srcPixel++, dstPixel += dstStepX) {
+                    *(uint32_t *)dstPixel = *srcPixel;
+                }
+            }
+        }
+    }
+}
+
+#pragma mark - CGImage
+
+// 8 位的像素转换成预乘的 BGRA 需要做的操作
+typedef NS_ENUM(NSInteger, SDPixelConversion) {
+    SDPixelConversionUnsupported,
+    // 已经是预乘的 BGRA
+    SDPixelConversionCopy,
+    // 预乘的 RGBA
+    SDPixelConversionSwizzle,
+    // 没有预乘的 BGRA
+    SDPixelConversionPremultiply,
+    // 没有预乘的 RGBA
+    SDPixelConversionPremultiplyAndSwizzle,
+    // 没有 alpha 的 BGRX (最后一个字节被跳过)
+    SDPixelConversionOpaque,
+    // 没有 alpha 的 RGBX
+    SDPixelConversionOpaqueAndSwizzle
+};
+
+// 转换成 8 位之后，alpha (或者被跳过的字节) 在最后的 RGBA 和 BGRA 对应的操作
+// JPEG 等不透明的图片解码出来通常是 kCGImageAlphaNoneSkipFirst / kCGImageAlphaNoneSkipLast
+static SDPixelConversion SDPixelConversionForAlphaInfo(CGImageAlphaInfo alphaInfo, BOOL bgra) {
+    switch (alphaInfo) {
+        case kCGImageAlphaLast:
+            return bgra ? SDPixelConversionUnsupported : SDPixelConversionPremultiplyAndSwizzle;
+        case kCGImageAlphaPremultipliedLast:
+            return bgra ? SDPixelConversionUnsupported : SDPixelConversionSwizzle;
+        case kCGImageAlphaFirst:
+            return bgra ? SDPixelConversionPremultiply : SDPixelConversionUnsupported;
+        case kCGImageAlphaPremultipliedFirst:
+            return bgra ? SDPixelConversionCopy : SDPixelConversionUnsupported;
+        case kCGImageAlphaNoneSkipLast:
+            return bgra ? SDPixelConversionUnsupported : SDPixelConversionOpaqueAndSwizzle;
+        case kCGImageAlphaNoneSkipFirst:
+            return bgra ? SDPixelConversionOpaque : SDPixelConversionUnsupported;
+        default:
+            return SDPixelConversionUnsupported;
+    }
+}
+
+BOOL SDPixelConvertImageToPremultipliedBGRA(CGImageRef imageRef, uint8_t *dst, size_t bytesPerRow) {
+    if (!imageRef || !dst) {
+        return NO;
+    }
+
+    size_t width = CGImageGetWidth(imageRef);
+    size_t height = CGImageGetHeight(imageRef);
+    size_t bitsPerComponent = CGImageGetBitsPerComponent(imageRef);
+    size_t bitsPerPixel = CGImageGetBitsPerPixel(imageRef);
+    CGBitmapInfo bitmapInfo = CGImageGetBitmapInfo(imageRef);
+    CGBitmapInfo byteOrder = bitmapInfo & kCGBitmapByteOrderMask;
+    CGImageAlphaInfo alphaInfo = (CGImageAlphaInfo)(bitmapInfo & kCGBitmapAlphaInfoMask);
+    if (width == 0 || height == 0 || bytesPerRow < width * 4) {
+        return NO;
+    }
+    if (CGColorSpaceGetModel(CGImageGetColorSpace(imageRef)) != kCGColorSpaceModelRGB || (bitmapInfo & kCGBitmapFloatComponents)) {
+        return NO;
+    }
+
+    SDPixelConversion conversion = SDPixelConversionUnsupported;
+    BOOL sixteenBits = NO;
+    if (bitsPerComponent == 8 && bitsPerPixel == 32) {
+        if (byteOrder == kCGBitmapByteOrderDefault || byteOrder == kCGBitmapByteOrder32Big) {
+            conversion = SDPixelConversionForAlphaInfo(alphaInfo, NO);
+        }
+        else if (byteOrder == kCGBitmapByteOrder32Little) {
+            conversion = SDPixelConversionForAlphaInfo(alphaInfo, YES);
+        }
+    }
+#if __LITTLE_ENDIAN__
+    else if (bitsPerComponent == 16 && bitsPerPixel == 64 && byteOrder == kCGBitmapByteOrder16Little) {
+        // 16 位的通道在内存中仍然是 R G B A 的顺序
+        conversion = SDPixelConversionForAlphaInfo(alphaInfo, NO);
+        sixteenBits = YES;
+    }
+#endif
+    if (conversion == SDPixelConversionUnsupported) {
+        return NO;
+    }
+
+    // CGImage 没有公开的方法直接访问像素，只能拷贝；ImageIO 创建的没有缓存的图片在这里才解码，
+    // 解码的结果直接写到返回的 data 中，不会再多一次拷贝
+    CFDataRef data = CGDataProviderCopyData(CGImageGetDataProvider(imageRef));
+    if (!data) {
+        return NO;
+    }
+    size_t srcBytesPerRow = CGImageGetBytesPerRow(imageRef);
+    if ((size_t)CFDataGetLength(data) < srcBytesPerRow * (height - 1) + width * bitsPerPixel / 8) {
+        CFRelease(data);
+        return NO;
+    }
+
+    const uint8_t *src = CFDataGetBytePtr(data);
+    for (size_t y = 0; y < height; y++) {
+        const uint8_t *srcRow = src + y * srcBytesPerRow;
+        uint8_t *dstRow = dst + y * bytesPerRow;
+        if (sixteenBits) {
+            // 先转换成 8 位写到目标行中，再在目标行上原地转换
+            SDPixelConvert16To8((const uint16_t *)srcRow, dstRow, width * 4);
+            srcRow = dstRow;
+        }
+        switch (conversion) {
+            case SDPixelConversionCopy:
+                if (srcRow != dstRow) {
+                    memcpy(dstRow, srcRow, width * 4);
+                }
+                break;
+            case SDPixelConversionSwizzle:
+                SDPixelSwizzleRGBAToBGRA(srcRow, dstRow, width);
+                break;
+            case SDPixelConversionPremultiply:
+                SDPixelPremultiply(srcRow, dstRow, width, NO);
+                break;
+            case SDPixelConversionPremultiplyAndSwizzle:
+                SDPixelPremultiply(srcRow, dstRow, width, YES);
+                break;
+            case SDPixelConversionOpaque:
+                // 被跳过的字节内容不确定，要写成 0xFF，预乘的 BGRA 中不透明的像素 alpha 必须是 255
+                SDPixelSetOpaque(srcRow, dstRow, width, NO);
+                break;
+            case SDPixelConversionOpaqueAndSwizzle:
+                SDPixelSetOpaque(srcRow, dstRow, width, YES);
+                break;
+            default:
+                break;
+        }
+    }
+
+    CFRelease(data);
+    return YES;
+}
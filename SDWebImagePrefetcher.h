@@ -0,0 +1,95 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import <Foundation/Foundation.h>
+#import "SDWebImageManager.h"
+
+/**
+ *  每预加载完一张图片调用的 block
+ *
+ *  @param finishedCount 已经完成 (成功或者失败) 的图片个数
+ *  @param totalCount    这一次预加载的图片总数
+ */
+typedef void(^SDWebImagePrefetcherProgressBlock)(NSUInteger finishedCount, NSUInteger totalCount);
+
+/**
+ *  所有图片都预加载完之后调用的 block
+ *
+ *  @param finishedCount 完成的图片个数
+ *  @param skippedCount  失败的图片个数
+ */
+typedef void(^SDWebImagePrefetcherCompletionBlock)(NSUInteger finishedCount, NSUInteger skippedCount);
+
+/**
+ *  在 SDWebImageManager 之上的预加载
+ *  预加载的图片有自己的低优先级通道：最多同时下载 maxConcurrentDownloads 张，不会占满 downloader 的下载数
+ *  有前台 (非预加载) 的下载时暂停开始新的预加载，前台的下载都完成之后继续
+ *  同一个 URL 要显示时，downloader 会把正在排队的预加载下载提升到前台请求的优先级
+ */
+@interface SDWebImagePrefetcher : NSObject
+
+/**
+ *  执行预加载的 SDWebImageManager
+ */
+@property (strong, nonatomic, readonly) SDWebImageManager *manager;
+
+/**
+ *  同时预加载的最多图片数，默认是 2
+ */
+@property (assign, nonatomic) NSUInteger maxConcurrentDownloads;
+
+/**
+ *  预加载占用的带宽上限 (bytes per second)，默认是 0 不限制
+ *  NSURLConnection 不能限制单个连接的速度，这里在开始新的下载之前检查：最近收到的数据超出上限时推迟开始下一张，
+ *  平均速度会回到上限以下，但是一张很大的图片仍然可能短时间超出
+ *  在开始一张图片的下载时读取，修改之后对已经开始的下载不起作用
+ */
+@property (assign, nonatomic) NSUInteger maxBytesPerSecond;
+
+/**
+ *  有前台下载时是否暂停开始新的预加载，默认是 YES
+ *  已经开始的预加载不会被取消 (同一个 URL 的前台请求可能正合并在这个下载中)
+ */
+@property (assign, nonatomic) BOOL yieldsToForegroundDownloads;
+
+/**
+ *  预加载使用的 options，默认是 SDWebImageLowPriority
+ */
+@property (assign, nonatomic) SDWebImageOptions options;
+
+/**
+ *  回调和内部状态所在的队列，默认是主队列
+ */
+@property (strong, nonatomic) dispatch_queue_t prefetcherQueue;
+
+/**
+ *  预加载的单例，使用 [SDWebImageManager sharedManager]
+ */
++ (SDWebImagePrefetcher *)sharedImagePrefetcher;
+
+/**
+ *  @param manager 执行预加载的 SDWebImageManager
+ */
+- (id)initWithImageManager:(SDWebImageManager *)manager;
+
+/**
+ *  预加载一组 URL，会先取消正在进行的预加载
+ */
+- (void)prefetchURLs:(NSArray *)urls;
+
+/**
+ *  与上面的方法相同，多了进度和完成的回调，在 prefetcherQueue 中调用
+ */
+- (void)prefetchURLs:(NSArray *)urls progress:(SDWebImagePrefetcherProgressBlock)progressBlock completed:(SDWebImagePrefetcherCompletionBlock)completionBlock;
+
+/**
+ *  取消所有还没有完成的预加载
+ */
+- (void)cancelPrefetching;
+
+@end
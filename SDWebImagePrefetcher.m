@@ -0,0 +1,262 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import "SDWebImagePrefetcher.h"
+
+@interface SDWebImagePrefetcher ()
+
+@property (strong, nonatomic, readwrite) SDWebImageManager *manager;
+// 以下的状态只在 prefetcherQueue 中读写 (带宽的部分除外)
+@property (strong, nonatomic) NSArray *prefetchURLs;
+@property (assign, nonatomic) NSUInteger nextIndex;
+@property (assign, nonatomic) NSUInteger finishedCount;
+@property (assign, nonatomic) NSUInteger skippedCount;
+// 正在执行的预加载 operation
+@property (strong, nonatomic) NSMutableArray *runningOperations;
+// URL -> 这个 URL 已经收到的字节数，用来从累计的进度算出每次新收到的数据
+// 下载的进度在下载线程中直接计入令牌桶，不切换到 prefetcherQueue；receivedSizes、availableBytes、lastRefillTime
+// 在任意线程中读写，都以 receivedSizes 作为锁，generation 在 prefetcherQueue 中修改时也持有这个锁
+@property (strong, nonatomic) NSMutableDictionary *receivedSizes;
+@property (copy, nonatomic) SDWebImagePrefetcherProgressBlock progressBlock;
+@property (copy, nonatomic) SDWebImagePrefetcherCompletionBlock completionBlock;
+// 每次预加载递增，取消之前的 operation 晚到的回调直接忽略
+@property (assign, nonatomic) NSUInteger generation;
+// 带宽的令牌桶：还可以接收的字节数 (可以是负数) 和上一次补充的时间
+@property (assign, nonatomic) double availableBytes;
+@property (assign, nonatomic) CFAbsoluteTime lastRefillTime;
+// 已经安排了因为带宽推迟的重试
+@property (assign, nonatomic) BOOL retryScheduled;
+
+@end
+
+@implementation SDWebImagePrefetcher
+
++ (SDWebImagePrefetcher *)sharedImagePrefetcher {
+    static dispatch_once_t once;
+    static id instance;
+    dispatch_once(&once, ^{
+        instance = [self new];
+    });
+    return instance;
+}
+
+- (id)init {
+    return [self initWithImageManager:[SDWebImageManager sharedManager]];
+}
+
+- (id)initWithImageManager:(SDWebImageManager *)manager {
+    if ((self = [super init])) {
+        _manager = manager;
+        _maxConcurrentDownloads = 2;
+        _yieldsToForegroundDownloads = YES;
+        _options = SDWebImageLowPriority;
+        _prefetcherQueue = dispatch_get_main_queue();
+        _runningOperations = [NSMutableArray new];
+        _receivedSizes = [NSMutableDictionary new];
+
+        // 前台的下载都完成之后继续预加载
+        [[NSNotificationCenter defaultCenter] addObserver:self
+                                                 selector:@selector(foregroundDownloadsDidChange:)
+                                                     name:SDWebImageManagerForegroundDownloadsDidChangeNotification
+                                                   object:manager];
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [[NSNotificationCenter defaultCenter] removeObserver:self];
+}
+
+- (void)prefetchURLs:(NSArray *)urls {
+    [self prefetchURLs:urls progress:nil completed:nil];
+}
+
+- (void)prefetchURLs:(NSArray *)urls progress:(SDWebImagePrefetcherProgressBlock)progressBlock completed:(SDWebImagePrefetcherCompletionBlock)completionBlock {
+    NSArray *prefetchURLs = [urls copy];
+    dispatch_async(self.prefetcherQueue, ^{
+        [self resetPrefetching];
+        self.prefetchURLs = prefetchURLs;
+        self.progressBlock = progressBlock;
+        self.completionBlock = completionBlock;
+
+        if (prefetchURLs.count == 0) {
+            [self finishPrefetchingIfNeeded];
+            return;
+        }
+        [self startPrefetchingIfPossible];
+    });
+}
+
+- (void)cancelPrefetching {
+    dispatch_async(self.prefetcherQueue, ^{
+        [self resetPrefetching];
+    });
+}
+
+#pragma mark SDWebImagePrefetcher (private)
+
+// 取消正在执行的预加载，清空状态，在 prefetcherQueue 中调用
+- (void)resetPrefetching {
+    @synchronized (self.receivedSizes) {
+        self.generation++;
+        [self.receivedSizes removeAllObjects];
+    }
+    NSArray *operations = [self.runningOperations copy];
+    [self.runningOperations removeAllObjects];
+    self.prefetchURLs = nil;
+    self.nextIndex = 0;
+    self.finishedCount = 0;
+    self.skippedCount = 0;
+    self.progressBlock = nil;
+    self.completionBlock = nil;
+    [operations makeObjectsPerformSelector:@selector(cancel)];
+}
+
+- (BOOL)isYielding {
+    return self.yieldsToForegroundDownloads && self.manager.foregroundDownloadCount > 0;
+}
+
+// 在 prefetcherQueue 中调用
+- (void)startPrefetchingIfPossible {
+    while (self.nextIndex < self.prefetchURLs.count && self.runningOperations.count < self.maxConcurrentDownloads) {
+        if ([self isYielding]) {
+            return;
+        }
+        if (![self hasBandwidthBudget]) {
+            [self scheduleBandwidthRetry];
+            return;
+        }
+
+        NSURL *url = self.prefetchURLs[self.nextIndex];
+        self.nextIndex++;
+        [self startPrefetchingURL:url];
+    }
+}
+
+- (void)startPrefetchingURL:(NSURL *)url {
+    NSUInteger generation = self.generation;
+    __weak __typeof(self)wself = self;
+    __block id <SDWebImageOperation> operation = nil;
+    // 不限制带宽时不需要进度，不传 progress block，下载线程不用为每一段数据回调
+    // 有上限时在下载线程中直接记账，不为每一段数据切换一次线程
+    SDWebImageDownloaderProgressBlock progressBlock = nil;
+    if (self.maxBytesPerSecond > 0) {
+        progressBlock = ^(NSInteger receivedSize, NSInteger expectedSize) {
+            [wself consumeBandwidthForURL:url receivedSize:receivedSize generation:generation];
+        };
+    }
+    operation = [self.manager downloadImageWithURL:url options:self.options context:@{SDWebImageManagerContextPrefetchKey: @YES} progress:progressBlock completed:^(UIImage *image, NSError *error, SDImageCacheType cacheType, BOOL finished, NSURL *imageURL) {
+        SDWebImagePrefetcher *sself = wself;
+        if (!sself || !finished) return;
+        dispatch_async(sself.prefetcherQueue, ^{
+            if (sself.generation != generation) {
+                return;
+            }
+            if (operation) {
+                [sself.runningOperations removeObjectIdenticalTo:operation];
+            }
+            @synchronized (sself.receivedSizes) {
+                [sself.receivedSizes removeObjectForKey:url];
+            }
+            sself.finishedCount++;
+            if (!image) {
+                sself.skippedCount++;
+            }
+            if (sself.progressBlock) {
+                sself.progressBlock(sself.finishedCount, sself.prefetchURLs.count);
+            }
+            [sself finishPrefetchingIfNeeded];
+            [sself startPrefetchingIfPossible];
+        });
+    }];
+    // 命中缓存时 completed 可能已经同步调用过，但是移除是在 prefetcherQueue 中异步执行的，一定在这之后
+    if (operation) {
+        [self.runningOperations addObject:operation];
+    }
+}
+
+- (void)finishPrefetchingIfNeeded {
+    if (self.finishedCount < self.prefetchURLs.count) {
+        return;
+    }
+    SDWebImagePrefetcherCompletionBlock completionBlock = self.completionBlock;
+    NSUInteger finishedCount = self.finishedCount;
+    NSUInteger skippedCount = self.skippedCount;
+    [self resetPrefetching];
+    if (completionBlock) {
+        completionBlock(finishedCount, skippedCount);
+    }
+}
+
+- (void)foregroundDownloadsDidChange:(NSNotification *)notification {
+    dispatch_async(self.prefetcherQueue, ^{
+        [self startPrefetchingIfPossible];
+    });
+}
+
+#pragma mark Bandwidth
+
+// 按经过的时间补充令牌，最多攒一秒的量，在持有 receivedSizes 锁时调用
+- (void)refillBandwidth {
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    double maxBytes = self.maxBytesPerSecond;
+    if (self.lastRefillTime == 0) {
+        self.availableBytes = maxBytes;
+    }
+    else {
+        self.availableBytes = MIN(maxBytes, self.availableBytes + (now - self.lastRefillTime) * maxBytes);
+    }
+    self.lastRefillTime = now;
+}
+
+- (BOOL)hasBandwidthBudget {
+    if (self.maxBytesPerSecond == 0) {
+        return YES;
+    }
+    @synchronized (self.receivedSizes) {
+        [self refillBandwidth];
+        return self.availableBytes > 0;
+    }
+}
+
+// 在下载的线程中调用，取消之前的 operation 晚到的进度直接忽略
+- (void)consumeBandwidthForURL:(NSURL *)url receivedSize:(NSInteger)receivedSize generation:(NSUInteger)generation {
+    @synchronized (self.receivedSizes) {
+        if (self.generation != generation) {
+            return;
+        }
+        NSInteger previousSize = [self.receivedSizes[url] integerValue];
+        self.receivedSizes[url] = @(receivedSize);
+        if (self.maxBytesPerSecond == 0 || receivedSize <= previousSize) {
+            return;
+        }
+        [self refillBandwidth];
+        self.availableBytes -= (receivedSize - previousSize);
+    }
+}
+
+// 透支的字节数按上限的速度补回来之后再重试
+- (void)scheduleBandwidthRetry {
+    if (self.retryScheduled || self.maxBytesPerSecond == 0) {
+        return;
+    }
+    self.retryScheduled = YES;
+    double availableBytes;
+    @synchronized (self.receivedSizes) {
+        availableBytes = self.availableBytes;
+    }
+    NSTimeInterval delay = MAX(0.05, -availableBytes / (double)self.maxBytesPerSecond);
+    __weak __typeof(self)wself = self;
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(delay * NSEC_PER_SEC)), self.prefetcherQueue, ^{
+        SDWebImagePrefetcher *sself = wself;
+        sself.retryScheduled = NO;
+        [sself startPrefetchingIfPossible];
+    });
+}
+
+@end
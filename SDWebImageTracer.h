@@ -0,0 +1,93 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import <Foundation/Foundation.h>
+#import <mach/mach_time.h>
+
+/**
+ *  一个请求在各个阶段花费的时间
+ */
+typedef NS_ENUM(NSUInteger, SDWebImageTraceSpan) {
+    // 查询 memory 缓存
+    SDWebImageTraceSpanMemoryLookup = 0,
+    // disk 查询在 ioQueue 中排队等待
+    SDWebImageTraceSpanDiskQueryWait,
+    // 从 disk 读取数据
+    SDWebImageTraceSpanDiskRead,
+    // 解码 (disk 缓存的数据或者下载的数据)
+    SDWebImageTraceSpanDecode,
+    // 下载 operation 在 downloadQueue 中排队等待
+    SDWebImageTraceSpanDownloadQueueWait,
+    // 从开始连接到收到响应 (包括 DNS、建立连接和等待第一个字节，NSURLConnection 不提供更细的时间)
+    SDWebImageTraceSpanTimeToFirstByte,
+    // 从收到响应到接收完所有数据
+    SDWebImageTraceSpanTransfer,
+    // transform
+    SDWebImageTraceSpanTransform,
+    // 存入缓存 (包括在 ioQueue 中排队和写入 disk)
+    SDWebImageTraceSpanStore,
+    // 回调从提交到执行完 (包括在主线程或者 completionQueue 中等待)
+    SDWebImageTraceSpanDelivery
+};
+
+/**
+ *  请求的标识，0 表示这个请求不记录
+ */
+typedef uint64_t SDWebImageTraceID;
+
+/**
+ *  记录每个请求各个阶段的时间，导出成 Chrome trace (chrome://tracing、Perfetto) 可以打开的 JSON
+ *  记录写入固定大小的环形缓冲区，写入不加锁，写满之后覆盖最早的记录
+ *  默认关闭，关闭时每个记录点只有一次判断
+ */
+@interface SDWebImageTracer : NSObject
+
+/**
+ *  是否记录，默认是 NO；只影响之后开始的请求
+ */
+@property (assign, nonatomic, getter = isEnabled) BOOL enabled;
+
++ (SDWebImageTracer *)sharedTracer;
+
+/**
+ *  导出缓冲区中的所有记录，每个请求是一行 (tid 是请求的标识)，时间从系统启动开始以微秒计
+ *
+ *  @return Chrome trace 格式的 JSON 数据
+ */
+- (NSData *)chromeTraceData;
+
+/**
+ *  清空缓冲区
+ */
+- (void)clear;
+
+@end
+
+/**
+ *  以下是各个模块记录时间使用的函数
+ */
+// 开始一个请求，没有开启记录时返回 0
+extern SDWebImageTraceID SDWebImageTraceBegin(void);
+// 当前线程正在处理的请求，调用 SDImageCache、SDWebImageDownloader 之前由 SDWebImageManager 设置，被调用的一方在方法中同步读取
+extern SDWebImageTraceID SDWebImageTraceCurrentID(void);
+// 设置当前线程正在处理的请求，返回之前的值，调用完成之后要恢复
+extern SDWebImageTraceID SDWebImageTraceSetCurrentID(SDWebImageTraceID traceID);
+// 写入一条记录，时间是 mach_absolute_time
+extern void SDWebImageTraceRecord(SDWebImageTraceID traceID, SDWebImageTraceSpan span, uint64_t start, uint64_t end);
+
+// 单调递增的时间，不记录的请求返回 0，不读取时钟
+FOUNDATION_STATIC_INLINE uint64_t SDWebImageTraceTimestamp(SDWebImageTraceID traceID) {
+    return traceID ? mach_absolute_time() : 0;
+}
+
+// 记录从 start 到现在的一段时间
+FOUNDATION_STATIC_INLINE void SDWebImageTraceEnd(SDWebImageTraceID traceID, SDWebImageTraceSpan span, uint64_t start) {
+    if (traceID) {
+        SDWebImageTraceRecord(traceID, span, start, mach_absolute_time());
+    }
+}
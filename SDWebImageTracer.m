@@ -0,0 +1,160 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import "SDWebImageTracer.h"
+#import <stdatomic.h>
+
+// 缓冲区的大小，2 的幂，用位运算取下标
+#define SDTraceBufferCapacity 16384
+// 正在写入的记录的 sequence，写入的序号不会到达这个值
+#define SDTraceEntryBusy UINT64_MAX
+
+// 一条记录，sequence 是写入的序号 + 1，0 表示还没有写入，SDTraceEntryBusy 表示正在写入
+// 读取时前后两次读到相同的 sequence 才说明中间读到的内容是完整的
+typedef struct {
+    atomic_uint_fast64_t sequence;
+    atomic_uint_fast64_t traceID;
+    atomic_uint_fast64_t start;
+    atomic_uint_fast64_t end;
+    atomic_uint_fast32_t span;
+} SDTraceEntry;
+
+static SDTraceEntry SDTraceEntries[SDTraceBufferCapacity];
+// 下一条记录的序号，一直递增
+static atomic_uint_fast64_t SDTraceNextIndex;
+static atomic_uint_fast64_t SDTraceNextID;
+static atomic_bool SDTraceEnabled;
+static __thread SDWebImageTraceID SDTraceCurrentID;
+
+static NSString *const SDTraceSpanNames[] = {
+    [SDWebImageTraceSpanMemoryLookup] = @"memory lookup",
+    [SDWebImageTraceSpanDiskQueryWait] = @"disk query wait",
+    [SDWebImageTraceSpanDiskRead] = @"disk read",
+    [SDWebImageTraceSpanDecode] = @"decode",
+    [SDWebImageTraceSpanDownloadQueueWait] = @"download queue wait",
+    [SDWebImageTraceSpanTimeToFirstByte] = @"connect + TTFB",
+    [SDWebImageTraceSpanTransfer] = @"transfer",
+    [SDWebImageTraceSpanTransform] = @"transform",
+    [SDWebImageTraceSpanStore] = @"store",
+    [SDWebImageTraceSpanDelivery] = @"delivery",
+};
+
+SDWebImageTraceID SDWebImageTraceBegin(void) {
+    if (!atomic_load_explicit(&SDTraceEnabled, memory_order_relaxed)) {
+        return 0;
+    }
+    return atomic_fetch_add_explicit(&SDTraceNextID, 1, memory_order_relaxed) + 1;
+}
+
+SDWebImageTraceID SDWebImageTraceCurrentID(void) {
+    return SDTraceCurrentID;
+}
+
+SDWebImageTraceID SDWebImageTraceSetCurrentID(SDWebImageTraceID traceID) {
+    SDWebImageTraceID previous = SDTraceCurrentID;
+    SDTraceCurrentID = traceID;
+    return previous;
+}
+
+void SDWebImageTraceRecord(SDWebImageTraceID traceID, SDWebImageTraceSpan span, uint64_t start, uint64_t end) {
+    if (!traceID) {
+        return;
+    }
+    uint64_t index = atomic_fetch_add_explicit(&SDTraceNextIndex, 1, memory_order_relaxed);
+    SDTraceEntry *entry = &SDTraceEntries[index & (SDTraceBufferCapacity - 1)];
+    // 绕了一圈之后可能有两个线程同时写同一个位置，两边的字段交错写入会留下一条 sequence 有效但内容混在一起的记录
+    // 先把 sequence 换成 SDTraceEntryBusy 占住这个位置，已经有线程在写时丢弃这一条
+    uint64_t sequence = atomic_load_explicit(&entry->sequence, memory_order_relaxed);
+    if (sequence == SDTraceEntryBusy ||
+        !atomic_compare_exchange_strong_explicit(&entry->sequence, &sequence, SDTraceEntryBusy, memory_order_relaxed, memory_order_relaxed)) {
+        return;
+    }
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&entry->traceID, traceID, memory_order_relaxed);
+    atomic_store_explicit(&entry->start, start, memory_order_relaxed);
+    atomic_store_explicit(&entry->end, end, memory_order_relaxed);
+    atomic_store_explicit(&entry->span, (uint_fast32_t)span, memory_order_relaxed);
+    atomic_store_explicit(&entry->sequence, index + 1, memory_order_release);
+}
+
+@implementation SDWebImageTracer
+
++ (SDWebImageTracer *)sharedTracer {
+    static dispatch_once_t once;
+    static id instance;
+    dispatch_once(&once, ^{
+        instance = [self new];
+    });
+    return instance;
+}
+
+- (BOOL)isEnabled {
+    return atomic_load_explicit(&SDTraceEnabled, memory_order_relaxed);
+}
+
+- (void)setEnabled:(BOOL)enabled {
+    atomic_store_explicit(&SDTraceEnabled, enabled, memory_order_relaxed);
+}
+
+- (NSData *)chromeTraceData {
+    mach_timebase_info_data_t timebase;
+    mach_timebase_info(&timebase);
+    // mach_absolute_time -> 微秒
+    double microsecondsPerTick = (double)timebase.numer / timebase.denom / 1000.0;
+
+    NSMutableArray *events = [NSMutableArray new];
+    NSMutableSet *traceIDs = [NSMutableSet new];
+    for (NSUInteger i = 0; i < SDTraceBufferCapacity; i++) {
+        SDTraceEntry *entry = &SDTraceEntries[i];
+        uint64_t sequence = atomic_load_explicit(&entry->sequence, memory_order_acquire);
+        if (sequence == 0 || sequence == SDTraceEntryBusy) {
+            continue;
+        }
+        uint64_t traceID = atomic_load_explicit(&entry->traceID, memory_order_relaxed);
+        uint64_t start = atomic_load_explicit(&entry->start, memory_order_relaxed);
+        uint64_t end = atomic_load_explicit(&entry->end, memory_order_relaxed);
+        uint_fast32_t span = atomic_load_explicit(&entry->span, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        // 读取的过程中被新的记录覆盖了
+        if (atomic_load_explicit(&entry->sequence, memory_order_relaxed) != sequence || span > SDWebImageTraceSpanDelivery) {
+            continue;
+        }
+
+        [traceIDs addObject:@(traceID)];
+        [events addObject:@{@"name": SDTraceSpanNames[span],
+                            @"cat": @"SDWebImage",
+                            @"ph": @"X",
+                            @"ts": @(start * microsecondsPerTick),
+                            @"dur": @((end > start ? end - start : 0) * microsecondsPerTick),
+                            @"pid": @0,
+                            @"tid": @(traceID)}];
+    }
+
+    // 每个请求一行，行名是请求的标识
+    for (NSNumber *traceID in traceIDs) {
+        [events addObject:@{@"name": @"thread_name",
+                            @"ph": @"M",
+                            @"pid": @0,
+                            @"tid": traceID,
+                            @"args": @{@"name": [NSString stringWithFormat:@"request %@", traceID]}}];
+    }
+
+    return [NSJSONSerialization dataWithJSONObject:@{@"traceEvents": events, @"displayTimeUnit": @"ms"} options:0 error:NULL];
+}
+
+- (void)clear {
+    for (NSUInteger i = 0; i < SDTraceBufferCapacity; i++) {
+        // 正在写入的记录不清除，否则另一个线程可以再次占住这个位置，和正在写的线程交错写入
+        uint64_t sequence = atomic_load_explicit(&SDTraceEntries[i].sequence, memory_order_relaxed);
+        if (sequence != SDTraceEntryBusy) {
+            atomic_compare_exchange_strong_explicit(&SDTraceEntries[i].sequence, &sequence, 0, memory_order_relaxed, memory_order_relaxed);
+        }
+    }
+}
+
+@end
@@ -0,0 +1,112 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import <Foundation/Foundation.h>
+#import "SDWebImageCompat.h"
+
+/**
+ *  声明式的图片 transform，附加在请求的 context 中 (SDWebImageManagerContextTransformerKey)
+ *  下载的图片解码之后马上在解码线程中执行，transform 之后的图片用单独的 key 缓存，下次直接命中，不需要再解码原图和重新 transform
+ *
+ *  transform 在后台线程中执行，实现必须是线程安全的
+ */
+@protocol SDWebImageTransformer <NSObject>
+
+/**
+ *  标识这个 transform 的字符串，参数相同的 transform 必须返回相同的 key，会拼接到缓存的 key 中
+ */
+@property (copy, nonatomic, readonly) NSString *transformerKey;
+
+/**
+ *  传入的图片已经按 shouldBakeImageOrientation 旋转过；返回的新图片当作已经解压缩的位图，不会再重绘一次
+ *  不需要 transform 时可以原样返回传入的图片，这时仍然按 shouldDecompressImages 解压缩
+ *
+ *  @return transform 之后的图片，失败时返回 nil
+ */
+- (UIImage *)transformedImageWithImage:(UIImage *)image;
+
+@end
+
+/**
+ *  transform 之后的图片在缓存中的 key
+ *
+ *  @param key            原图的 key
+ *  @param transformerKey transform 的 key
+ */
+extern NSString *SDTransformedKeyForKey(NSString *key, NSString *transformerKey);
+
+/**
+ *  按顺序执行多个 transform，key 是各个 transform 的 key 按顺序拼接起来
+ */
+@interface SDWebImagePipelineTransformer : NSObject <SDWebImageTransformer>
+
+@property (copy, nonatomic, readonly) NSArray *transformers;
+
++ (instancetype)transformerWithTransformers:(NSArray *)transformers;
+
+@end
+
+typedef NS_ENUM(NSInteger, SDWebImageScaleMode) {
+    /**
+     *  拉伸填满目标大小
+     */
+    SDWebImageScaleModeFill,
+    /**
+     *  保持比例，完整显示在目标大小之内
+     */
+    SDWebImageScaleModeAspectFit,
+    /**
+     *  保持比例，填满目标大小，超出的部分居中裁掉
+     */
+    SDWebImageScaleModeAspectFill
+};
+
+/**
+ *  缩放到指定大小 (in points，scale 和原图一致)
+ */
+@interface SDWebImageResizingTransformer : NSObject <SDWebImageTransformer>
+
+@property (assign, nonatomic, readonly) CGSize size;
+@property (assign, nonatomic, readonly) SDWebImageScaleMode scaleMode;
+
++ (instancetype)transformerWithSize:(CGSize)size scaleMode:(SDWebImageScaleMode)scaleMode;
+
+@end
+
+/**
+ *  裁剪出指定的区域 (in points)
+ */
+@interface SDWebImageCroppingTransformer : NSObject <SDWebImageTransformer>
+
+@property (assign, nonatomic, readonly) CGRect rect;
+
++ (instancetype)transformerWithRect:(CGRect)rect;
+
+@end
+
+/**
+ *  圆角，角以外的部分是透明的
+ */
+@interface SDWebImageRoundCornerTransformer : NSObject <SDWebImageTransformer>
+
+@property (assign, nonatomic, readonly) CGFloat cornerRadius;
+
++ (instancetype)transformerWithCornerRadius:(CGFloat)cornerRadius;
+
+@end
+
+/**
+ *  用颜色着色，保留原图的 alpha
+ */
+@interface SDWebImageTintTransformer : NSObject <SDWebImageTransformer>
+
+@property (strong, nonatomic, readonly) UIColor *tintColor;
+
++ (instancetype)transformerWithColor:(UIColor *)tintColor;
+
+@end
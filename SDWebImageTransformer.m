@@ -0,0 +1,189 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import "SDWebImageTransformer.h"
+
+NSString *SDTransformedKeyForKey(NSString *key, NSString *transformerKey) {
+    if (!key || transformerKey.length == 0) {
+        return key;
+    }
+    return [NSString stringWithFormat:@"%@-SDTransform(%@)", key, transformerKey];
+}
+
+/**
+ *  在 size 大小 (in points) 的画布中绘制，返回和原图 scale 相同的图片
+ *  UIKit 的绘图函数从 iOS 4 开始是线程安全的；drawInRect: 会处理图片的方向，绘制之后的图片方向都是 Up
+ */
+static UIImage *SDDrawnImage(UIImage *image, CGSize size, BOOL opaque, void (^drawBlock)(CGContextRef context)) {
+    if (!image || size.width <= 0 || size.height <= 0) {
+        return nil;
+    }
+    UIGraphicsBeginImageContextWithOptions(size, opaque, image.scale);
+    CGContextRef context = UIGraphicsGetCurrentContext();
+    if (!context) {
+        UIGraphicsEndImageContext();
+        return nil;
+    }
+    drawBlock(context);
+    UIImage *drawnImage = UIGraphicsGetImageFromCurrentImageContext();
+    UIGraphicsEndImageContext();
+    return drawnImage;
+}
+
+// 图片是否有透明通道，没有时可以画在不透明的画布上
+static BOOL SDImageHasAlpha(UIImage *image) {
+    CGImageAlphaInfo alphaInfo = CGImageGetAlphaInfo(image.CGImage);
+    return !(alphaInfo == kCGImageAlphaNone ||
+             alphaInfo == kCGImageAlphaNoneSkipFirst ||
+             alphaInfo == kCGImageAlphaNoneSkipLast);
+}
+
+@implementation SDWebImagePipelineTransformer
+
+@synthesize transformerKey = _transformerKey;
+
++ (instancetype)transformerWithTransformers:(NSArray *)transformers {
+    SDWebImagePipelineTransformer *transformer = [self new];
+    transformer->_transformers = [transformers copy];
+    NSMutableArray *keys = [NSMutableArray arrayWithCapacity:transformers.count];
+    for (id<SDWebImageTransformer> t in transformers) {
+        [keys addObject:t.transformerKey];
+    }
+    transformer->_transformerKey = [keys componentsJoinedByString:@"|"];
+    return transformer;
+}
+
+- (UIImage *)transformedImageWithImage:(UIImage *)image {
+    UIImage *transformedImage = image;
+    for (id<SDWebImageTransformer> transformer in self.transformers) {
+        transformedImage = [transformer transformedImageWithImage:transformedImage];
+        if (!transformedImage) {
+            break;
+        }
+    }
+    return transformedImage;
+}
+
+@end
+
+@implementation SDWebImageResizingTransformer
+
++ (instancetype)transformerWithSize:(CGSize)size scaleMode:(SDWebImageScaleMode)scaleMode {
+    SDWebImageResizingTransformer *transformer = [self new];
+    transformer->_size = size;
+    transformer->_scaleMode = scaleMode;
+    return transformer;
+}
+
+- (NSString *)transformerKey {
+    return [NSString stringWithFormat:@"Resize(%gx%g,%ld)", self.size.width, self.size.height, (long)self.scaleMode];
+}
+
+- (UIImage *)transformedImageWithImage:(UIImage *)image {
+    CGSize size = self.size;
+    CGSize imageSize = image.size;
+    if (imageSize.width <= 0 || imageSize.height <= 0) {
+        return nil;
+    }
+
+    CGRect drawRect = (CGRect){CGPointZero, size};
+    if (self.scaleMode != SDWebImageScaleModeFill) {
+        CGFloat xScale = size.width / imageSize.width;
+        CGFloat yScale = size.height / imageSize.height;
+        CGFloat scale = self.scaleMode == SDWebImageScaleModeAspectFit ? MIN(xScale, yScale) : MAX(xScale, yScale);
+        CGSize scaledSize = CGSizeMake(imageSize.width * scale, imageSize.height * scale);
+        if (self.scaleMode == SDWebImageScaleModeAspectFit) {
+            // 完整显示时画布就是缩放之后的大小，不留空白
+            size = scaledSize;
+            drawRect.size = scaledSize;
+        }
+        else {
+            drawRect = CGRectMake((size.width - scaledSize.width) / 2, (size.height - scaledSize.height) / 2, scaledSize.width, scaledSize.height);
+        }
+    }
+
+    return SDDrawnImage(image, size, !SDImageHasAlpha(image), ^(CGContextRef context) {
+        CGContextSetInterpolationQuality(context, kCGInterpolationHigh);
+        [image drawInRect:drawRect];
+    });
+}
+
+@end
+
+@implementation SDWebImageCroppingTransformer
+
++ (instancetype)transformerWithRect:(CGRect)rect {
+    SDWebImageCroppingTransformer *transformer = [self new];
+    transformer->_rect = rect;
+    return transformer;
+}
+
+- (NSString *)transformerKey {
+    return [NSString stringWithFormat:@"Crop(%g,%g,%gx%g)", self.rect.origin.x, self.rect.origin.y, self.rect.size.width, self.rect.size.height];
+}
+
+- (UIImage *)transformedImageWithImage:(UIImage *)image {
+    CGRect rect = CGRectIntersection(self.rect, (CGRect){CGPointZero, image.size});
+    if (CGRectIsEmpty(rect)) {
+        return nil;
+    }
+    return SDDrawnImage(image, rect.size, !SDImageHasAlpha(image), ^(CGContextRef context) {
+        [image drawAtPoint:CGPointMake(-rect.origin.x, -rect.origin.y)];
+    });
+}
+
+@end
+
+@implementation SDWebImageRoundCornerTransformer
+
++ (instancetype)transformerWithCornerRadius:(CGFloat)cornerRadius {
+    SDWebImageRoundCornerTransformer *transformer = [self new];
+    transformer->_cornerRadius = cornerRadius;
+    return transformer;
+}
+
+- (NSString *)transformerKey {
+    return [NSString stringWithFormat:@"RoundCorner(%g)", self.cornerRadius];
+}
+
+- (UIImage *)transformedImageWithImage:(UIImage *)image {
+    CGRect rect = (CGRect){CGPointZero, image.size};
+    return SDDrawnImage(image, rect.size, NO, ^(CGContextRef context) {
+        [[UIBezierPath bezierPathWithRoundedRect:rect cornerRadius:self.cornerRadius] addClip];
+        [image drawInRect:rect];
+    });
+}
+
+@end
+
+@implementation SDWebImageTintTransformer
+
++ (instancetype)transformerWithColor:(UIColor *)tintColor {
+    SDWebImageTintTransformer *transformer = [self new];
+    transformer->_tintColor = tintColor;
+    return transformer;
+}
+
+- (NSString *)transformerKey {
+    CGFloat red = 0, green = 0, blue = 0, alpha = 0;
+    [self.tintColor getRed:&red green:&green blue:&blue alpha:&alpha];
+    return [NSString stringWithFormat:@"Tint(%g,%g,%g,%g)", red, green, blue, alpha];
+}
+
+- (UIImage *)transformedImageWithImage:(UIImage *)image {
+    CGRect rect = (CGRect){CGPointZero, image.size};
+    return SDDrawnImage(image, rect.size, !SDImageHasAlpha(image), ^(CGContextRef context) {
+        [image drawInRect:rect];
+        // 只在图片不透明的地方着色
+        CGContextSetBlendMode(context, kCGBlendModeSourceAtop);
+        [self.tintColor setFill];
+        CGContextFillRect(context, rect);
+    });
+}
+
+@end